@@ -0,0 +1,282 @@
+#!/usr/bin/env python3
+# --------------------------------------------------------------
+#
+#                        fcbench.py
+#
+#        Loopback throughput benchmark for fileclient/fileserver.
+#
+#        Builds fixed corpora (SRC texts, files of numbers made with
+#        makedatafile, and a mixed one with the largest file in front
+#        of many of the smallest), then for every combination of
+#        corpus, network nastiness, file nastiness and client schedule
+#        starts a fileserver, copies the corpus with a fileclient over
+#        loopback and reads the --metrics lines both programs write.
+#        Each run becomes one JSON object:
+#
+#            mb_per_s, files_per_s       whole-run throughput
+#            file_p50_ms, file_p99_ms    per-file time on the client
+#            completion_mean_ms,         time from the start of the run
+#            completion_p99_ms           to each file being done
+#            retransmit_ratio            client resends per packet
+#            server_retransmit_ratio     server lost requests per packet
+#            failed, mismatched          end-to-end failures, and
+#                                        target files that differ
+#
+#        Results go to stdout (or --output) as a JSON list. With
+#        --baseline the results are compared with a saved run and
+#        the script exits 1 if throughput drops or p99 latency grows
+#        by more than --threshold; --save-baseline writes one.
+#
+#        Usage: see --help. "make bench" runs the default sweep.
+#
+# --------------------------------------------------------------
+
+import argparse
+import filecmp
+import json
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+LINE_BYTES = 71      # one makedatafile line: ten 6-wide numbers, spaces, newline
+
+
+def parse_list(text):
+    return [int(x) for x in text.split(",") if x != ""]
+
+
+def build_corpora(work, counts, sizes):
+    """Creates the corpora under work/corpora, once. Returns name -> dir."""
+
+    corpora = {}
+    root = os.path.join(work, "corpora")
+
+    texts = os.path.join(root, "texts")
+    if not os.path.isdir(texts):
+        shutil.copytree(os.path.join(HERE, "SRC"), texts)
+    corpora["texts"] = texts
+
+    for count in counts:
+        for size in sizes:
+            name = "numbers-%dx%d" % (count, size)
+            path = os.path.join(root, name)
+            corpora[name] = path
+            if os.path.isdir(path):
+                continue
+            os.makedirs(path + ".part")
+            lines = max(1, size // LINE_BYTES)
+            sample = os.path.join(path + ".part", "f0")
+            subprocess.run([os.path.join(HERE, "makedatafile"), sample, str(lines)],
+                           check=True, stdout=subprocess.DEVNULL)
+            for i in range(1, count):
+                shutil.copyfile(sample, os.path.join(path + ".part", "f%d" % i))
+            os.rename(path + ".part", path)
+
+    # One large file among many small ones, which it can hold up
+    if len(sizes) > 1:
+        small, large, count = min(sizes), max(sizes), max(counts)
+        path = os.path.join(root, "mixed-1x%d+%dx%d" % (large, count, small))
+        corpora[os.path.basename(path)] = path
+        if not os.path.isdir(path):
+            os.makedirs(path + ".part")
+            for name, size in (("a-large", large), ("f0", small)):
+                subprocess.run([os.path.join(HERE, "makedatafile"), os.path.join(path + ".part", name),
+                                str(max(1, size // LINE_BYTES))], check=True, stdout=subprocess.DEVNULL)
+            for i in range(1, count):
+                shutil.copyfile(os.path.join(path + ".part", "f0"), os.path.join(path + ".part", "f%d" % i))
+            os.rename(path + ".part", path)
+    return corpora
+
+
+def read_metrics(path):
+    files, run = [], None
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                record = json.loads(line)
+                if record["event"] == "file":
+                    files.append(record)
+                elif record["event"] == "run":
+                    run = record
+    return files, run
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p * len(values)))]
+
+
+def count_mismatched(source, target):
+    mismatched = 0
+    for dirpath, _, names in os.walk(source):
+        for name in names:
+            src = os.path.join(dirpath, name)
+            dst = os.path.join(target, os.path.relpath(src, source))
+            if not os.path.exists(dst) or not filecmp.cmp(src, dst, shallow=False):
+                mismatched += 1
+    return mismatched
+
+
+def run_one(work, corpus, source, network, filenasty, schedule, args):
+    """Copies one corpus once and returns its result object."""
+
+    rundir = os.path.join(work, "runs", "%s-n%d-f%d-%s" % (corpus, network, filenasty, schedule))
+    shutil.rmtree(rundir, ignore_errors=True)
+    target = os.path.join(rundir, "target")
+    os.makedirs(target)
+
+    server = subprocess.Popen(
+        [os.path.join(HERE, "fileserver"), str(network), str(filenasty), target,
+         "--metrics=" + os.path.join(rundir, "server.jsonl")] + args.server_args,
+        cwd=rundir, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+
+    started = time.time()
+    try:
+        client = subprocess.run(
+            [os.path.join(HERE, "fileclient"), args.server, str(network), str(filenasty), source,
+             "--metrics=" + os.path.join(rundir, "client.jsonl"), "--schedule=" + schedule]
+            + args.client_args,
+            cwd=rundir, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+            timeout=args.timeout)
+        status = client.returncode
+    except subprocess.TimeoutExpired:
+        status = "timeout"
+    elapsed = time.time() - started
+
+    # The server writes its run line when stopped
+    server.send_signal(signal.SIGTERM)
+    try:
+        server.wait(timeout=10)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.wait()
+
+    files, run = read_metrics(os.path.join(rundir, "client.jsonl"))
+    _, server_run = read_metrics(os.path.join(rundir, "server.jsonl"))
+    durations = [f["duration_us"] / 1000.0 for f in files]
+    total_bytes = sum(os.path.getsize(os.path.join(d, n))
+                      for d, _, names in os.walk(source) for n in names)
+    total_files = sum(len(names) for _, _, names in os.walk(source))
+
+    completion = run["completion_us"] if run else {"mean": 0, "p99": 0}
+
+    def ratio(record):
+        if record is None or record["packets"] == 0:
+            return 0.0
+        return round(record["retransmits"] / record["packets"], 4)
+
+    return {
+        "corpus": corpus,
+        "network_nastiness": network,
+        "file_nastiness": filenasty,
+        "schedule": schedule,
+        "files": total_files,
+        "bytes": total_bytes,
+        "status": status,
+        "seconds": round(elapsed, 3),
+        "mb_per_s": round(total_bytes / elapsed / 1e6, 6),
+        "files_per_s": round(total_files / elapsed, 3),
+        "file_p50_ms": round(percentile(durations, 0.50), 3),
+        "file_p99_ms": round(percentile(durations, 0.99), 3),
+        "completion_mean_ms": round(completion["mean"] / 1000.0, 3),
+        "completion_p99_ms": round(completion["p99"] / 1000.0, 3),
+        "retransmit_ratio": ratio(run),
+        "server_retransmit_ratio": ratio(server_run),
+        "failed": run["failed"] if run else total_files,
+        "mismatched": count_mismatched(source, target),
+    }
+
+
+def compare(results, baseline, threshold):
+    """Returns a list of regressions against the baseline runs."""
+
+    def key(r):
+        return (r["corpus"], r["network_nastiness"], r["file_nastiness"], r.get("schedule", "walk"))
+
+    old = {key(r): r for r in baseline}
+    problems = []
+    for r in results:
+        b = old.get(key(r))
+        if b is None:
+            continue
+        if r["status"] != 0:
+            problems.append("%s: client status %s" % (key(r), r["status"]))
+        if r["mb_per_s"] < b["mb_per_s"] * (1 - threshold):
+            problems.append("%s: %.3f MB/s, baseline %.3f" % (key(r), r["mb_per_s"], b["mb_per_s"]))
+        if r["file_p99_ms"] > b["file_p99_ms"] * (1 + threshold):
+            problems.append("%s: p99 %.1f ms, baseline %.1f" % (key(r), r["file_p99_ms"], b["file_p99_ms"]))
+        if r["mismatched"] > b["mismatched"]:
+            problems.append("%s: %d files differ, baseline %d" % (key(r), r["mismatched"], b["mismatched"]))
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Loopback benchmark for fileclient/fileserver")
+    parser.add_argument("--work", default=os.path.join(HERE, "benchwork"),
+                        help="where corpora and run directories go")
+    parser.add_argument("--counts", default="1,100", help="file counts of the numbers corpora")
+    parser.add_argument("--sizes", default="2000,400000", help="file sizes in bytes of the numbers corpora")
+    parser.add_argument("--network", default="0,1", help="network nastiness levels")
+    parser.add_argument("--file", default="0", help="file nastiness levels")
+    parser.add_argument("--schedule", default="walk",
+                        help="client schedules to compare: walk, shortest, largest, fair")
+    parser.add_argument("--server", default="localhost", help="server name given to the client")
+    parser.add_argument("--timeout", type=int, default=600, help="seconds allowed per run")
+    parser.add_argument("--client-args", default="", help="extra fileclient options")
+    parser.add_argument("--server-args", default="", help="extra fileserver options")
+    parser.add_argument("--output", help="write the results here instead of stdout")
+    parser.add_argument("--baseline", help="compare with the results saved in this file")
+    parser.add_argument("--save-baseline", help="save the results to this file as the baseline")
+    parser.add_argument("--threshold", type=float, default=0.2,
+                        help="allowed fraction of throughput loss or p99 growth")
+    args = parser.parse_args()
+    args.client_args = args.client_args.split()
+    args.server_args = args.server_args.split()
+
+    corpora = build_corpora(args.work, parse_list(args.counts), parse_list(args.sizes))
+
+    results = []
+    for corpus, source in sorted(corpora.items()):
+        for network in parse_list(args.network):
+            for filenasty in parse_list(args.file):
+                for schedule in args.schedule.split(","):
+                    result = run_one(args.work, corpus, source, network, filenasty, schedule, args)
+                    print("%-24s n%d f%d %-8s %8.3f MB/s %8.1f files/s  p99 %8.1f ms"
+                          "  done mean %8.1f p99 %8.1f ms  mismatched %d"
+                          % (corpus, network, filenasty, schedule, result["mb_per_s"],
+                             result["files_per_s"], result["file_p99_ms"], result["completion_mean_ms"],
+                             result["completion_p99_ms"], result["mismatched"]), file=sys.stderr)
+                    results.append(result)
+
+    text = json.dumps(results, indent=1)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+    if args.save_baseline:
+        with open(args.save_baseline, "w") as f:
+            f.write(text + "\n")
+
+    if args.baseline:
+        if not os.path.exists(args.baseline):
+            print("No baseline at %s, run make bench-baseline first" % args.baseline, file=sys.stderr)
+            return 0
+        with open(args.baseline) as f:
+            problems = compare(results, json.load(f), args.threshold)
+        for p in problems:
+            print("REGRESSION " + p, file=sys.stderr)
+        return 1 if problems else 0
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
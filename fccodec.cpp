@@ -0,0 +1,127 @@
+// --------------------------------------------------------------
+//
+//                        fccodec.cpp
+//
+//        Allocation free packet codec for both programs.
+//        See fccodec.h for the interface.
+//
+// --------------------------------------------------------------
+
+#include "fccodec.h"
+#include "fchash.h"
+#include <string.h>
+
+using namespace std;
+
+#define DATA_FCP '9'  // as in fileclient.cpp and fileserver.cpp
+#define ZERO_FCP 'Z'
+
+void PacketPool::reset(size_t newCount, size_t newStride) {
+
+    //The last message's '\0' may run past its slot
+    if (slots.size() < newCount * newStride + 1)
+        slots.resize(newCount * newStride + 1);
+    if (lengths.size() < newCount)
+        lengths.resize(newCount);
+    count = newCount;
+    stride = newStride;
+}
+
+PacketPool& packetPool() {
+    thread_local PacketPool pool;
+    return pool;
+}
+
+void putNumber(char *out, long n, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        out[i] = '0' + n % 10;
+        n /= 10;
+    }
+}
+
+long getNumber(const char *in, int width) {
+    long n = 0;
+    for (int i = 0; i < width; i++) {
+        if (in[i] < '0' or in[i] > '9')
+            return -1;
+        n = n * 10 + (in[i] - '0');
+    }
+    return n;
+}
+
+int numPacketsFile(long fsize) {
+    return (int) ((fsize + MAX_DATA_SIZE - 2) / (MAX_DATA_SIZE - 1));
+}
+
+size_t encodeData(char *buf, const char *fileNameHash, long packetNum, size_t dataLen) {
+
+    size_t len = DATA_HEADER_SIZE + dataLen;
+
+    buf[0] = DATA_FCP;
+    memcpy(buf + DATA_HASH_OFFSET, fileNameHash, DIGEST_HEX_LENGTH);
+    putNumber(buf + DATA_NUM_OFFSET, packetNum, NUMBER_WIDTH);
+    dataChecksum(buf + DATA_HASH_OFFSET, len - DATA_HASH_OFFSET, buf + 1);
+    buf[len] = '\0';
+    return len;
+}
+
+size_t encodeZeroRange(char *buf, const char *fileNameHash, long firstPacket, long lastPacket) {
+
+    putNumber(buf + DATA_HEADER_SIZE, lastPacket, NUMBER_WIDTH);
+    buf[DATA_HEADER_SIZE + NUMBER_WIDTH] = ZERO_FCP;
+    size_t len = encodeData(buf, fileNameHash, firstPacket, NUMBER_WIDTH + 1);
+    buf[0] = ZERO_FCP;
+    return len;
+}
+
+/* glibc's memcmp is vectorized whatever this file is compiled with, and
+ * comparing the buffer with itself one byte on needs no zero block.
+ */
+
+bool allZero(const char *buf, size_t len) {
+    return len == 0 or (buf[0] == 0 and memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+size_t encodeReply(char *buf, char code, long packetNum, const char *fileNameHash) {
+
+    size_t len = 0;
+
+    buf[len++] = code;
+    if (packetNum >= 0) {
+        putNumber(buf + len, packetNum, NUMBER_WIDTH);
+        len += NUMBER_WIDTH;
+    }
+    memcpy(buf + len, fileNameHash, DIGEST_HEX_LENGTH);
+    len += DIGEST_HEX_LENGTH;
+    buf[len] = '\0';
+    return len;
+}
+
+bool decodeData(const char *msg, size_t len, struct dataView& view) {
+
+    if (len < DATA_HEADER_SIZE or msg[0] != DATA_FCP)
+        return false;
+
+    view.packetNum = getNumber(msg + DATA_NUM_OFFSET, NUMBER_WIDTH);
+    if (view.packetNum < 0)
+        return false;
+    view.fileNameHash = msg + DATA_HASH_OFFSET;
+    view.data = msg + DATA_HEADER_SIZE;
+    view.dataLen = len - DATA_HEADER_SIZE;
+    return true;
+}
+
+bool decodeZeroRange(const char *msg, size_t len, struct dataView& view, long& lastPacket) {
+
+    if (len != DATA_HEADER_SIZE + NUMBER_WIDTH + 1 or msg[0] != ZERO_FCP or msg[len - 1] != ZERO_FCP)
+        return false;
+
+    view.packetNum = getNumber(msg + DATA_NUM_OFFSET, NUMBER_WIDTH);
+    lastPacket = getNumber(msg + DATA_HEADER_SIZE, NUMBER_WIDTH);
+    if (view.packetNum < 1 or lastPacket < view.packetNum)
+        return false;
+    view.fileNameHash = msg + DATA_HASH_OFFSET;
+    view.data = NULL;
+    view.dataLen = 0;
+    return true;
+}
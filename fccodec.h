@@ -0,0 +1,112 @@
+// --------------------------------------------------------------
+//
+//                        fccodec.h
+//
+//        Encoding and decoding of the messages sent once per
+//        packet: data packets, zero ranges standing in for packets
+//        that hold nothing but zero bytes, and the PKT_LOST, PKT_DONE
+//        and NEED_START replies to them.
+//
+//        Nothing here touches the heap. Messages are written into
+//        buffers the caller owns, usually the slots of a PacketPool
+//        that is reused from file to file, and parsed in place in
+//        the receive buffer. Numbers are fixed width, zero padded
+//        decimal, as everywhere else in the protocol.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCCODEC_H_INCLUDED__
+#define __FCCODEC_H_INCLUDED__
+
+#include "fcpacket.h"
+#include <vector>
+#include <stddef.h>
+
+#define NUMBER_WIDTH 16     // packet numbers, counts and sizes
+
+//
+// Room for a file's worth of encoded messages, one MAX_PACKET_SIZE
+// slot per packet, kept so the next file can reuse the memory
+//
+class PacketPool {
+public:
+    // Make room for count messages, growing only past the largest
+    // file seen so far. A stride of DATA_MESSAGE_SIZE packs full data
+    // messages back to back, for sends that take many at once; they
+    // must then be encoded in order, as each one's '\0' is overwritten
+    // by the next.
+    void reset(size_t count, size_t stride = MAX_PACKET_SIZE);
+
+    char *slot(size_t i) { return &slots[i * stride]; }
+    size_t& length(size_t i) { return lengths[i]; }
+    size_t size() const { return count; }
+
+private:
+    std::vector<char> slots;
+    std::vector<size_t> lengths;
+    size_t count = 0;
+    size_t stride = MAX_PACKET_SIZE;
+};
+
+// The calling thread's pool
+PacketPool& packetPool();
+
+// n as exactly width digits
+void putNumber(char *out, long n, int width);
+
+// The width digits at in, or -1 if any is not a digit
+long getNumber(const char *in, int width);
+
+// Packets needed to send fsize bytes, 0 for an empty file
+int numPacketsFile(long fsize);
+
+//
+// Fills in the header and checksum of a data message whose dataLen
+// bytes of data are already at buf + DATA_HEADER_SIZE. Returns the
+// message length; a NUL follows the message for the debug log.
+//
+size_t encodeData(char *buf, const char *fileNameHash, long packetNum, size_t dataLen);
+
+//
+// A run of packets, firstPacket to lastPacket, that are all zero bytes
+// and are not sent. Laid out as a data message of type ZERO_FCP for
+// firstPacket whose data is lastPacket followed by the type again, so
+// the checksum covers both and dataMessageIntact applies. Returns the
+// message length; a NUL follows it.
+//
+size_t encodeZeroRange(char *buf, const char *fileNameHash, long firstPacket, long lastPacket);
+
+// True if all len bytes at buf are zero
+bool allZero(const char *buf, size_t len);
+
+//
+// code, then the packet number unless packetNum is negative, then the
+// filename hash. Returns the length, not counting the NUL after it.
+//
+size_t encodeReply(char *buf, char code, long packetNum, const char *fileNameHash);
+
+//
+// A data message as it sits in the receive buffer
+//
+struct dataView {
+    const char *fileNameHash;   // DIGEST_HEX_LENGTH characters
+    long packetNum;
+    const char *data;
+    size_t dataLen;
+};
+
+//
+// Parses a data message in place. Returns false if msg is not a data
+// message or its header is malformed. The checksum is not looked at;
+// see dataMessageIntact in fchash.h.
+//
+bool decodeData(const char *msg, size_t len, struct dataView& view);
+
+//
+// Parses a zero range in place: view.packetNum is its first packet,
+// lastPacket its last. Returns false if msg is not a zero range or is
+// malformed; as for data, the checksum is not looked at.
+//
+bool decodeZeroRange(const char *msg, size_t len, struct dataView& view, long& lastPacket);
+
+#endif
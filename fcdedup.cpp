@@ -0,0 +1,77 @@
+// --------------------------------------------------------------
+//
+//                        fcdedup.cpp
+//
+//        Content-addressed index of received files.
+//        See fcdedup.h for the interface.
+//
+// --------------------------------------------------------------
+
+#include "fcdedup.h"
+#include "fchash.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+using namespace std;
+
+#define DEDUP_MAX_ENTRIES 65536   // the index is cleared when it grows past this
+
+void ContentIndex::add(string digest, const struct digestAlgorithm *alg, string path) {
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return;
+    if (entries.size() >= DEDUP_MAX_ENTRIES)
+        entries.clear();
+    entries[string(digestName(alg)) + ":" + digest] = {path, st.st_dev, st.st_ino, st.st_size, st.st_mtim};
+}
+
+string ContentIndex::find(string digest, const struct digestAlgorithm *alg) {
+
+    auto e = entries.find(string(digestName(alg)) + ":" + digest);
+    if (e == entries.end())
+        return "";
+
+    struct stat st;
+    const struct entry& known = e -> second;
+    if (stat(known.path.c_str(), &st) != 0 or st.st_dev != known.dev or st.st_ino != known.ino or
+            st.st_size != known.size or st.st_mtim.tv_sec != known.mtime.tv_sec or
+            st.st_mtim.tv_nsec != known.mtime.tv_nsec) {
+        entries.erase(e);
+        return "";
+    }
+    return known.path;
+}
+
+bool ContentIndex::materialize(string from, string to) {
+
+    string tmp = to + ".tmp";
+    unlink(tmp.c_str());
+
+    //A reflink is a copy of its own, sharing blocks only until written
+    bool made = false;
+    int in = open(from.c_str(), O_RDONLY);
+    if (in >= 0) {
+        int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out >= 0) {
+            made = ioctl(out, FICLONE, in) == 0;
+            close(out);
+            if (!made)
+                unlink(tmp.c_str());
+        }
+        close(in);
+    }
+    if (!made)
+        made = link(from.c_str(), tmp.c_str()) == 0;
+
+    //Renaming one link of a file over another does nothing, so what is
+    //left of tmp goes either way
+    if (made and rename(tmp.c_str(), to.c_str()) != 0)
+        made = false;
+    unlink(tmp.c_str());
+    return made;
+}
@@ -0,0 +1,62 @@
+// --------------------------------------------------------------
+//
+//                        fcdedup.h
+//
+//        The fileserver's content-addressed index of the files it
+//        has received, for copying the same contents under another
+//        name without receiving them again.
+//
+//        Each file that passes its end-to-end check is recorded by
+//        its full digest (with the name of the digest algorithm, as
+//        clients may pick different ones). A client about to send
+//        a file of DEDUP_MIN_BYTES or more asks first whether its
+//        digest is known; if it is, the server makes the new name
+//        from the file it already has and the data never crosses
+//        the network.
+//
+//        The new file is a reflink (FICLONE) of the old one where the
+//        filesystem can share blocks copy-on-write, otherwise a hard
+//        link. Either way it is made under the .tmp name and renamed
+//        into place, like a received file.
+//
+//        The index lives as long as the server. An entry is only used
+//        while its file still has the inode, size and modification
+//        time it had when it was recorded; one that changed, or was
+//        removed, is dropped on lookup.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCDEDUP_H_INCLUDED__
+#define __FCDEDUP_H_INCLUDED__
+
+#include "fchash.h"
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+#include <time.h>
+
+class ContentIndex {
+public:
+    // path has been written and checked good with digest, which is in
+    // hex and made with alg
+    void add(std::string digest, const struct digestAlgorithm *alg, std::string path);
+
+    // A file with digest's contents, unchanged since it was added, or ""
+    std::string find(std::string digest, const struct digestAlgorithm *alg);
+
+    // Make to, through to.tmp, with from's contents. Returns false,
+    // leaving nothing behind, if neither a reflink nor a link works.
+    static bool materialize(std::string from, std::string to);
+
+private:
+    struct entry {
+        std::string path;
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+    };
+    std::unordered_map<std::string, struct entry> entries;
+};
+
+#endif
@@ -0,0 +1,288 @@
+// --------------------------------------------------------------
+//
+//                        fcevent.cpp
+//
+//        epoll event loops and coroutine waits for the data flows.
+//        See fcevent.h for the interface.
+//
+// --------------------------------------------------------------
+
+#include "fcevent.h"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+
+#define EPOLL_BATCH 64            // events taken per epoll_wait
+#define QUEUE_MAX_MESSAGES 4096   // held by a MessageQueue before new ones are dropped
+
+static uint64_t nowMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+EventLoop::EventLoop() : stopping(false), nextTimer(1) {
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 or wakeFd < 0) {
+        perror("Could not create event loop");
+        exit(1);
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+}
+
+EventLoop::~EventLoop() {
+    close(wakeFd);
+    close(epollFd);
+}
+
+void EventLoop::watch(int fd, function<void()> onReadable) {
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    watchers[fd] = make_shared<function<void()>>(onReadable);
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        perror("Could not watch descriptor");
+}
+
+void EventLoop::unwatch(int fd) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+    watchers.erase(fd);
+}
+
+uint64_t EventLoop::after(long ms, function<void()> fn) {
+    uint64_t id = nextTimer++;
+    timers[id] = fn;
+    timerHeap.push(make_pair(nowMillis() + ms, id));
+    return id;
+}
+
+void EventLoop::cancel(uint64_t timer) {
+    timers.erase(timer);
+}
+
+void EventLoop::post(function<void()> fn) {
+    {
+        lock_guard<mutex> guard(postLock);
+        posted.push_back(fn);
+    }
+    wake();
+}
+
+void EventLoop::stop() {
+    stopping = true;
+    wake();
+}
+
+void EventLoop::wake() {
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0)
+        perror("Could not wake event loop");
+}
+
+/* Sleeps until the next timer is due at the latest. Callbacks are run
+ * through their own reference, so one that unwatches its descriptor
+ * does not destroy itself while running.
+ */
+
+void EventLoop::run() {
+
+    struct epoll_event events[EPOLL_BATCH];
+    while (!stopping) {
+        int timeout = -1;
+        while (!timerHeap.empty() and timers.count(timerHeap.top().second) == 0)
+            timerHeap.pop();
+        if (!timerHeap.empty()) {
+            uint64_t now = nowMillis();
+            uint64_t due = timerHeap.top().first;
+            timeout = due > now ? (int) (due - now) : 0;
+        }
+
+        int n = epoll_wait(epollFd, events, EPOLL_BATCH, timeout);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                uint64_t count;
+                while (read(wakeFd, &count, sizeof(count)) > 0)
+                    ;
+                continue;
+            }
+            auto w = watchers.find(fd);
+            if (w == watchers.end())
+                continue;
+            shared_ptr<function<void()>> callback = w -> second;
+            (*callback)();
+        }
+
+        runPosted();
+        runTimers();
+    }
+}
+
+void EventLoop::runPosted() {
+
+    vector<function<void()>> work;
+    {
+        lock_guard<mutex> guard(postLock);
+        work.swap(posted);
+    }
+    for (auto& fn : work)
+        fn();
+}
+
+void EventLoop::runTimers() {
+
+    uint64_t now = nowMillis();
+    while (!timerHeap.empty() and timerHeap.top().first <= now) {
+        uint64_t id = timerHeap.top().second;
+        timerHeap.pop();
+        auto t = timers.find(id);
+        if (t == timers.end())
+            continue;
+        function<void()> fn = move(t -> second);
+        timers.erase(t);
+        fn();
+    }
+}
+
+SocketWaiter::SocketWaiter(EventLoop *loop, int fd) : loop(loop), fd(fd), timer(0),
+        result(false), pending(false) {
+    loop -> watch(fd, [this]() { resume(true); });
+}
+
+SocketWaiter::~SocketWaiter() {
+    loop -> unwatch(fd);
+    if (timer != 0)
+        loop -> cancel(timer);
+}
+
+bool SocketWaiter::awaiter::await_ready() {
+    if (!waiter -> pending)
+        return false;
+    waiter -> pending = false;
+    waiter -> result = true;
+    return true;
+}
+
+void SocketWaiter::awaiter::await_suspend(coroutine_handle<> h) {
+    waiter -> waiting = h;
+    waiter -> timer = waiter -> loop -> after(ms, [w = waiter]() {
+        w -> timer = 0;
+        w -> resume(false);
+    });
+}
+
+void SocketWaiter::wake() {
+    resume(false);
+}
+
+/* The coroutine may finish, and destroy this waiter, before resume()
+ * returns, so nothing here is touched after it.
+ */
+
+void SocketWaiter::resume(bool ready) {
+
+    if (!waiting) {
+        pending = pending or ready;
+        return;
+    }
+    if (timer != 0) {
+        loop -> cancel(timer);
+        timer = 0;
+    }
+    coroutine_handle<> h = waiting;
+    waiting = nullptr;
+    result = ready;
+    h.resume();
+}
+
+MessageQueue::MessageQueue(EventLoop *loop) : loop(loop), timer(0) {
+}
+
+MessageQueue::~MessageQueue() {
+    if (timer != 0)
+        loop -> cancel(timer);
+}
+
+void MessageQueue::awaiter::await_suspend(coroutine_handle<> h) {
+    queue -> waiting = h;
+    queue -> timer = queue -> loop -> after(ms, [q = queue]() {
+        q -> timer = 0;
+        q -> resume();
+    });
+}
+
+/* A full queue drops the message, as a full socket buffer would, and
+ * whoever sent it sends it again.
+ */
+
+void MessageQueue::push(const char *msg, size_t len) {
+    if (messages.size() >= QUEUE_MAX_MESSAGES)
+        return;
+    messages.push_back(string(msg, len));
+    if (waiting)
+        resume();
+}
+
+size_t MessageQueue::pop(char *buf, size_t len) {
+    if (messages.empty())
+        return 0;
+    size_t n = min(len, messages.front().length());
+    memcpy(buf, messages.front().data(), n);
+    messages.pop_front();
+    return n;
+}
+
+/* As in SocketWaiter::resume, the coroutine may destroy this queue before
+ * resume() returns.
+ */
+
+void MessageQueue::resume() {
+
+    if (timer != 0) {
+        loop -> cancel(timer);
+        timer = 0;
+    }
+    coroutine_handle<> h = waiting;
+    waiting = nullptr;
+    h.resume();
+}
+
+EventLoopPool::EventLoopPool(int numThreads) : nextLoop(0) {
+
+    if (numThreads < 1)
+        numThreads = 1;
+    for (int i = 0; i < numThreads; i++) {
+        EventLoop *loop = new EventLoop();
+        loops.push_back(loop);
+        threads.push_back(thread(&EventLoop::run, loop));
+    }
+}
+
+EventLoopPool::~EventLoopPool() {
+    for (auto loop : loops)
+        loop -> stop();
+    for (auto& t : threads)
+        t.join();
+    for (auto loop : loops)
+        delete loop;
+}
+
+EventLoop *EventLoopPool::next() {
+    return loops[nextLoop++ % loops.size()];
+}
@@ -0,0 +1,272 @@
+// --------------------------------------------------------------
+//
+//                        fcevent.h
+//
+//        Event loops, and coroutines run on them, for the UDP data
+//        flows of both programs.
+//
+//        Each loop belongs to one thread. It sleeps in epoll_wait
+//        until one of its non-blocking descriptors is readable or
+//        its next timer is due, then runs the callbacks registered
+//        for them. Other threads hand work to a loop with post(),
+//        which wakes it through an eventfd. Timers are kept in a
+//        heap by due time. Cancelling a timer only forgets its
+//        callback, so a cancel costs nothing.
+//
+//        An EventLoopPool runs a few loops, each on its own thread,
+//        and hands them out in turn. The flows of a striped file then
+//        share a small, fixed number of threads instead of taking one
+//        each. The server's control socket has a loop of its own,
+//        which hands each message to the session of the client that
+//        sent it.
+//
+//        A flow's protocol is written as a C++20 coroutine (LoopTask)
+//        that reads like a blocking loop. It suspends on co_await
+//        SocketWaiter::readable() until a datagram arrives or a timeout
+//        passes, or on co_await sleepOn() to pace its sends, and the
+//        loop resumes it. A coroutine sharing a socket with others
+//        waits on co_await MessageQueue::next() instead, for the
+//        messages the loop has read for it. A suspended flow costs one
+//        coroutine frame, not a thread and its stack. A coroutine that
+//        needs the result of another awaits it as a LoopCall, so the
+//        client's per-file protocol is a tree of them under one task.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCEVENT_H_INCLUDED__
+#define __FCEVENT_H_INCLUDED__
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+
+    //
+    // These four are for the loop's own thread: from callbacks, or
+    // from work handed over with post()
+    //
+
+    // Make fd non-blocking and call onReadable whenever it has data
+    void watch(int fd, std::function<void()> onReadable);
+    void unwatch(int fd);
+
+    // Call fn once, ms milliseconds from now. Returns an id for cancel.
+    uint64_t after(long ms, std::function<void()> fn);
+    void cancel(uint64_t timer);
+
+    // Any thread: run fn on the loop's thread
+    void post(std::function<void()> fn);
+
+    // Run callbacks until stop() is called from any thread
+    void run();
+    void stop();
+
+private:
+    void wake();
+    void runPosted();
+    void runTimers();
+
+    int epollFd;
+    int wakeFd;
+    std::atomic<bool> stopping;
+
+    std::unordered_map<int, std::shared_ptr<std::function<void()>>> watchers;
+
+    typedef std::pair<uint64_t, uint64_t> timerKey;   // due (ms), id
+    std::priority_queue<timerKey, std::vector<timerKey>, std::greater<timerKey>> timerHeap;
+    std::unordered_map<uint64_t, std::function<void()>> timers;
+    uint64_t nextTimer;
+
+    std::mutex postLock;
+    std::vector<std::function<void()>> posted;
+};
+
+//
+// A coroutine run on an event loop. Calling it (on the loop's thread)
+// runs it up to its first co_await; its frame is freed when it returns.
+// Nothing waits for it, so it must report its own end.
+//
+struct LoopTask {
+    struct promise_type {
+        LoopTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+//
+// A coroutine whose result another coroutine on the same loop waits
+// for. Calling it runs it up to its first co_await, like a LoopTask;
+// co_await on the LoopCall then gives its co_return value, or rethrows
+// what it threw, resuming the caller as soon as it returns. Several
+// can be started before any is awaited, and run side by side. Its
+// frame lives as long as the LoopCall.
+//
+template <typename T>
+class LoopCall {
+public:
+    struct promise_type {
+        T value{};
+        std::exception_ptr error;
+        std::coroutine_handle<> caller;   // null until awaited
+        bool finished = false;
+
+        LoopCall get_return_object() {
+            return LoopCall(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        struct finalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                h.promise().finished = true;
+                if (h.promise().caller)
+                    return h.promise().caller;
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        finalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    LoopCall(LoopCall&& other) noexcept : h(other.h) { other.h = nullptr; }
+    LoopCall(const LoopCall&) = delete;
+    ~LoopCall() {
+        if (h)
+            h.destroy();
+    }
+
+    bool await_ready() { return h.promise().finished; }
+    void await_suspend(std::coroutine_handle<> caller) { h.promise().caller = caller; }
+    T await_resume() {
+        if (h.promise().error)
+            std::rethrow_exception(h.promise().error);
+        return std::move(h.promise().value);
+    }
+
+private:
+    explicit LoopCall(std::coroutine_handle<promise_type> h) : h(h) {}
+
+    std::coroutine_handle<promise_type> h;
+};
+
+//
+// Lets a coroutine on loop wait for fd to become readable. fd is
+// watched for as long as the waiter lives, which must be on the loop's
+// thread.
+//
+class SocketWaiter {
+public:
+    SocketWaiter(EventLoop *loop, int fd);
+    ~SocketWaiter();
+
+    struct awaiter {
+        SocketWaiter *waiter;
+        long ms;
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> h);
+        bool await_resume() { return waiter -> result; }
+    };
+
+    // co_await readable(ms) is true once fd has data, false after ms or
+    // once wake() is called. It may be true with nothing left to read.
+    awaiter readable(long ms) { return {this, ms}; }
+
+    // Resume the waiting coroutine at once, with false
+    void wake();
+
+private:
+    void resume(bool ready);
+
+    EventLoop *loop;
+    int fd;
+    std::coroutine_handle<> waiting;   // null unless suspended here
+    uint64_t timer;
+    bool result;
+    bool pending;                      // fd became readable while not waiting
+};
+
+//
+// Messages read by a loop's callbacks for one coroutine on the same
+// loop, oldest first. It lives on the loop's thread.
+//
+class MessageQueue {
+public:
+    MessageQueue(EventLoop *loop);
+    ~MessageQueue();
+
+    struct awaiter {
+        MessageQueue *queue;
+        long ms;
+
+        bool await_ready() { return !queue -> messages.empty(); }
+        void await_suspend(std::coroutine_handle<> h);
+        bool await_resume() { return !queue -> messages.empty(); }
+    };
+
+    // co_await next(ms) is true once a message is queued, false after ms
+    awaiter next(long ms) { return {this, ms}; }
+
+    // Queue a copy of msg, resuming the coroutine if it is waiting
+    void push(const char *msg, size_t len);
+
+    // Copy the oldest message into buf, at most len bytes, and drop it.
+    // Returns the bytes copied, 0 if nothing is queued.
+    size_t pop(char *buf, size_t len);
+
+private:
+    void resume();
+
+    EventLoop *loop;
+    std::deque<std::string> messages;
+    std::coroutine_handle<> waiting;   // null unless suspended here
+    uint64_t timer;
+};
+
+//
+// co_await sleepOn(loop, ms) resumes the coroutine on loop ms later
+//
+struct sleepOn {
+    EventLoop *loop;
+    long ms;
+
+    sleepOn(EventLoop *loop, long ms) : loop(loop), ms(ms) {}
+    bool await_ready() { return ms <= 0; }
+    void await_suspend(std::coroutine_handle<> h) { loop -> after(ms, [h]() { h.resume(); }); }
+    void await_resume() {}
+};
+
+class EventLoopPool {
+public:
+    EventLoopPool(int numThreads);
+    ~EventLoopPool();
+
+    // The loops in turn, so work spreads over the threads
+    EventLoop *next();
+
+private:
+    std::vector<EventLoop *> loops;
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> nextLoop;
+};
+
+#endif
@@ -0,0 +1,436 @@
+// --------------------------------------------------------------
+//
+//                        fchash.cpp
+//
+//        Digests, hex and CRC32C for both programs.
+//        See fchash.h for the interface.
+//
+// --------------------------------------------------------------
+
+#include "fchash.h"
+#include "fcpacket.h"
+#include "fcmetrics.h"
+#include "fcread.h"
+#include <sstream>
+#include <stdio.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <tmmintrin.h>
+#include <nmmintrin.h>
+#endif
+
+using namespace std;
+using namespace C150NETWORK;
+
+#define DIGEST_FILE_CHUNK 65536  // bytes read per fread when digesting a file
+
+struct digestAlgorithm {
+    const char *name;
+    const EVP_MD *(*md)();
+};
+
+static const struct digestAlgorithm algorithms[] = {
+    {"sha256",  EVP_sha256},
+    {"blake2b", EVP_blake2b512},
+    {"sha1",    EVP_sha1},
+};
+
+// SHA-1 until the two sides agree on something else
+static const struct digestAlgorithm *current = &algorithms[2];
+
+static const struct digestAlgorithm *orDefault(const struct digestAlgorithm *alg) {
+    return alg != NULL ? alg : current;
+}
+
+const struct digestAlgorithm *findDigest(string names) {
+
+    stringstream offered(names);
+    string name;
+    while (getline(offered, name, ',')) {
+        for (auto& alg : algorithms) {
+            if (name == alg.name)
+                return &alg;
+        }
+    }
+    return NULL;
+}
+
+string selectDigest(string names) {
+
+    const struct digestAlgorithm *alg = findDigest(names);
+    if (alg == NULL)
+        return "";
+    current = alg;
+    return alg -> name;
+}
+
+const char *digestName(const struct digestAlgorithm *alg) {
+    return orDefault(alg) -> name;
+}
+
+DigestStream::DigestStream(const struct digestAlgorithm *alg) {
+    ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, orDefault(alg) -> md(), NULL);
+}
+
+DigestStream::~DigestStream() {
+    EVP_MD_CTX_free(ctx);
+}
+
+void DigestStream::update(const void *data, size_t len) {
+    EVP_DigestUpdate(ctx, data, len);
+}
+
+/* Longer digests are cut to their first SHA_DIGEST_LENGTH bytes.
+ */
+
+struct digestValue DigestStream::finish() {
+
+    unsigned char full[EVP_MAX_MD_SIZE];
+    unsigned int fullLen = 0;
+    struct digestValue value;
+
+    EVP_DigestFinal_ex(ctx, full, &fullLen);
+    memcpy(value.bytes, full, SHA_DIGEST_LENGTH);
+    return value;
+}
+
+void DigestStream::reset(const struct digestAlgorithm *alg) {
+    EVP_DigestInit_ex(ctx, orDefault(alg) -> md(), NULL);
+}
+
+PrefixDigest::PrefixDigest() {
+    fd = -1;
+    fileSize = 0;
+    packetBytes = 1;
+    next = 0;
+    busy = false;
+    failed = true;
+    finished = false;
+}
+
+void PrefixDigest::start(int fileFd, long numPackets, long size, size_t bytes,
+                         const struct digestAlgorithm *alg) {
+
+    lock_guard<mutex> guard(lock);
+    stream.reset(alg);
+    done.assign(numPackets, false);
+    fd = fileFd;
+    fileSize = size;
+    packetBytes = bytes;
+    next = 0;
+    busy = false;
+    failed = fd < 0;
+    finished = false;
+}
+
+/* The thread that finds the prefix grown hashes it outside the lock, in
+ * DIGEST_FILE_CHUNK reads, then looks again in case other threads marked
+ * more packets meanwhile. Packets written twice are only hashed once.
+ */
+
+void PrefixDigest::written(long packetNum) {
+
+    unique_lock<mutex> guard(lock);
+    if (packetNum < 1 or packetNum > (long) done.size() or finished)
+        return;
+    done[packetNum - 1] = true;
+    if (busy)
+        return;
+
+    busy = true;
+    while (!failed) {
+        long end = next;
+        while (end < (long) done.size() and done[end])
+            end++;
+        if (end == next)
+            break;
+
+        off_t from = (off_t) (next * packetBytes);
+        off_t to = min((off_t) (end * packetBytes), (off_t) fileSize);
+        next = end;
+        guard.unlock();
+
+        uint64_t started = metricsNow();
+        unsigned char buffer[DIGEST_FILE_CHUNK];
+        bool ok = true;
+        while (from < to) {
+            ssize_t got = pread(fd, buffer, (size_t) min((off_t) sizeof(buffer), to - from), from);
+            if (got <= 0) {
+                ok = false;
+                break;
+            }
+            stream.update(buffer, got);
+            from += got;
+        }
+        threadMetrics().hashMicros += metricsNow() - started;
+
+        guard.lock();
+        if (!ok)
+            failed = true;
+    }
+    busy = false;
+}
+
+bool PrefixDigest::finish(struct digestValue& out) {
+
+    lock_guard<mutex> guard(lock);
+    if (failed or busy or next < (long) done.size())
+        return false;
+    if (!finished) {
+        value = stream.finish();
+        finished = true;
+    }
+    out = value;
+    return true;
+}
+
+struct digestValue digestOf(const void *data, size_t len, const struct digestAlgorithm *alg) {
+
+    unsigned char full[EVP_MAX_MD_SIZE];
+    unsigned int fullLen = 0;
+    struct digestValue value;
+
+    EVP_Digest(data, len, full, &fullLen, orDefault(alg) -> md(), NULL);
+    memcpy(value.bytes, full, SHA_DIGEST_LENGTH);
+    return value;
+}
+
+/* Streams the file through the digest a chunk at a time, so no file is
+ * ever held in memory whole. The reads are voted on, so file nastiness
+ * does not turn into a wrong digest.
+ */
+
+bool digestFile(const char *filename, int fileNasty, struct digestValue& out,
+                const struct digestAlgorithm *alg) {
+
+    uint64_t started = metricsNow();
+    ExtentReader reader(fileNasty);
+    if (!reader.open(filename)) {
+        perror("Cannot open file.");
+        return false;
+    }
+
+    DigestStream stream(alg);
+    char buffer[DIGEST_FILE_CHUNK];
+    size_t got;
+    while ((got = reader.read(buffer, sizeof(buffer))) > 0)
+        stream.update(buffer, got);
+    reader.close();
+
+    out = stream.finish();
+    threadMetrics().hashMicros += metricsNow() - started;
+    return true;
+}
+
+string nameHash(const char *filename, const struct digestAlgorithm *alg) {
+    return toHex(digestOf(filename, strlen(filename), alg)).str();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                        Hex
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static void hexEncodeScalar(const unsigned char *in, size_t len, char *out) {
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i]     = hexDigits[in[i] >> 4];
+        out[2 * i + 1] = hexDigits[in[i] & 0x0f];
+    }
+}
+
+static int hexNibble(char c) {
+    if (c >= '0' and c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' and c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static bool hexDecodeScalar(const char *in, size_t len, unsigned char *out) {
+    for (size_t i = 0; i < len; i++) {
+        int hi = hexNibble(in[2 * i]);
+        int lo = hexNibble(in[2 * i + 1]);
+        if (hi < 0 or lo < 0)
+            return false;
+        out[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
+#if defined(__x86_64__)
+/* Sixteen bytes at a time: split each byte into its two nibbles, look
+ * both up in the digit table with pshufb, then interleave them.
+ */
+
+__attribute__((target("ssse3")))
+static void hexEncodeSimd(const unsigned char *in, size_t len, char *out) {
+
+    const __m128i digits = _mm_loadu_si128((const __m128i *) hexDigits);
+    const __m128i low = _mm_set1_epi8(0x0f);
+
+    for (; len >= 16; in += 16, out += 32, len -= 16) {
+        __m128i v  = _mm_loadu_si128((const __m128i *) in);
+        __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), low));
+        __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, low));
+        _mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    hexEncodeScalar(in, len, out);
+}
+
+/* Value of each of sixteen hex characters, with bad set wherever one is
+ * not a hex digit. Bytes of 0x80 and up compare as negative, so they
+ * fall outside both ranges.
+ */
+
+__attribute__((target("ssse3")))
+static inline __m128i hexNibbles(__m128i c, __m128i& bad) {
+
+    __m128i isDigit  = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                     _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i lower    = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                     _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+    bad = _mm_or_si128(bad, _mm_andnot_si128(_mm_or_si128(isDigit, isLetter), _mm_set1_epi8(-1)));
+    return _mm_or_si128(_mm_and_si128(isDigit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                        _mm_and_si128(isLetter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+/* Thirty-two characters at a time. pmaddubsw with weights 16 and 1 joins
+ * each pair of nibbles into a byte value, and packuswb narrows them.
+ */
+
+__attribute__((target("ssse3")))
+static bool hexDecodeSimd(const char *in, size_t len, unsigned char *out) {
+
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    __m128i bad = _mm_setzero_si128();
+
+    for (; len >= 16; in += 32, out += 16, len -= 16) {
+        __m128i a = hexNibbles(_mm_loadu_si128((const __m128i *) in), bad);
+        __m128i b = hexNibbles(_mm_loadu_si128((const __m128i *) (in + 16)), bad);
+        _mm_storeu_si128((__m128i *) out,
+                         _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights)));
+    }
+    if (_mm_movemask_epi8(bad) != 0)
+        return false;
+    return hexDecodeScalar(in, len, out);
+}
+
+static bool cpuHasSsse3() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static bool haveSsse3 = cpuHasSsse3();
+#endif
+
+void hexEncode(const unsigned char *in, size_t len, char *out) {
+#if defined(__x86_64__)
+    if (haveSsse3)
+        return hexEncodeSimd(in, len, out);
+#endif
+    hexEncodeScalar(in, len, out);
+}
+
+bool hexDecode(const char *in, size_t len, unsigned char *out) {
+#if defined(__x86_64__)
+    if (haveSsse3)
+        return hexDecodeSimd(in, len, out);
+#endif
+    return hexDecodeScalar(in, len, out);
+}
+
+struct digestHex toHex(const struct digestValue& value) {
+    struct digestHex hex;
+    hexEncode(value.bytes, SHA_DIGEST_LENGTH, hex.text);
+    hex.text[DIGEST_HEX_LENGTH] = '\0';
+    return hex;
+}
+
+bool fromHex(const char *text, struct digestValue& value) {
+    return hexDecode(text, SHA_DIGEST_LENGTH, value.bytes);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                        CRC32C
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/* Bytewise table version, for CPUs without SSE4.2.
+ */
+
+static uint32_t crc32cTable(const unsigned char *p, size_t len) {
+
+    static uint32_t table[256];
+    static bool ready = false;
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            table[i] = c;
+        }
+        ready = true;
+    }
+
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+#if defined(__x86_64__)
+/* Eight bytes per crc32 instruction, then the tail a byte at a time.
+ */
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(const unsigned char *p, size_t len) {
+
+    uint64_t crc = 0xFFFFFFFF;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+    uint32_t crc32 = (uint32_t) crc;
+    while (len--)
+        crc32 = _mm_crc32_u8(crc32, *p++);
+    return crc32 ^ 0xFFFFFFFF;
+}
+#endif
+
+uint32_t crc32c(const void *data, size_t len) {
+
+#if defined(__x86_64__)
+    static bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware)
+        return crc32cHardware((const unsigned char *) data, len);
+#endif
+    return crc32cTable((const unsigned char *) data, len);
+}
+
+void dataChecksum(const char *body, size_t len, char *hex) {
+
+    uint32_t crc = crc32c(body, len);
+    unsigned char bigEndian[4] = {(unsigned char) (crc >> 24), (unsigned char) (crc >> 16),
+                                  (unsigned char) (crc >> 8), (unsigned char) crc};
+    hexEncode(bigEndian, 4, hex);
+}
+
+bool dataMessageIntact(const char *msg, size_t len) {
+
+    char hex[DATA_CRC_LENGTH];
+
+    if (len < DATA_HEADER_SIZE)
+        return false;
+    dataChecksum(msg + DATA_HASH_OFFSET, len - DATA_HASH_OFFSET, hex);
+    return memcmp(hex, msg + 1, DATA_CRC_LENGTH) == 0;
+}
@@ -0,0 +1,187 @@
+// --------------------------------------------------------------
+//
+//                        fchash.h
+//
+//        Hashing shared by the fileclient and fileserver.
+//
+//        The client offers a list of algorithms when it starts and
+//        the server picks the first one it knows; both sides then
+//        use it for the end-to-end file digests and the filename
+//        hashes. All go through OpenSSL's EVP interface, which uses
+//        the SHA extensions of the CPU where it has them.
+//
+//            sha256  - SHA-256, as fast as SHA-1 with SHA-NI
+//            blake2b - BLAKE2b-512, fastest without SHA-NI
+//            sha1    - SHA-1, what a peer that never negotiates uses
+//
+//        The client keeps its choice as the process default. The
+//        server, whose flow threads hash while the main thread
+//        negotiates, never changes the default: it keeps the
+//        algorithm a client picked with the client's session and
+//        passes it to every call below that takes one.
+//
+//        Digests go on the wire cut to SHA_DIGEST_LENGTH bytes (40
+//        hex characters) whatever the algorithm, so no message
+//        layout depends on the choice.
+//
+//        Digests are fixed size values that live on the stack and
+//        are compared as bytes; hex is only for the wire, through an
+//        SSSE3 encoder and decoder where the CPU has it.
+//
+//        Data packets carry a CRC32C of their own as well, so a
+//        damaged packet is caught before it is written. It uses the
+//        SSE4.2 crc32 instruction where the CPU has it.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCHASH_H_INCLUDED__
+#define __FCHASH_H_INCLUDED__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+// Offered by the client unless --hash says otherwise, best first
+#define DIGEST_PREFERENCES "sha256,blake2b,sha1"
+
+#define DIGEST_HEX_LENGTH (SHA_DIGEST_LENGTH * 2)
+
+//
+// A digest, cut to SHA_DIGEST_LENGTH bytes
+//
+struct digestValue {
+    unsigned char bytes[SHA_DIGEST_LENGTH];
+
+    bool operator==(const struct digestValue& other) const {
+        return memcmp(bytes, other.bytes, SHA_DIGEST_LENGTH) == 0;
+    }
+    bool operator!=(const struct digestValue& other) const {
+        return !(*this == other);
+    }
+};
+
+//
+// A digest as the NUL terminated hex text sent on the wire
+//
+struct digestHex {
+    char text[DIGEST_HEX_LENGTH + 1];
+
+    std::string str() const { return std::string(text, DIGEST_HEX_LENGTH); }
+};
+
+//
+// One of the supported algorithms. Wherever one is taken, NULL means
+// the default.
+//
+struct digestAlgorithm;
+
+// The first algorithm in names (comma separated) that is supported,
+// or NULL if there is none
+const struct digestAlgorithm *findDigest(std::string names);
+
+//
+// Picks the first algorithm in names (comma separated) that is
+// supported and makes it the default. Returns its name, or "" if none
+// is supported, leaving the default in place.
+//
+std::string selectDigest(std::string names);
+
+// Name of alg
+const char *digestName(const struct digestAlgorithm *alg = NULL);
+
+//
+// Digest of data handed over in pieces, with the algorithm given when
+// the stream was created or last reset
+//
+class DigestStream {
+public:
+    DigestStream(const struct digestAlgorithm *alg = NULL);
+    ~DigestStream();
+
+    void update(const void *data, size_t len);
+    struct digestValue finish();
+
+    // Starts over, with alg
+    void reset(const struct digestAlgorithm *alg = NULL);
+
+private:
+    EVP_MD_CTX *ctx;
+};
+
+//
+// Digest of a file being received out of order, kept up to date as
+// its packets are written so the end-to-end check need not read the
+// whole file again. written() is called once a packet is on disk;
+// whenever that extends the run of packets written from the start of
+// the file, the run is read back from fd (still in the page cache)
+// into the digest. Safe to call from several threads: one of them
+// hashes while the others only mark their packets.
+//
+class PrefixDigest {
+public:
+    PrefixDigest();
+
+    // Starts a file of numPackets packets of packetBytes bytes, the
+    // last one shorter, fileSize bytes in all, readable through fd,
+    // to be hashed with alg
+    void start(int fd, long numPackets, long fileSize, size_t packetBytes,
+               const struct digestAlgorithm *alg = NULL);
+
+    void written(long packetNum);
+
+    // Digest of the whole file, false unless every packet was hashed
+    bool finish(struct digestValue& out);
+
+private:
+    std::mutex lock;
+    DigestStream stream;
+    std::vector<bool> done;   // by packet number - 1
+    int fd;
+    long fileSize;
+    size_t packetBytes;
+    long next;                // first packet not yet hashed, from 0
+    bool busy;                // a thread is hashing
+    bool failed;
+    bool finished;
+    struct digestValue value;
+};
+
+// Digest of len bytes of data
+struct digestValue digestOf(const void *data, size_t len, const struct digestAlgorithm *alg = NULL);
+
+// Digest of a file read through a C150NastyFile with the given
+// nastiness, voting on each extent as fcread.h describes. Returns
+// false if the file cannot be opened.
+bool digestFile(const char *filename, int fileNasty, struct digestValue& out,
+                const struct digestAlgorithm *alg = NULL);
+
+// Filename hash that names a file in data and control messages
+std::string nameHash(const char *filename, const struct digestAlgorithm *alg = NULL);
+
+// Hex of len bytes into 2 * len characters, lower case, no NUL
+void hexEncode(const unsigned char *in, size_t len, char *out);
+
+// len bytes from 2 * len hex characters, false if any is not hex
+bool hexDecode(const char *in, size_t len, unsigned char *out);
+
+struct digestHex toHex(const struct digestValue& value);
+
+// Digest from DIGEST_HEX_LENGTH hex characters, false if not hex
+bool fromHex(const char *text, struct digestValue& value);
+
+// CRC32C (Castagnoli) of len bytes of data
+uint32_t crc32c(const void *data, size_t len);
+
+// Checksum field for a data message: CRC32C of the len bytes after the
+// field, as DATA_CRC_LENGTH hex characters written to hex
+void dataChecksum(const char *body, size_t len, char *hex);
+
+// True if the len byte data message msg matches its checksum field
+bool dataMessageIntact(const char *msg, size_t len);
+
+#endif
@@ -0,0 +1,175 @@
+// --------------------------------------------------------------
+//
+//                        fclog.cpp
+//
+//        Asynchronous application log.
+//        See fclog.h for the interface.
+//
+//        The ring is a bounded multi-producer queue: every slot has
+//        a sequence number saying whether it is free for the lap a
+//        producer is on or holds a record for the drain thread, so
+//        producers only contend on one compare-and-swap of the tail.
+//
+// --------------------------------------------------------------
+
+#include "fclog.h"
+#include <atomic>
+#include <thread>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+int fclogLevel = FCLOG_FILE;
+
+struct logRecord {
+    atomic<uint64_t> seq;   // lap + 1 once written, lap + ring size once read
+    struct timespec when;
+    const char *format;
+    long a, b;
+    int level;
+    size_t bodyLen;         // length of the whole body, not just the kept part
+    char body[FCLOG_BODY_MAX];
+};
+
+static struct logRecord ring[FCLOG_RING_SIZE];
+static atomic<uint64_t> ringTail(0);    // next position a producer takes
+static uint64_t ringHead = 0;           // next position to drain, drain thread only
+static atomic<uint64_t> dropped(0);
+
+static const char *programName = "";
+static FILE *output = NULL;
+static thread drainThread;
+static atomic<bool> stopping(false);
+
+static const char *levelNames[] = {"none", "file", "packet"};
+
+bool fclogSetLevel(const char *name) {
+
+    for (int i = FCLOG_NONE; i <= FCLOG_PACKET; i++) {
+        if (strcmp(name, levelNames[i]) == 0) {
+            fclogLevel = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Claims the next free slot and fills it in. Never blocks: if the drain
+ * thread is a whole ring behind, the record is dropped.
+ */
+
+void fclogRecord(int level, const char *format, long a, long b, const char *msg, size_t len) {
+
+    if (output == NULL)
+        return;
+
+    uint64_t pos = ringTail.load(memory_order_relaxed);
+    struct logRecord *r;
+    while (1) {
+        r = &ring[pos & (FCLOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t) r -> seq.load(memory_order_acquire) - (int64_t) pos;
+        if (diff == 0) {
+            if (ringTail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        } else {
+            pos = ringTail.load(memory_order_relaxed);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &r -> when);
+    r -> format = format;
+    r -> a = a;
+    r -> b = b;
+    r -> level = level;
+    r -> bodyLen = msg == NULL ? 0 : len;
+    if (msg != NULL)
+        memcpy(r -> body, msg, len < FCLOG_BODY_MAX ? len : FCLOG_BODY_MAX);
+    r -> seq.store(pos + 1, memory_order_release);
+}
+
+/* Formats one record as a line of the log file. Non-printing bytes of
+ * the body become '.', as cleanString does.
+ */
+
+static void writeRecord(struct logRecord *r) {
+
+    char text[256];
+    struct tm local;
+    localtime_r(&r -> when.tv_sec, &local);
+    int n = strftime(text, sizeof(text), "%H:%M:%S", &local);
+    n += snprintf(text + n, sizeof(text) - n, ".%06ld %s [%s] ", r -> when.tv_nsec / 1000,
+                  programName, levelNames[r -> level]);
+    snprintf(text + n, sizeof(text) - n, r -> format, r -> a, r -> b);
+    fputs(text, output);
+
+    if (r -> bodyLen > 0) {
+        size_t kept = r -> bodyLen < FCLOG_BODY_MAX ? r -> bodyLen : FCLOG_BODY_MAX;
+        char body[FCLOG_BODY_MAX + 1];
+        for (size_t i = 0; i < kept; i++)
+            body[i] = isprint((unsigned char) r -> body[i]) ? r -> body[i] : '.';
+        body[kept] = '\0';
+        fprintf(output, " \"%s\"%s", body, kept < r -> bodyLen ? "..." : "");
+    }
+    fputc('\n', output);
+}
+
+/* Drain thread: writes records in order as they become ready, and naps
+ * briefly when the ring is empty so producers never have to wake it.
+ */
+
+static void drain() {
+
+    while (1) {
+        struct logRecord *r = &ring[ringHead & (FCLOG_RING_SIZE - 1)];
+        if (r -> seq.load(memory_order_acquire) == ringHead + 1) {
+            writeRecord(r);
+            r -> seq.store(ringHead + FCLOG_RING_SIZE, memory_order_release);
+            ringHead++;
+            continue;
+        }
+
+        uint64_t lost = dropped.exchange(0, memory_order_relaxed);
+        if (lost > 0)
+            fprintf(output, "%s: %lu log records dropped, ring full\n", programName, (unsigned long) lost);
+        fflush(output);
+
+        //A record claimed but not yet filled in is waited for, so nothing
+        //queued before exit is lost
+        if (stopping and ringHead == ringTail.load(memory_order_acquire))
+            return;
+        usleep(stopping ? 100 : 2000);
+    }
+}
+
+static void fclogClose() {
+    stopping = true;
+    drainThread.join();
+    fclose(output);
+}
+
+void fclogOpen(const char *program, const char *path) {
+
+    if (fclogLevel == FCLOG_NONE)
+        return;
+
+    programName = program;
+    output = fopen(path, "w");
+    if (output == NULL) {
+        perror("Cannot open log file");
+        return;
+    }
+    for (uint64_t i = 0; i < FCLOG_RING_SIZE; i++)
+        ring[i].seq.store(i, memory_order_relaxed);
+
+    drainThread = thread(drain);
+    atexit(fclogClose);
+}
@@ -0,0 +1,71 @@
+// --------------------------------------------------------------
+//
+//                        fclog.h
+//
+//        Asynchronous application log for both programs.
+//
+//        A log call on the packet path copies a fixed-size binary
+//        record into a lock-free ring and returns: the format string
+//        is a literal kept by pointer, the numbers are stored as they
+//        are, and a message body is copied raw, up to a limit. A
+//        background thread drains the ring, formats the records,
+//        replaces non-printing bytes in the bodies and writes them
+//        to the log file. When the ring is full records are dropped
+//        and counted rather than making the sender wait.
+//
+//        Each call names a level. Calls above the level chosen at
+//        run time (--log=none|file|packet) cost one comparison, and
+//        calls above FCLOG_MAX_LEVEL are compiled out entirely, e.g.
+//        make CPPFLAGS+=-DFCLOG_MAX_LEVEL=1
+//
+//        The c150 library keeps writing its own log through
+//        c150debug; this log is for the programs' own messages.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCLOG_H_INCLUDED__
+#define __FCLOG_H_INCLUDED__
+
+#include <stddef.h>
+
+#define FCLOG_NONE   0   // nothing is logged
+#define FCLOG_FILE   1   // once or a few times per file
+#define FCLOG_PACKET 2   // once per datagram
+
+#ifndef FCLOG_MAX_LEVEL
+#define FCLOG_MAX_LEVEL FCLOG_PACKET
+#endif
+
+#define FCLOG_BODY_MAX 96      // bytes of a message body kept in a record
+#define FCLOG_RING_SIZE 4096   // records, a power of two
+
+extern int fclogLevel;   // set once at startup, before any thread starts
+
+//
+// format must be a string literal using at most two %ld, for a and b.
+// FCLOG_MSG also logs the first FCLOG_BODY_MAX bytes of msg.
+//
+#define FCLOG(level, format, a, b) \
+    do { if ((level) <= FCLOG_MAX_LEVEL and (level) <= fclogLevel) \
+        fclogRecord((level), (format), (long) (a), (long) (b), NULL, 0); } while (0)
+
+#define FCLOG_MSG(level, format, a, b, msg, len) \
+    do { if ((level) <= FCLOG_MAX_LEVEL and (level) <= fclogLevel) \
+        fclogRecord((level), (format), (long) (a), (long) (b), (msg), (len)); } while (0)
+
+//
+// Sets fclogLevel from its name ("none", "file" or "packet"). Returns
+// false if the name is unknown.
+//
+bool fclogSetLevel(const char *name);
+
+//
+// Starts the drain thread writing to path, unless the level is none.
+// The ring is drained and the file closed when the program exits.
+//
+void fclogOpen(const char *program, const char *path);
+
+// Queue a record, used through the macros above
+void fclogRecord(int level, const char *format, long a, long b, const char *msg, size_t len);
+
+#endif
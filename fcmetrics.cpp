@@ -0,0 +1,233 @@
+// --------------------------------------------------------------
+//
+//                        fcmetrics.cpp
+//
+//        Transfer metrics as JSON lines.
+//        See fcmetrics.h for the interface.
+//
+// --------------------------------------------------------------
+
+#include "fcmetrics.h"
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+static const char *programName = "";
+static FILE *output = NULL;
+
+static mutex metricsLock;                // guards everything below
+static struct transferMetrics flushed;   // from helper threads
+static struct transferMetrics runTotals;
+static uint64_t runStart = 0, runFiles = 0, runFailed = 0;
+static vector<uint64_t> runCompletions;  // of the good files, from runStart
+
+static thread_local struct transferMetrics current;
+static thread_local uint64_t fileStart;
+
+void latencyHistogram::record(uint64_t micros) {
+
+    int bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+    if (bucket >= METRICS_BUCKETS)
+        bucket = METRICS_BUCKETS - 1;
+    buckets[bucket]++;
+    count++;
+    if (micros > max)
+        max = micros;
+}
+
+void latencyHistogram::merge(const struct latencyHistogram& other) {
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+        buckets[i] += other.buckets[i];
+    count += other.count;
+    if (other.max > max)
+        max = other.max;
+}
+
+uint64_t latencyHistogram::percentile(double p) const {
+
+    uint64_t rank = (uint64_t) (p * count), seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            uint64_t edge = i == 0 ? 0 : (1ULL << i) - 1;
+            return edge < max ? edge : max;
+        }
+    }
+    return max;
+}
+
+void transferMetrics::merge(const struct transferMetrics& other) {
+    bytes       += other.bytes;
+    packets     += other.packets;
+    retransmits += other.retransmits;
+    corrupt     += other.corrupt;
+    duplicates  += other.duplicates;
+    timeouts    += other.timeouts;
+    hashMicros  += other.hashMicros;
+    rtt.merge(other.rtt);
+    diskWrite.merge(other.diskWrite);
+}
+
+uint64_t metricsNow() {
+    return chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void metricsOpen(const char *program, const char *path) {
+
+    lock_guard<mutex> guard(metricsLock);
+    programName = program;
+    output = fopen(path, "a");
+    if (output == NULL)
+        perror("Cannot open metrics file");
+    runStart = metricsNow();
+}
+
+struct transferMetrics& threadMetrics() {
+    return current;
+}
+
+void metricsFileStart() {
+    fileStart = metricsNow();
+}
+
+void metricsFlushThread() {
+    lock_guard<mutex> guard(metricsLock);
+    flushed.merge(current);
+    memset(&current, 0, sizeof(current));
+}
+
+/* Appends s to line as a JSON string.
+ */
+
+static void jsonString(string& line, const char *s) {
+
+    line += '"';
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' or c == '\\') {
+            line += '\\';
+            line += c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            line += escaped;
+        } else {
+            line += c;
+        }
+    }
+    line += '"';
+}
+
+static void jsonHistogram(string& line, const char *name, const struct latencyHistogram& h) {
+
+    char buf[160];
+    snprintf(buf, sizeof(buf), ",\"%s\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"max\":%llu}",
+             name, (unsigned long long) h.count, (unsigned long long) h.percentile(0.50),
+             (unsigned long long) h.percentile(0.99), (unsigned long long) h.max);
+    line += buf;
+}
+
+/* The fields common to file and run lines.
+ */
+
+static void jsonCounters(string& line, const struct transferMetrics& m, uint64_t micros) {
+
+    char buf[320];
+    snprintf(buf, sizeof(buf),
+             ",\"bytes\":%llu,\"packets\":%llu,\"retransmits\":%llu,\"corrupt\":%llu"
+             ",\"duplicates\":%llu,\"timeouts\":%llu,\"hash_us\":%llu,\"duration_us\":%llu",
+             (unsigned long long) m.bytes, (unsigned long long) m.packets,
+             (unsigned long long) m.retransmits, (unsigned long long) m.corrupt,
+             (unsigned long long) m.duplicates, (unsigned long long) m.timeouts,
+             (unsigned long long) m.hashMicros, (unsigned long long) micros);
+    line += buf;
+    jsonHistogram(line, "rtt_us", m.rtt);
+    jsonHistogram(line, "write_us", m.diskWrite);
+}
+
+/* Exact mean and percentiles of the completion times, which are sorted
+ * in place. There is one per file, few enough to keep them all.
+ */
+
+static void jsonCompletions(string& line, vector<uint64_t>& completions) {
+
+    uint64_t sum = 0;
+    for (uint64_t c : completions)
+        sum += c;
+    sort(completions.begin(), completions.end());
+    size_t count = completions.size();
+    auto at = [&](double p) {
+        return count == 0 ? 0 : (unsigned long long) completions[min(count - 1, (size_t) (p * count))];
+    };
+
+    char buf[200];
+    snprintf(buf, sizeof(buf), ",\"completion_us\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,"
+             "\"p99\":%llu,\"max\":%llu}",
+             (unsigned long long) count, (unsigned long long) (count == 0 ? 0 : sum / count),
+             at(0.50), at(0.99), count == 0 ? 0 : (unsigned long long) completions.back());
+    line += buf;
+}
+
+void metricsFileDone(const char *filename, bool ok) {
+
+    uint64_t now = metricsNow();
+    uint64_t micros = now - fileStart;
+
+    lock_guard<mutex> guard(metricsLock);
+    current.merge(flushed);
+    memset(&flushed, 0, sizeof(flushed));
+
+    runTotals.merge(current);
+    runFiles++;
+    if (!ok)
+        runFailed++;
+    else
+        runCompletions.push_back(now - runStart);
+
+    if (output != NULL) {
+        string line = "{\"program\":\"" + string(programName) + "\",\"event\":\"file\",\"file\":";
+        jsonString(line, filename);
+        line += ok ? ",\"ok\":true" : ",\"ok\":false";
+        jsonCounters(line, current, micros);
+        if (ok) {
+            char buf[48];
+            snprintf(buf, sizeof(buf), ",\"completion_us\":%llu", (unsigned long long) (now - runStart));
+            line += buf;
+        }
+        line += "}\n";
+        fputs(line.c_str(), output);
+        fflush(output);
+    }
+    memset(&current, 0, sizeof(current));
+    fileStart = metricsNow();
+}
+
+void metricsRunDone() {
+
+    lock_guard<mutex> guard(metricsLock);
+    uint64_t micros = metricsNow() - runStart;
+
+    if (output != NULL and runFiles > 0) {
+        char buf[96];
+        snprintf(buf, sizeof(buf), ",\"files\":%llu,\"failed\":%llu",
+                 (unsigned long long) runFiles, (unsigned long long) runFailed);
+        string line = "{\"program\":\"" + string(programName) + "\",\"event\":\"run\"" + buf;
+        jsonCounters(line, runTotals, micros);
+        jsonCompletions(line, runCompletions);
+        line += "}\n";
+        fputs(line.c_str(), output);
+        fflush(output);
+    }
+
+    memset(&runTotals, 0, sizeof(runTotals));
+    runFiles = runFailed = 0;
+    runCompletions.clear();
+    runStart = metricsNow();
+}
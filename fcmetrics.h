@@ -0,0 +1,88 @@
+// --------------------------------------------------------------
+//
+//                        fcmetrics.h
+//
+//        Per-file and per-run transfer metrics for both programs.
+//
+//        Counters and latency histograms live in a thread_local
+//        transferMetrics, so the hot path only bumps a field of its
+//        own thread's struct: no locks, no atomics, no formatting.
+//        When a file finishes its counters are written out as one
+//        JSON line and folded into the run totals, which get a line
+//        of their own when the run ends.
+//
+//        Threads that help with a file (the stripe flows) hand their
+//        counters over with metricsFlushThread before they exit, and
+//        they are added to whichever file finishes next.
+//
+//        Each good file also has its completion time, from the start
+//        of the run to the file being done: what someone waiting on
+//        the files sees, and what the client's schedules change. The
+//        run line gives their mean and exact tail.
+//
+//        Nothing is written unless a metrics file was given with
+//        --metrics=path.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCMETRICS_H_INCLUDED__
+#define __FCMETRICS_H_INCLUDED__
+
+#include <stdint.h>
+
+#define METRICS_BUCKETS 40   // powers of two of microseconds, up to ~6 days
+
+//
+// Latencies in microseconds, bucketed by powers of two. Percentiles
+// are reported as the upper edge of the bucket they fall in.
+//
+struct latencyHistogram {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+
+    void record(uint64_t micros);
+    void merge(const struct latencyHistogram& other);
+    uint64_t percentile(double p) const;
+};
+
+struct transferMetrics {
+    uint64_t bytes;         // data bytes sent, or received and written
+    uint64_t packets;       // data packets sent, or received and written
+    uint64_t retransmits;   // packets sent again, or asked for again
+    uint64_t corrupt;       // packets dropped for a bad checksum
+    uint64_t duplicates;    // packets that had already arrived
+    uint64_t timeouts;      // reads that timed out
+    uint64_t hashMicros;    // time spent on file digests
+    struct latencyHistogram rtt;        // request to reply, client side
+    struct latencyHistogram diskWrite;  // write to verified read-back
+
+    void merge(const struct transferMetrics& other);
+};
+
+// Microseconds on a monotonic clock
+uint64_t metricsNow();
+
+// Name the program in the output and start writing to path
+void metricsOpen(const char *program, const char *path);
+
+// The calling thread's counters for the file in progress
+struct transferMetrics& threadMetrics();
+
+// Start timing a file. Counters are not cleared: work done between
+// files, such as hashing files for a bundle, counts toward the next.
+void metricsFileStart();
+
+// Hand the calling thread's counters to the next file to finish
+void metricsFlushThread();
+
+//
+// Write the file's line, with the calling thread's counters and any
+// flushed ones, and add them to the run
+//
+void metricsFileDone(const char *filename, bool ok);
+
+// Write the run's line and start a new run
+void metricsRunDone();
+
+#endif
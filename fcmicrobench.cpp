@@ -0,0 +1,242 @@
+// --------------------------------------------------------------
+//
+//                        fcmicrobench.cpp
+//
+//        Microbenchmarks for the per-packet and per-file inner
+//        loops of fileclient and fileserver, without the network:
+//
+//            codec    - data message encode, decode + checksum check
+//            hash     - CRC32C, digest of a buffer, of a file name and
+//                       of a whole file, hex encode and decode
+//            packets  - numPacketsFile
+//            storage  - write, read back and verify of one packet
+//                       through each storage engine, with and without
+//                       the reorder buffer
+//
+//        Each benchmark repeats its operation until it has run for
+//        a while and reports ns/op, MB/s where the operation has a
+//        size, and heap allocations per op: every malloc and calloc,
+//        including those made by OpenSSL and operator new. Counting
+//        relies on glibc's __libc_malloc.
+//
+//        COMMAND LINE
+//
+//              fcmicrobench [tmpdir] [filter]
+//
+//        Files are created in tmpdir, default /dev/shm so the storage
+//        numbers are not disk bound. Only benchmarks whose name
+//        contains filter are run.
+//
+// --------------------------------------------------------------
+
+#include "fcpacket.h"
+#include "fchash.h"
+#include "fccodec.h"
+#include "fcstorage.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define MIN_BENCH_NANOS 300000000ULL   // run each benchmark at least this long
+#define BENCH_FILE_SIZE (16 << 20)     // bytes in the file digested whole
+#define STORAGE_SLOTS 65536            // packets in the storage target file
+
+static atomic<uint64_t> allocations(0);
+static volatile size_t sink;           // keeps results from being optimized away
+static const char *filter = "";
+
+extern "C" void *__libc_malloc(size_t n);
+extern "C" void *__libc_calloc(size_t count, size_t n);
+
+extern "C" void *malloc(size_t n) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t count, size_t n) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    return __libc_calloc(count, n);
+}
+
+static uint64_t nowNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Runs op(i) for i = 0, 1, ... doubling the count until one pass takes
+ * MIN_BENCH_NANOS, then reports that pass. bytesPerOp may be 0.
+ */
+
+template <typename Op>
+static void bench(const char *name, size_t bytesPerOp, Op op) {
+
+    if (strstr(name, filter) == NULL)
+        return;
+
+    for (uint64_t iters = 1; ; iters *= 2) {
+        uint64_t allocsBefore = allocations.load();
+        uint64_t started = nowNanos();
+        for (uint64_t i = 0; i < iters; i++)
+            op(i);
+        uint64_t elapsed = nowNanos() - started;
+        uint64_t allocs = allocations.load() - allocsBefore;
+
+        if (elapsed < MIN_BENCH_NANOS and iters < (1ULL << 40))
+            continue;
+
+        double nsPerOp = (double) elapsed / iters;
+        printf("%-32s %12.1f ns/op", name, nsPerOp);
+        if (bytesPerOp > 0)
+            printf(" %10.1f MB/s", bytesPerOp * 1e3 / nsPerOp);
+        else
+            printf(" %15s", "");
+        printf(" %8.2f allocs/op\n", (double) allocs / iters);
+        fflush(stdout);
+        return;
+    }
+}
+
+static void benchCodec() {
+
+    char fileNameHash[DIGEST_HEX_LENGTH + 1];
+    memset(fileNameHash, 'a', DIGEST_HEX_LENGTH);
+    fileNameHash[DIGEST_HEX_LENGTH] = '\0';
+
+    char buf[MAX_PACKET_SIZE];
+    size_t dataLen = MAX_DATA_SIZE - 1;
+    for (size_t i = 0; i < dataLen; i++)
+        buf[DATA_HEADER_SIZE + i] = (char) i;
+
+    bench("codec/encodeData", dataLen, [&](uint64_t i) {
+        sink = encodeData(buf, fileNameHash, i + 1, dataLen);
+    });
+
+    size_t len = encodeData(buf, fileNameHash, 1, dataLen);
+    struct dataView view;
+    bench("codec/decodeData+intact", dataLen, [&](uint64_t i) {
+        sink = decodeData(buf, len, view) and dataMessageIntact(buf, len);
+    });
+
+    char reply[MAX_PACKET_SIZE];
+    bench("codec/encodeReply", 0, [&](uint64_t i) {
+        sink = encodeReply(reply, '@', i + 1, fileNameHash);
+    });
+}
+
+static void benchHash(string tmpdir) {
+
+    vector<unsigned char> block(1 << 20);
+    for (size_t i = 0; i < block.size(); i++)
+        block[i] = (unsigned char) (i * 131);
+
+    bench("hash/crc32c 399B", MAX_DATA_SIZE - 1, [&](uint64_t i) {
+        sink = crc32c(block.data(), MAX_DATA_SIZE - 1);
+    });
+
+    bench("hash/crc32c 1MB", block.size(), [&](uint64_t i) {
+        sink = crc32c(block.data(), block.size());
+    });
+
+    bench("hash/digestOf 1MB", block.size(), [&](uint64_t i) {
+        sink = digestOf(block.data(), block.size()).bytes[0];
+    });
+
+    bench("hash/nameHash", 0, [&](uint64_t i) {
+        sink = nameHash("some/directory/warandpeace.txt").length();
+    });
+
+    struct digestValue value = digestOf(block.data(), block.size());
+    bench("hash/toHex", SHA_DIGEST_LENGTH, [&](uint64_t i) {
+        sink = toHex(value).text[0];
+    });
+
+    struct digestHex hex = toHex(value);
+    bench("hash/fromHex", DIGEST_HEX_LENGTH, [&](uint64_t i) {
+        sink = fromHex(hex.text, value);
+    });
+
+    string path = tmpdir + "/fcmicrobench.digest";
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL) {
+        perror("Cannot create benchmark file");
+        return;
+    }
+    for (int i = 0; i < BENCH_FILE_SIZE / (1 << 20); i++)
+        fwrite(block.data(), 1, block.size(), f);
+    fclose(f);
+
+    bench("hash/digestFile 16MB", BENCH_FILE_SIZE, [&](uint64_t i) {
+        sink = digestFile(path.c_str(), 0, value);
+    });
+    unlink(path.c_str());
+}
+
+static void benchPackets() {
+    bench("packets/numPacketsFile", 0, [&](uint64_t i) {
+        sink = numPacketsFile((long) i * 7919);
+    });
+}
+
+static void benchStorage(string tmpdir, const char *engineName, size_t reorderBytes) {
+
+    StorageEngine *engine = newStorageEngine(engineName, 0, reorderBytes);
+    string name = string("storage/") + engine -> name() + (reorderBytes ? "+reorder" : "") +
+            " write+verify";
+    if (strstr(name.c_str(), filter) == NULL) {
+        delete engine;
+        return;
+    }
+
+    string path = tmpdir + "/fcmicrobench.storage";
+    size_t dataLen = MAX_DATA_SIZE - 1;
+    int fd = engine -> open(path, (long) STORAGE_SLOTS * dataLen);
+    vector<char> data(dataLen, 'x');
+    vector<struct writeDone> done;
+    done.reserve(STORAGE_SLOTS);
+
+    bench(name.c_str(), dataLen, [&](uint64_t i) {
+        int slot = i % STORAGE_SLOTS;
+        engine -> write(fd, slot + 1, (off_t) slot * dataLen, data.data(), dataLen);
+        engine -> reap(done, false);
+        done.clear();
+    });
+
+    engine -> reap(done, true);
+    engine -> close(fd);
+    delete engine;
+    unlink(path.c_str());
+}
+
+int main(int argc, char *argv[]) {
+
+    struct stat st;
+    string tmpdir = stat("/dev/shm", &st) == 0 ? "/dev/shm" : "/tmp";
+    if (argc > 1)
+        tmpdir = argv[1];
+    if (argc > 2)
+        filter = argv[2];
+    if (argc > 3) {
+        fprintf(stderr, "Correct syntax is: %s [tmpdir] [filter]\n", argv[0]);
+        exit(1);
+    }
+
+    selectDigest(DIGEST_PREFERENCES);
+    printf("digest %s, files in %s\n", digestName(), tmpdir.c_str());
+
+    benchCodec();
+    benchHash(tmpdir);
+    benchPackets();
+    benchStorage(tmpdir, "sync", 0);
+    benchStorage(tmpdir, "uring", 0);
+    benchStorage(tmpdir, "sync", REORDER_DEFAULT_BYTES);
+    benchStorage(tmpdir, "uring", REORDER_DEFAULT_BYTES);
+    return 0;
+}
@@ -1,20 +1,69 @@
+#ifndef __FCPACKET_H_INCLUDED__
+#define __FCPACKET_H_INCLUDED__
+
 #include <openssl/sha.h>
 #include <iostream>
 
 #define MAX_FILE_NAME 460
 #define MAX_DATA_SIZE 400
+#define MAX_PACKET_SIZE 512
+
+//
+// Data message layout: type, CRC32C of the rest in hex, filename hash,
+// packet number, data
+//
+#define DATA_CRC_LENGTH  8
+#define DATA_HASH_OFFSET (1 + DATA_CRC_LENGTH)
+#define DATA_NUM_OFFSET  (DATA_HASH_OFFSET + SHA_DIGEST_LENGTH * 2)
+#define DATA_HEADER_SIZE (DATA_NUM_OFFSET + 16)
+#define DATA_MESSAGE_SIZE (DATA_HEADER_SIZE + MAX_DATA_SIZE - 1)  // a full one
+
+//
+// Bundles of small files. The per-file statuses in the bundle reply have
+// to fit in one packet, which bounds the number of files.
+//
+#define BUNDLE_PREFIX    ".fcbundle."
+#define BUNDLE_MAX_FILE  16384     // default largest file that is bundled
+#define BUNDLE_MAX_FILES 256
+#define BUNDLE_MAX_BYTES 1048576
+
+//
+// Striping one large file across several UDP flows
+//
+#define STRIPE_MIN_BYTES   4194304 // smaller files use a single flow
+#define STRIPE_MAX         16      // most flows a server will open per file
+#define STRIPE_IDLE_ROUNDS 10      // 1 second timeouts before a flow gives up
+#define STRIPE_LOST_WINDOW 128     // most packets asked for per timeout
+
+//
+// The server's clients, each with a session of its own
+//
+#define CONTROL_READ_MS      10    // read timeout once a datagram has arrived
+#define CLIENT_IDLE_ROUNDS   300   // 1 second timeouts before a file is dropped
+#define SESSION_IDLE_SECONDS 600   // quiet time before a client is forgotten
+#define LANES_MAX            64    // most files a client sends at once, a session each
+
+//
+// Asking the server for a file's contents by digest before sending it.
+// The extra round trip only pays off for files of a few packets or more.
+//
+#define DEDUP_MIN_BYTES 16384
 
 struct initialPacket {
 	char packetType = '8';               // 1
 	char checksum[SHA_DIGEST_LENGTH * 2]; // 40
     char numPackets[16];			      // 4
+    char fileSize[16];                    // 16
+    char fileDigest[SHA_DIGEST_LENGTH * 2]; // 40, START_FCP only
 	char filename[MAX_FILE_NAME];
 };
 
 struct dataPacket {
 	std::string packetType = "9";					  // 1 bytes
-	std::string checksum;     // 40 bytes
+	std::string checksum;     // 8 bytes, CRC32C of the fields below
     std::string fileNameHash; // 40 bytes
     std::string packetNum; 					  // 4 bytes
     std::string data;    			  // Up to 425 bytes
-};
\ No newline at end of file
+};
+
+#endif
@@ -0,0 +1,208 @@
+// --------------------------------------------------------------
+//
+//                        fcprotocoltest.cpp
+//
+//        Checks of how a running fileserver answers a client whose
+//        messages went missing. Each check plays the client's side
+//        of one file by hand, leaving out the message that was lost:
+//
+//            lost start - the start of a file that ends in zeros is
+//                         lost, so its data and its closing zero
+//                         range must both be answered with NEED_START
+//                         until the start is sent again
+//            retry      - the done reply for a file is lost and the
+//                         client times out and sends the file again;
+//                         the repeated start and its data must be
+//                         answered as done, not dropped
+//            sessions   - a second client sends a whole file while the
+//                         first one's is still open; each must be
+//                         received as if the other were not there
+//
+//        Every file must then pass its end-to-end check and match
+//        what was sent.
+//
+//        COMMAND LINE
+//
+//              fcprotocoltest <server> <targetdir>
+//
+//        The server must be running with no nastiness and writing to
+//        targetdir. Exits 0 if every check passes, 1 otherwise.
+//
+// --------------------------------------------------------------
+
+#include "c150dgmsocket.h"
+#include "fcpacket.h"
+#include "fccodec.h"
+#include "fchash.h"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+
+using namespace C150NETWORK;
+using namespace std;
+
+#define START_FCP  'S'
+#define ZERO_FCP   'Z'
+#define PKT_DONE   '!'
+#define NEED_START '?'
+#define REQ_CHK    '0'
+#define CHK_SUCC   '2'
+#define ACK_SUCC   '5'
+#define FIN_ACK    '7'
+
+#define TEST_READS 5        // replies read, a second apart, before giving up
+
+static int failures = 0;
+static const size_t packetLen = MAX_DATA_SIZE - 1;
+
+static void check(bool ok, const char *what) {
+    printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+//
+// A three packet file: two of data, then a short one of zeros that
+// the client sends as a zero range
+//
+struct testFile {
+    string name;
+    string hash;
+    string contents;
+    string digest;
+    char data2[MAX_PACKET_SIZE];
+    size_t data2Len;
+    char zeros3[MAX_PACKET_SIZE];
+    size_t zeros3Len;
+    string start;
+};
+
+static void makeFile(struct testFile& f, string name) {
+
+    f.name = name;
+    f.hash = nameHash(name.c_str());
+    f.contents = string(packetLen, 'a') + string(packetLen, 'b') + string(100, '\0');
+    f.digest = toHex(digestOf(f.contents.data(), f.contents.length())).str();
+
+    memcpy(f.data2 + DATA_HEADER_SIZE, f.contents.data() + packetLen, packetLen);
+    f.data2Len = encodeData(f.data2, f.hash.c_str(), 2, packetLen);
+    f.zeros3Len = encodeZeroRange(f.zeros3, f.hash.c_str(), 3, 3);
+
+    char number[NUMBER_WIDTH];
+    string count, size, nameLen;
+    putNumber(number, numPacketsFile(f.contents.length()), NUMBER_WIDTH);
+    count.assign(number, NUMBER_WIDTH);
+    putNumber(number, f.contents.length(), NUMBER_WIDTH);
+    size.assign(number, NUMBER_WIDTH);
+    putNumber(number, name.length(), 3);
+    nameLen.assign(number, 3);
+    f.start = START_FCP + count + size + f.digest + nameLen + "1" + name + f.contents.substr(0, packetLen);
+}
+
+/* Reads replies until one starts with code and is followed by tail, or
+ * the server has been quiet too long. Returns true if one came.
+ */
+
+static bool awaitReply(C150DgmSocket *sock, char code, string tail) {
+
+    char reply[MAX_PACKET_SIZE];
+    for (int i = 0; i < TEST_READS; i++) {
+        ssize_t len = sock -> read(reply, sizeof(reply) - 1);
+        if (sock -> timedout())
+            continue;
+        reply[len] = '\0';
+        if (reply[0] == code and string(reply + 1).compare(0, string::npos, tail) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool exchange(C150DgmSocket *sock, const char *msg, size_t len, char code, string tail) {
+    sock -> write(msg, len);
+    return awaitReply(sock, code, tail);
+}
+
+/* Sends the start and the rest of the file, and waits for it to be done
+ */
+
+static bool sendWhole(C150DgmSocket *sock, struct testFile& f) {
+    sock -> write(f.start.data(), f.start.length());
+    sock -> write(f.data2, f.data2Len);
+    sock -> write(f.zeros3, f.zeros3Len);
+    return awaitReply(sock, PKT_DONE, f.hash);
+}
+
+/* Runs the end-to-end check and compares the file the server kept
+ */
+
+static bool finishFile(C150DgmSocket *sock, struct testFile& f, string targetDir) {
+
+    string request = REQ_CHK + f.digest + f.name;
+    string ack = ACK_SUCC + f.name;
+    if (!exchange(sock, request.data(), request.length(), CHK_SUCC, f.name) or
+            !exchange(sock, ack.data(), ack.length(), FIN_ACK, f.name))
+        return false;
+
+    ifstream kept(targetDir + "/" + f.name, ios::binary);
+    stringstream contents;
+    contents << kept.rdbuf();
+    return contents.str() == f.contents;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc != 3) {
+        fprintf(stderr, "Correct syntax is: %s <server> <targetdir>\n", argv[0]);
+        exit(1);
+    }
+
+    try {
+        C150DgmSocket *sock = new C150DgmSocket();
+        sock -> setServerName(argv[1]);
+        sock -> turnOnTimeouts(1000);
+
+        struct testFile lost;
+        makeFile(lost, "fcprotocoltest.loststart");
+        check(exchange(sock, lost.zeros3, lost.zeros3Len, NEED_START, lost.hash),
+              "lost start: a closing zero range asks for the start");
+        check(exchange(sock, lost.data2, lost.data2Len, NEED_START, lost.hash),
+              "lost start: data asks for the start");
+        check(sendWhole(sock, lost), "lost start: the file is done once started again");
+        check(finishFile(sock, lost, argv[2]), "lost start: the file passes its check");
+
+        //The done reply is read here, then taken as lost
+        struct testFile retry;
+        makeFile(retry, "fcprotocoltest.retry");
+        check(sendWhole(sock, retry), "retry: the first attempt is done");
+        check(exchange(sock, retry.start.data(), retry.start.length(), PKT_DONE, retry.hash),
+              "retry: the repeated start is answered as done");
+        check(exchange(sock, retry.data2, retry.data2Len, PKT_DONE, retry.hash),
+              "retry: its data is answered as done");
+        check(finishFile(sock, retry, argv[2]), "retry: the file passes its check");
+
+        //The first client's file is left one packet short until the end
+        C150DgmSocket *other = new C150DgmSocket();
+        other -> setServerName(argv[1]);
+        other -> turnOnTimeouts(1000);
+
+        struct testFile first, second;
+        makeFile(first, "fcprotocoltest.first");
+        makeFile(second, "fcprotocoltest.second");
+        sock -> write(first.start.data(), first.start.length());
+        sock -> write(first.data2, first.data2Len);
+        check(sendWhole(other, second), "sessions: a second client's file is done meanwhile");
+        check(finishFile(other, second, argv[2]), "sessions: the second client's file passes its check");
+        check(exchange(sock, first.zeros3, first.zeros3Len, PKT_DONE, first.hash),
+              "sessions: the first client's file is done after it");
+        check(finishFile(sock, first, argv[2]), "sessions: the first client's file passes its check");
+    }
+    catch (C150NetworkException& e) {
+        fprintf(stderr, "%s: caught C150NetworkException: %s\n", argv[0], e.formattedExplanation().c_str());
+        failures++;
+    }
+
+    printf("%s\n", failures == 0 ? "All checks passed" : "Some checks FAILED");
+    return failures == 0 ? 0 : 1;
+}
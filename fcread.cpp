@@ -0,0 +1,175 @@
+// --------------------------------------------------------------
+//
+//                        fcread.cpp
+//
+//        Voting extent reader for source files.
+//        See fcread.h for the interface.
+//
+// --------------------------------------------------------------
+
+#include "fcread.h"
+#include "fchash.h"
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits.h>
+
+using namespace std;
+using namespace C150NETWORK;
+
+ExtentReader::ExtentReader(int fileNasty) : file(fileNasty), position(0), extentStart(-1), extentLen(0),
+        fileEnd(0) {
+
+    if (fileNasty == 0)
+        agreeNeeded = 1;
+    else if (fileNasty < 3)
+        agreeNeeded = 2;
+    else
+        agreeNeeded = 3;
+    maxReads = agreeNeeded == 1 ? 1 : agreeNeeded * READ_VOTE_ROUNDS;
+    extent.resize(EXTENT_BYTES);
+
+    //fill() keeps pointers to candidates, so they must never move
+    candidates.reserve(maxReads);
+}
+
+ExtentReader::~ExtentReader() {
+    close();
+}
+
+bool ExtentReader::open(const char *path) {
+
+    close();
+    position = 0;
+    extentStart = -1;
+    if (file.fopen(path, "rb") == NULL)
+        return false;
+    findHoles(path);
+    return true;
+}
+
+/* The holes come from the file system, not through C150NastyFile, so
+ * there is nothing to vote on. A file system without SEEK_HOLE reports
+ * the whole file as data, and every extent is read as before.
+ */
+
+void ExtentReader::findHoles(const char *path) {
+
+    holes.clear();
+    fileEnd = 0;
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    fileEnd = lseek(fd, 0, SEEK_END);
+    long at = 0;
+    while (at < fileEnd) {
+        long hole = lseek(fd, at, SEEK_HOLE);
+        if (hole < 0 or hole >= fileEnd)
+            break;
+        long data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0)
+            data = fileEnd;
+        holes.push_back(make_pair(hole, data));
+        at = data;
+    }
+    ::close(fd);
+}
+
+bool ExtentReader::inHole(long start, long end) {
+
+    auto after = upper_bound(holes.begin(), holes.end(), make_pair(start, LONG_MAX));
+    if (after == holes.begin())
+        return false;
+    after--;
+    return after -> first <= start and end <= after -> second;
+}
+
+void ExtentReader::close() {
+    file.fclose();
+}
+
+/* Copies out of the agreed extents, reading each one in as the range
+ * reaches it.
+ */
+
+size_t ExtentReader::read(long offset, char *buf, size_t len) {
+
+    size_t copied = 0;
+    while (copied < len) {
+        long at = offset + (long) copied;
+        long start = at - at % EXTENT_BYTES;
+        if (start != extentStart and !fill(start))
+            break;
+
+        size_t within = at - start;
+        if (within >= extentLen)
+            break;
+        size_t n = min(len - copied, extentLen - within);
+        memcpy(buf + copied, extent.data() + within, n);
+        copied += n;
+    }
+
+    position = offset + (long) copied;
+    return copied;
+}
+
+/* Reads the extent at start until agreeNeeded reads return the same
+ * bytes, and makes that version the current extent. Every distinct
+ * version seen is kept with its votes, so a damaged read never has to
+ * be matched against more than the others.
+ */
+
+bool ExtentReader::fill(long start) {
+
+    long end = min(start + (long) EXTENT_BYTES, fileEnd);
+    if (start < end and inHole(start, end)) {
+        memset(extent.data(), 0, end - start);
+        extentLen = end - start;
+        extentStart = start;
+        return true;
+    }
+
+    size_t distinct = 0;
+    struct candidate *best = NULL;
+
+    for (int attempt = 0; attempt < maxReads; attempt++) {
+        if (distinct == candidates.size()) {
+            candidates.push_back(candidate());
+            candidates.back().data.resize(EXTENT_BYTES);
+        }
+        struct candidate& c = candidates[distinct];
+
+        if (file.fseek(start, SEEK_SET) != 0)
+            return false;
+        c.len = file.fread(c.data.data(), 1, EXTENT_BYTES);
+        c.crc = crc32c(c.data.data(), c.len);
+        c.votes = 1;
+
+        //A match with a version already seen is a vote for it
+        struct candidate *match = &c;
+        for (size_t i = 0; i < distinct; i++) {
+            struct candidate& seen = candidates[i];
+            if (seen.len == c.len and seen.crc == c.crc and
+                    memcmp(seen.data.data(), c.data.data(), c.len) == 0) {
+                seen.votes++;
+                match = &seen;
+                break;
+            }
+        }
+        if (match == &c)
+            distinct++;
+
+        if (best == NULL or match -> votes > best -> votes)
+            best = match;
+        if (best -> votes >= agreeNeeded)
+            break;
+    }
+
+    swap(extent, best -> data);
+    extentLen = best -> len;
+    extentStart = start;
+    return true;
+}
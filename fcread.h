@@ -0,0 +1,83 @@
+// --------------------------------------------------------------
+//
+//                        fcread.h
+//
+//        Robust reads of source files through C150NastyFile.
+//
+//        With file nastiness a single fread may hand back damaged
+//        bytes, and a damaged byte read for the digest or for a
+//        packet is only found out once the whole file has crossed
+//        the network and failed its end-to-end check. The reader
+//        below reads a file an extent (EXTENT_BYTES) at a time and
+//        reads each extent again until enough of the reads agree,
+//        comparing them by CRC32C and then byte for byte. How many
+//        must agree grows with the nastiness:
+//
+//            nastiness 0     1 read, trusted as before
+//            nastiness 1-2   2 matching reads
+//            nastiness 3+    3 matching reads
+//
+//        If no version gets enough votes within READ_VOTE_ROUNDS
+//        times that many reads, the one seen most often is used.
+//
+//        Holes in sparse files are found with SEEK_HOLE/SEEK_DATA
+//        when the file is opened. An extent that lies wholly in a
+//        hole is zeros without being read at all.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCREAD_H_INCLUDED__
+#define __FCREAD_H_INCLUDED__
+
+#include "c150nastyfile.h"
+#include <vector>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EXTENT_BYTES 65536   // bytes read and voted on at a time
+#define READ_VOTE_ROUNDS 4   // reads allowed per matching read needed
+
+class ExtentReader {
+public:
+    ExtentReader(int fileNasty);
+    ~ExtentReader();
+
+    // Returns false if the file cannot be opened
+    bool open(const char *path);
+    void close();
+
+    // Reads up to len bytes at offset into buf. Returns the count, which
+    // is short only at the end of the file.
+    size_t read(long offset, char *buf, size_t len);
+
+    // Reads on from where the last read ended
+    size_t read(char *buf, size_t len) { return read(position, buf, len); }
+
+private:
+    bool fill(long start);
+    void findHoles(const char *path);
+    bool inHole(long start, long end);
+
+    C150NETWORK::C150NastyFile file;
+    int agreeNeeded;
+    int maxReads;
+    long position;           // where the next sequential read starts
+
+    std::vector<char> extent;  // the agreed bytes of the extent at extentStart
+    long extentStart;          // -1 until one has been read
+    size_t extentLen;          // short at the end of the file
+
+    struct candidate {
+        std::vector<char> data;
+        size_t len;
+        uint32_t crc;
+        int votes;
+    };
+    std::vector<struct candidate> candidates;   // kept between extents
+
+    std::vector<std::pair<long, long>> holes;   // [start, end), in order
+    long fileEnd;                               // size when opened
+};
+
+#endif
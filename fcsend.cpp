@@ -0,0 +1,144 @@
+// --------------------------------------------------------------
+//
+//                        fcsend.cpp
+//
+//        Batched and zero-copy sends of data packets.
+//        See fcsend.h for the interface.
+//
+// --------------------------------------------------------------
+
+#include "fcsend.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+
+using namespace std;
+
+BatchSender::BatchSender(int sock, bool zeroCopy) : sock(sock), useZeroCopy(false),
+        useSegments(zeroCopy), issued(0), completed(0), queuedBytes(0) {
+
+    int one = 1;
+    if (zeroCopy and setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+        useZeroCopy = true;
+    queued.reserve(GSO_MAX_SEGMENTS);
+    lengths.reserve(GSO_MAX_SEGMENTS);
+}
+
+void BatchSender::add(const char *msg, size_t len) {
+
+    //Only the last datagram of a segmented send may be shorter
+    if (!lengths.empty() and (lengths.size() == GSO_MAX_SEGMENTS or len > lengths[0] or
+                              lengths.back() != lengths[0]))
+        flush();
+
+    if (!lengths.empty() and (char *) queued.back().iov_base + queued.back().iov_len == msg)
+        queued.back().iov_len += len;
+    else
+        queued.push_back({(void *) msg, len});
+    lengths.push_back(len);
+    queuedBytes += len;
+}
+
+void BatchSender::flush() {
+
+    if (lengths.empty())
+        return;
+    bool zero = useZeroCopy and queuedBytes >= ZEROCOPY_MIN_BYTES;
+    if (lengths.size() == 1 or !useSegments or
+            !sendBatch(queued.data(), queued.size(), lengths[0], zero)) {
+
+        //One by one, walking the merged iovecs
+        size_t v = 0, offset = 0;
+        for (size_t len : lengths) {
+            if (offset == queued[v].iov_len) {
+                v++;
+                offset = 0;
+            }
+            struct iovec one = {(char *) queued[v].iov_base + offset, len};
+            sendBatch(&one, 1, 0, false);
+            offset += len;
+        }
+    }
+    queued.clear();
+    lengths.clear();
+    queuedBytes = 0;
+}
+
+void BatchSender::send(const char *msg, size_t len) {
+    ::send(sock, msg, len, 0);
+}
+
+/* Sends iov as one sendmsg, cut into segment byte datagrams
+ * if segment is not 0. A zero-copy send the kernel refuses (too many page
+ * fragments, or out of option memory) is made again as a copy. A send the socket
+ * buffer has no room for is dropped, like any lost datagram; the receiver
+ * asks for it again. Returns false only if UDP_SEGMENT is refused, which
+ * turns segmenting off for good.
+ */
+
+bool BatchSender::sendBatch(struct iovec *iov, size_t iovCount, size_t segment, bool zero) {
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovCount;
+
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    if (segment != 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm -> cmsg_level = SOL_UDP;
+        cm -> cmsg_type = UDP_SEGMENT;
+        cm -> cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segmentSize = segment;
+        memcpy(CMSG_DATA(cm), &segmentSize, sizeof(segmentSize));
+    }
+
+    if (zero and sendmsg(sock, &msg, MSG_ZEROCOPY) >= 0) {
+        issued++;
+        return true;
+    }
+    if (sendmsg(sock, &msg, 0) >= 0)
+        return true;
+
+    if (segment != 0 and (errno == EINVAL or errno == EIO or errno == EOPNOTSUPP)) {
+        useSegments = false;
+        return false;
+    }
+    return true;
+}
+
+/* Each notification covers a range of zero-copy sends, numbered from 0
+ * in the order they were made.
+ */
+
+void BatchSender::reap() {
+
+    while (issued != completed) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm -> cmsg_level == SOL_IP and cm -> cmsg_type == IP_RECVERR) or
+                  (cm -> cmsg_level == SOL_IPV6 and cm -> cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            completed += err.ee_data - err.ee_info + 1;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                useZeroCopy = false;
+        }
+    }
+}
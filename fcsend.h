@@ -0,0 +1,87 @@
+// --------------------------------------------------------------
+//
+//                        fcsend.h
+//
+//        Batched, optionally zero-copy, sends of data packets on a
+//        connected UDP socket of the client's own (the stripe
+//        flows; the main socket belongs to the C150 library).
+//
+//        A data packet is under 512 bytes, far too small for
+//        MSG_ZEROCOPY to beat a copy: pinning pages and reading a
+//        completion costs more than copying them. So packets queued
+//        with add() go out together on flush(), up to GSO_MAX_SEGMENTS
+//        at a time, as one sendmsg with UDP_SEGMENT. The kernel
+//        splits that into the same datagrams the receiver saw before.
+//        Packets that lie back to back in memory (a PacketPool with a
+//        DATA_MESSAGE_SIZE stride) become a single iovec; a zero-copy
+//        send of scattered ones needs a page fragment for each and
+//        soon runs out of them, and is copied instead.
+//
+//        A batch of at least ZEROCOPY_MIN_BYTES is sent with
+//        MSG_ZEROCOPY when zero copy is on; smaller ones, and single
+//        packets sent with send(), are copied. The packets must stay
+//        untouched until the kernel reports their send complete on
+//        the socket's error queue. They live in the flow's PacketPool,
+//        which keeps every packet of the run for retransmission
+//        anyway, so only reuse of the pool for the next file has to
+//        wait: call reap() whenever the socket reports readable, and
+//        do not reuse the packets before idle(). Memory whose sends
+//        never complete must not be reused or freed at all.
+//
+//        If the kernel reports that it had to copy a zero-copy send
+//        after all (loopback, or a device that cannot do it), the
+//        sender switches to copying for the rest of its life, still
+//        in batches. Without zero copy asked for, flush() sends the
+//        packets one by one, as the flows always did.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCSEND_H_INCLUDED__
+#define __FCSEND_H_INCLUDED__
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define GSO_MAX_SEGMENTS 64         // most datagrams in one UDP_SEGMENT send
+#define ZEROCOPY_MIN_BYTES 16384    // smaller batches are copied
+
+class BatchSender {
+public:
+    // zeroCopy asks for batches and MSG_ZEROCOPY; zero copy is dropped
+    // if the socket refuses it
+    BatchSender(int sock, bool zeroCopy);
+
+    // Queue a packet for the next flush
+    void add(const char *msg, size_t len);
+
+    // Send everything queued
+    void flush();
+
+    // Send one packet now, copied
+    void send(const char *msg, size_t len);
+
+    // Read the zero-copy completions waiting on the error queue
+    void reap();
+
+    // True once every zero-copy send has completed
+    bool idle() const { return completed == issued; }
+
+    bool zeroCopy() const { return useZeroCopy; }
+
+private:
+    bool sendBatch(struct iovec *iov, size_t iovCount, size_t segment, bool zero);
+
+    int sock;
+    bool useZeroCopy;
+    bool useSegments;         // cleared if the kernel refuses UDP_SEGMENT
+    uint32_t issued;          // zero-copy sends made
+    uint32_t completed;       // and reported complete
+
+    std::vector<struct iovec> queued;   // adjacent packets merged
+    std::vector<size_t> lengths;        // of each packet queued
+    size_t queuedBytes;
+};
+
+#endif
@@ -0,0 +1,824 @@
+// --------------------------------------------------------------
+//
+//                        fcstorage.cpp
+//
+//        Sync and io_uring storage engines for the fileserver.
+//        See fcstorage.h for the interface.
+//
+//        The io_uring engine talks to the kernel directly through
+//        io_uring_setup/io_uring_enter and the mmap'd rings, so it
+//        needs no library beyond the kernel headers.
+//
+// --------------------------------------------------------------
+
+#include "fcstorage.h"
+#include "fcpacket.h"
+#include "fcmetrics.h"
+#include "c150debug.h"
+#include "c150nastyfile.h"
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+using namespace std;
+using namespace C150NETWORK;
+
+/* Function takes in the target path and the exact file size announced in the
+ * initial packet. Creates the file and preallocates all of its blocks up front
+ * so the data packets land in one contiguous extent instead of growing the
+ * file (and its metadata) on every extending write.
+ * Returns the open descriptor.
+ */
+
+int openTargetFile(string currFileName, long fileSize) {
+
+    int fd = ::open(currFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Could not create file\n");
+        exit(1);
+    }
+
+    //Filesystems without fallocate support still get the right size
+    if (fileSize > 0 and fallocate(fd, 0, 0, fileSize) != 0) {
+        if (ftruncate(fd, fileSize) != 0)
+            perror("Could not size file\n");
+    }
+
+    return fd;
+}
+
+/* Punches the preallocated blocks out of a run of zeros the client did
+ * not send. A file system that cannot punch holes keeps them, and the
+ * run reads as zeros either way.
+ */
+
+void StorageEngine::zero(int fd, off_t offset, off_t len) {
+    if (len > 0)
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                        SyncStorage
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+class SyncStorage : public StorageEngine {
+public:
+    SyncStorage(int fileNasty) : fileNasty(fileNasty) {}
+    ~SyncStorage();
+
+    const char *name() { return "sync"; }
+    int open(string path, long fileSize);
+    int reopen(string path);
+    void write(int fd, int packetNum, off_t offset, const char *data, size_t len);
+    void reap(vector<struct writeDone>& done, bool wait);
+    int close(int fd);
+    int rename(string from, string to);
+
+private:
+    int attach(string path, int fd);   //Set up the nastyfile for fd
+
+    int fileNasty;
+    vector<char> fileNastyCheck;          //Read-back buffer
+    map<int, C150NastyFile *> nastyFiles; //Open nastyfile for each descriptor
+    vector<struct writeDone> finished;    //Verified since the last reap
+};
+
+SyncStorage::~SyncStorage() {
+    for (auto& nf : nastyFiles) {
+        nf.second -> fclose();
+        delete nf.second;
+    }
+}
+
+int SyncStorage::open(string path, long fileSize) {
+    return attach(path, openTargetFile(path, fileSize));
+}
+
+int SyncStorage::reopen(string path) {
+
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        perror("Could not open file\n");
+        exit(1);
+    }
+    return attach(path, fd);
+}
+
+int SyncStorage::attach(string path, int fd) {
+
+    //With file nastiness the writes go through a nastyfile opened once on
+    //the preallocated file
+    if (fileNasty != 0) {
+        C150NastyFile *currentFile = new C150NastyFile(fileNasty);
+        currentFile -> fopen(path.c_str(), "r+");
+        nastyFiles[fd] = currentFile;
+    }
+    return fd;
+}
+
+/* Writes the packet data at its offset in the file and makes sure it was
+ * written correctly, retrying until the read-back matches or it has had
+ * STORAGE_WRITE_TRIES tries. With file nastiness the write goes through
+ * the nastyfile object, otherwise straight to the descriptor with
+ * pwrite/pread.
+ */
+
+void SyncStorage::write(int fd, int packetNum, off_t offset, const char *data, size_t len) {
+
+    bool fileCheck = true;
+    int tries = 0;
+    uint64_t started = metricsNow();
+    fileNastyCheck.resize(len);
+
+    do {
+        if (fileNasty == 0) {
+            //Write the data at its place in the preallocated file
+            if (pwrite(fd, data, len, offset) < (ssize_t) len)
+                perror("Could not write to file\n");
+
+            //Read back the data that was just written
+            if (pread(fd, fileNastyCheck.data(), len, offset) < (ssize_t) len)
+                perror("Could not read from file\n");
+        } else {
+            C150NastyFile *currentFile = nastyFiles[fd];
+
+            //Seek to the correct place in the file (data is 399 long)
+            if (currentFile -> fseek(offset, SEEK_SET))
+                perror("fseek failed\n");
+
+            //Write the data to the file
+            if (currentFile -> fwrite((void*) data, 1, len) < len)
+                perror("Could not write to file\n");
+
+            //Seek back to where the data was written.
+            if (currentFile -> fseek(offset, SEEK_SET))
+               perror("fseek failed\n");
+
+            //Read back the data that was just written
+            if(currentFile -> fread(fileNastyCheck.data(), 1, len) < len)
+               perror("Could not read from file\n");
+        }
+
+        //Compare the values what was written to check if write messed up
+        if(memcmp(fileNastyCheck.data(), data, len) == 0)
+           fileCheck = false;
+    } while(fileCheck == true and ++tries < STORAGE_WRITE_TRIES);
+
+    threadMetrics().diskWrite.record(metricsNow() - started);
+    finished.push_back({fd, packetNum, !fileCheck});
+}
+
+void SyncStorage::reap(vector<struct writeDone>& done, bool wait) {
+    done.insert(done.end(), finished.begin(), finished.end());
+    finished.clear();
+}
+
+int SyncStorage::close(int fd) {
+    auto nf = nastyFiles.find(fd);
+    if (nf != nastyFiles.end()) {
+        nf -> second -> fclose();
+        delete nf -> second;
+        nastyFiles.erase(nf);
+    }
+    return ::close(fd);
+}
+
+int SyncStorage::rename(string from, string to) {
+    return ::rename(from.c_str(), to.c_str());
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                        UringStorage
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+#define URING_ENTRIES 256
+#define URING_SLOTS   (URING_ENTRIES / 2) // each packet is a write + read
+
+//
+// Low two bits of user_data say what completed, the rest is the slot
+// (or control id)
+//
+#define OP_WRITE 0
+#define OP_READ  1
+#define OP_CTRL  2
+
+//
+// One packet in flight: the bytes to write, a buffer to read them back
+// into, and the two results. Buffers keep their capacity when the slot
+// is reused, so a warm ring does not allocate.
+//
+struct uringSlot {
+    int fd;
+    int packetNum;
+    off_t offset;
+    uint64_t queuedAt;     // for the write latency metric
+    vector<char> data;
+    vector<char> check;
+    int writeRes;
+    int readRes;
+    int opsLeft;
+    int tries;             // writes queued so far
+};
+
+class UringStorage : public StorageEngine {
+public:
+    UringStorage();
+    ~UringStorage();
+
+    bool ok() { return ringFd >= 0; }
+
+    const char *name() { return "uring"; }
+    int open(string path, long fileSize);
+    int reopen(string path);
+    void write(int fd, int packetNum, off_t offset, const char *data, size_t len);
+    void reap(vector<struct writeDone>& done, bool wait);
+    int close(int fd);
+    int rename(string from, string to);
+
+private:
+    struct io_uring_sqe *getSqe();
+    int waitCtrl(unsigned long id);
+    void queuePacket(int slot);
+    void submitAndWait(unsigned minComplete);
+    void processCompletions();
+
+    int ringFd;
+    void *sqMap, *cqMap;
+    size_t sqMapLen, cqMapLen;
+    struct io_uring_sqe *sqes;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;     //SQEs filled but not yet handed to the kernel
+
+    vector<struct uringSlot> slots;
+    vector<int> freeSlots;
+    int inFlight;          //Packets queued and not yet verified
+    unsigned long nextCtrl;
+    map<unsigned long, int> ctrlResults; //Results of control ops we wait on
+    vector<struct writeDone> finished;
+};
+
+UringStorage::UringStorage() : ringFd(-1), sqMap(MAP_FAILED), cqMap(MAP_FAILED),
+        toSubmit(0), slots(URING_SLOTS), inFlight(0), nextCtrl(1) {
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0)
+        return;
+
+    //
+    // Map the submission ring, completion ring and SQE array. Newer
+    // kernels share one mapping for both rings.
+    //
+    sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cqMapLen > sqMapLen)
+            sqMapLen = cqMapLen;
+        cqMapLen = sqMapLen;
+    }
+
+    sqMap = mmap(0, sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd, IORING_OFF_SQ_RING);
+    if (sqMap == MAP_FAILED) {
+        ::close(fd);
+        return;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cqMap = sqMap;
+    } else {
+        cqMap = mmap(0, cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_CQ_RING);
+        if (cqMap == MAP_FAILED) {
+            munmap(sqMap, sqMapLen);
+            ::close(fd);
+            return;
+        }
+    }
+    sqes = (struct io_uring_sqe *) mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (cqMap != sqMap)
+            munmap(cqMap, cqMapLen);
+        munmap(sqMap, sqMapLen);
+        ::close(fd);
+        return;
+    }
+
+    char *sq = (char *) sqMap;
+    char *cq = (char *) cqMap;
+    sqHead  = (unsigned *) (sq + p.sq_off.head);
+    sqTail  = (unsigned *) (sq + p.sq_off.tail);
+    sqMask  = (unsigned *) (sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *) (sq + p.sq_off.array);
+    cqHead  = (unsigned *) (cq + p.cq_off.head);
+    cqTail  = (unsigned *) (cq + p.cq_off.tail);
+    cqMask  = (unsigned *) (cq + p.cq_off.ring_mask);
+    cqes    = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    for (int i = URING_SLOTS - 1; i >= 0; i--)
+        freeSlots.push_back(i);
+
+    ringFd = fd;
+}
+
+UringStorage::~UringStorage() {
+    if (ringFd < 0)
+        return;
+
+    vector<struct writeDone> done;
+    reap(done, true);
+    if (cqMap != sqMap)
+        munmap(cqMap, cqMapLen);
+    munmap(sqMap, sqMapLen);
+    ::close(ringFd);
+}
+
+/* Returns the next free submission entry, zeroed. If the ring is full
+ * the queued entries are submitted first.
+ */
+
+struct io_uring_sqe *UringStorage::getSqe() {
+
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *sqTail;
+    if (tail - head > *sqMask) {
+        submitAndWait(0);
+        head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    }
+
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    toSubmit++;
+    return sqe;
+}
+
+/* Hands all filled entries to the kernel and, if minComplete is set,
+ * sleeps until at least that many completions are ready.
+ */
+
+void UringStorage::submitAndWait(unsigned minComplete) {
+
+    unsigned flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+    if (toSubmit == 0 and minComplete == 0)
+        return;
+
+    int ret;
+    do {
+        ret = (int) syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+                            flags, NULL, 0);
+    } while (ret < 0 and errno == EINTR);
+
+    if (ret < 0) {
+        perror("io_uring_enter failed\n");
+        return;
+    }
+    toSubmit -= (unsigned) ret < toSubmit ? ret : toSubmit;
+}
+
+/* Queues the write of a slot linked to its read-back, so the read only
+ * starts once the write has completed.
+ */
+
+void UringStorage::queuePacket(int slot) {
+
+    struct uringSlot& s = slots[slot];
+    s.opsLeft = 2;
+    s.tries++;
+
+    struct io_uring_sqe *sqe = getSqe();
+    sqe -> opcode    = IORING_OP_WRITE;
+    sqe -> fd        = s.fd;
+    sqe -> addr      = (unsigned long) s.data.data();
+    sqe -> len       = s.data.size();
+    sqe -> off       = s.offset;
+    sqe -> flags     = IOSQE_IO_LINK;
+    sqe -> user_data = ((unsigned long) slot << 2) | OP_WRITE;
+
+    sqe = getSqe();
+    sqe -> opcode    = IORING_OP_READ;
+    sqe -> fd        = s.fd;
+    sqe -> addr      = (unsigned long) s.check.data();
+    sqe -> len       = s.check.size();
+    sqe -> off       = s.offset;
+    sqe -> user_data = ((unsigned long) slot << 2) | OP_READ;
+}
+
+/* Drains every completion currently in the ring. A packet is finished
+ * once both its write and read-back have completed: if the bytes match
+ * it is reported verified, otherwise both are queued again, until it
+ * has had STORAGE_WRITE_TRIES tries and is reported failed.
+ */
+
+void UringStorage::processCompletions() {
+
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+        unsigned long op = cqe -> user_data & 3;
+        unsigned long id = cqe -> user_data >> 2;
+        int res = cqe -> res;
+        head++;
+
+        if (op == OP_CTRL) {
+            if (id != 0)
+                ctrlResults[id] = res;
+            continue;
+        }
+
+        struct uringSlot& s = slots[id];
+        if (op == OP_WRITE)
+            s.writeRes = res;
+        else
+            s.readRes = res;
+        if (--s.opsLeft > 0)
+            continue;
+
+        size_t len = s.data.size();
+        bool ok = s.writeRes == (int) len and s.readRes == (int) len and
+                memcmp(s.data.data(), s.check.data(), len) == 0;
+        if (ok or s.tries >= STORAGE_WRITE_TRIES) {
+            threadMetrics().diskWrite.record(metricsNow() - s.queuedAt);
+            finished.push_back({s.fd, s.packetNum, ok});
+            freeSlots.push_back(id);
+            inFlight--;
+        } else {
+            queuePacket(id);
+        }
+    }
+
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+int UringStorage::open(string path, long fileSize) {
+    return openTargetFile(path, fileSize);
+}
+
+int UringStorage::reopen(string path) {
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        perror("Could not open file\n");
+        exit(1);
+    }
+    return fd;
+}
+
+/* Copies the packet into a free slot and queues it. The submission is
+ * batched: nothing reaches the kernel until the ring fills or the
+ * server reaps.
+ */
+
+void UringStorage::write(int fd, int packetNum, off_t offset, const char *data, size_t len) {
+
+    while (freeSlots.empty()) {
+        submitAndWait(1);
+        processCompletions();
+    }
+
+    int slot = freeSlots.back();
+    freeSlots.pop_back();
+
+    struct uringSlot& s = slots[slot];
+    s.fd        = fd;
+    s.packetNum = packetNum;
+    s.offset    = offset;
+    s.queuedAt  = metricsNow();
+    s.data.assign(data, data + len);
+    s.check.resize(len);
+    s.tries = 0;
+    inFlight++;
+
+    queuePacket(slot);
+}
+
+void UringStorage::reap(vector<struct writeDone>& done, bool wait) {
+
+    submitAndWait(0);
+    processCompletions();
+    while (wait and inFlight > 0) {
+        submitAndWait(1);
+        processCompletions();
+    }
+
+    done.insert(done.end(), finished.begin(), finished.end());
+    finished.clear();
+}
+
+/* Submits until the control op id completes, reaping anything else that
+ * completes meanwhile, and returns its result.
+ */
+
+int UringStorage::waitCtrl(unsigned long id) {
+
+    while (ctrlResults.find(id) == ctrlResults.end()) {
+        submitAndWait(1);
+        processCompletions();
+    }
+    int res = ctrlResults[id];
+    ctrlResults.erase(id);
+    return res;
+}
+
+/* Queues fdatasync linked to close for a finished file and waits for
+ * both, so a file whose data did not reach the disk is never renamed
+ * into place. A failed sync cancels the linked close, and kernels
+ * without IORING_OP_CLOSE refuse it; either way close(2) is used.
+ */
+
+int UringStorage::close(int fd) {
+
+    //Every write to this file has to land before the close
+    submitAndWait(0);
+    processCompletions();
+    while (inFlight > 0) {
+        submitAndWait(1);
+        processCompletions();
+    }
+
+    unsigned long syncId = nextCtrl++;
+    unsigned long closeId = nextCtrl++;
+
+    struct io_uring_sqe *sqe = getSqe();
+    sqe -> opcode      = IORING_OP_FSYNC;
+    sqe -> fd          = fd;
+    sqe -> fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe -> flags       = IOSQE_IO_LINK;
+    sqe -> user_data   = (syncId << 2) | OP_CTRL;
+
+    sqe = getSqe();
+    sqe -> opcode    = IORING_OP_CLOSE;
+    sqe -> fd        = fd;
+    sqe -> user_data = (closeId << 2) | OP_CTRL;
+
+    //Only a close that never ran leaves fd open; after any other error
+    //the number may already belong to another thread's file
+    int syncRes = waitCtrl(syncId);
+    int closeRes = waitCtrl(closeId);
+    if (closeRes == -ECANCELED or closeRes == -EINVAL)
+        closeRes = ::close(fd) == 0 ? 0 : -errno;
+
+    int res = syncRes < 0 ? syncRes : closeRes;
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
+/* Queues a rename and waits for its result, reaping anything else that
+ * completes meanwhile. Kernels without IORING_OP_RENAMEAT fall back to
+ * rename(2).
+ */
+
+int UringStorage::rename(string from, string to) {
+
+    unsigned long id = nextCtrl++;
+
+    struct io_uring_sqe *sqe = getSqe();
+    sqe -> opcode       = IORING_OP_RENAMEAT;
+    sqe -> fd           = AT_FDCWD;
+    sqe -> addr         = (unsigned long) from.c_str();
+    sqe -> len          = AT_FDCWD;
+    sqe -> addr2        = (unsigned long) to.c_str();
+    sqe -> user_data    = (id << 2) | OP_CTRL;
+
+    int res = waitCtrl(id);
+
+    if (res == -EINVAL or res == -EOPNOTSUPP)
+        return ::rename(from.c_str(), to.c_str());
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                        ReorderStorage
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//
+// Packets buffered for one file that sit next to each other on disk,
+// their bytes already laid out in file order
+//
+struct pendingRun {
+    vector<char> data;
+    vector<int> packets;   // in file order
+};
+
+class ReorderStorage : public StorageEngine {
+public:
+    ReorderStorage(StorageEngine *inner, size_t maxBytes) :
+            inner(inner), maxBytes(maxBytes), buffered(0), direct(false) {}
+    ~ReorderStorage();
+
+    const char *name() { return inner -> name(); }
+    int open(string path, long fileSize) { return inner -> open(path, fileSize); }
+    int reopen(string path) { return inner -> reopen(path); }
+    void write(int fd, int packetNum, off_t offset, const char *data, size_t len);
+    void reap(vector<struct writeDone>& done, bool wait);
+    int close(int fd);
+    int rename(string from, string to) { return inner -> rename(from, to); }
+
+private:
+    typedef map<off_t, struct pendingRun> runMap;
+
+    void flushRun(int fd, runMap& runs, runMap::iterator run);
+    void flushFile(int fd);
+
+    StorageEngine *inner;
+    size_t maxBytes;
+    size_t buffered;                       //Bytes held in pending
+    bool direct;                           //Over budget: no new runs until
+                                           //buffered drains to half of it
+    map<int, runMap> pending;              //Runs not yet written, by fd and offset
+    map<pair<int, int>, vector<int>> runsInFlight; //Packets of each run written, by fd
+                                                   //and first packet
+    vector<struct writeDone> innerDone;
+};
+
+ReorderStorage::~ReorderStorage() {
+    while (!pending.empty())
+        flushFile(pending.begin() -> first);
+    delete inner;
+}
+
+/* Adds the packet to the run it extends, joining the runs on either side
+ * of it, and writes the run once it is long enough. Packets that are long
+ * enough already, that overlap something buffered, or that do not fit in
+ * the budget are written straight away.
+ *
+ * Once the budget is exceeded the buffer goes direct: new packets are
+ * written straight through and only those that extend a run held are
+ * still buffered, so the runs can finish and drain. It starts runs again
+ * once they have drained below half the budget, or been flushed by a
+ * wait or a close, rather than flushing and refilling on every packet.
+ */
+
+void ReorderStorage::write(int fd, int packetNum, off_t offset, const char *data, size_t len) {
+
+    if (len == 0 or len >= REORDER_RUN_BYTES) {
+        inner -> write(fd, packetNum, offset, data, len);
+        return;
+    }
+
+    if (buffered + len > maxBytes)
+        direct = true;
+    else if (direct and buffered < maxBytes / 2)
+        direct = false;
+
+    if (buffered + len > maxBytes) {
+        inner -> write(fd, packetNum, offset, data, len);
+        return;
+    }
+
+    runMap& runs = pending[fd];
+    runMap::iterator next = runs.upper_bound(offset);
+    runMap::iterator prev = next == runs.begin() ? runs.end() : std::prev(next);
+    off_t end = offset + (off_t) len;
+    bool extendsPrev = prev != runs.end() and prev -> first + (off_t) prev -> second.data.size() == offset;
+    bool extendsNext = next != runs.end() and next -> first == end;
+
+    if ((prev != runs.end() and prev -> first + (off_t) prev -> second.data.size() > offset) or
+            (next != runs.end() and next -> first < end) or
+            (direct and !extendsPrev and !extendsNext)) {
+        inner -> write(fd, packetNum, offset, data, len);
+        return;
+    }
+
+    runMap::iterator run;
+    if (extendsPrev) {
+        run = prev;
+        run -> second.data.insert(run -> second.data.end(), data, data + len);
+        run -> second.packets.push_back(packetNum);
+    } else {
+        run = runs.emplace(offset, pendingRun()).first;
+        run -> second.data.reserve(REORDER_RUN_BYTES + len);
+        run -> second.data.assign(data, data + len);
+        run -> second.packets.assign(1, packetNum);
+    }
+    buffered += len;
+
+    if (extendsNext) {
+        struct pendingRun& after = next -> second;
+        run -> second.data.insert(run -> second.data.end(), after.data.begin(), after.data.end());
+        run -> second.packets.insert(run -> second.packets.end(), after.packets.begin(), after.packets.end());
+        runs.erase(next);
+    }
+
+    if (run -> second.data.size() >= REORDER_RUN_BYTES)
+        flushRun(fd, runs, run);
+}
+
+/* Hands one run to the engine as a single write under the number of its
+ * first packet, remembering the rest so they can be reported with it.
+ */
+
+void ReorderStorage::flushRun(int fd, runMap& runs, runMap::iterator run) {
+
+    struct pendingRun& r = run -> second;
+    if (r.packets.size() > 1)
+        runsInFlight[make_pair(fd, r.packets[0])] = r.packets;
+    inner -> write(fd, r.packets[0], run -> first, r.data.data(), r.data.size());
+    buffered -= r.data.size();
+    runs.erase(run);
+}
+
+void ReorderStorage::flushFile(int fd) {
+
+    auto file = pending.find(fd);
+    if (file == pending.end())
+        return;
+    while (!file -> second.empty())
+        flushRun(fd, file -> second, file -> second.begin());
+    pending.erase(file);
+}
+
+/* A wait means the caller wants nothing left in flight, which includes
+ * whatever is buffered. Each verified run is reported as its packets.
+ */
+
+void ReorderStorage::reap(vector<struct writeDone>& done, bool wait) {
+
+    if (wait) {
+        while (!pending.empty())
+            flushFile(pending.begin() -> first);
+    }
+
+    inner -> reap(innerDone, wait);
+    for (auto& w : innerDone) {
+        auto run = runsInFlight.find(make_pair(w.fd, w.packetNum));
+        if (run == runsInFlight.end()) {
+            done.push_back(w);
+            continue;
+        }
+        for (int packetNum : run -> second)
+            done.push_back({w.fd, packetNum, w.ok});
+        runsInFlight.erase(run);
+    }
+    innerDone.clear();
+}
+
+int ReorderStorage::close(int fd) {
+    flushFile(fd);
+    return inner -> close(fd);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                        newStorageEngine
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static StorageEngine *newInnerEngine(const char *engineName, int fileNasty) {
+
+    if (strcmp(engineName, "uring") == 0) {
+        //The ring writes straight to the descriptor, so it cannot be used
+        //when the nastyfile has to see (and damage) every write
+        if (fileNasty != 0) {
+            c150debug->printf(C150ALWAYSLOG,"io_uring storage ignored with file nastiness %d, using sync",
+                    fileNasty);
+            return new SyncStorage(fileNasty);
+        }
+
+        UringStorage *uring = new UringStorage();
+        if (uring -> ok())
+            return uring;
+
+        c150debug->printf(C150ALWAYSLOG,"io_uring unavailable (%s), using sync storage",
+                strerror(errno));
+        delete uring;
+    } else if (strcmp(engineName, "sync") != 0) {
+        fprintf(stderr,"Unknown storage engine %s, using sync\n", engineName);
+    }
+
+    return new SyncStorage(fileNasty);
+}
+
+StorageEngine *newStorageEngine(const char *engineName, int fileNasty, size_t reorderBytes) {
+
+    StorageEngine *engine = newInnerEngine(engineName, fileNasty);
+    if (reorderBytes == 0)
+        return engine;
+    return new ReorderStorage(engine, reorderBytes);
+}
@@ -0,0 +1,95 @@
+// --------------------------------------------------------------
+//
+//                        fcstorage.h
+//
+//        Storage engines for the fileserver write and verify path.
+//
+//        Every data packet the server accepts becomes a positional
+//        write into a preallocated .tmp file followed by a read-back
+//        of the same bytes. An engine queues those operations and
+//        later hands back the packets whose write verified, so the
+//        server loop can keep reading the socket while disk work is
+//        in flight. A packet whose read-back still differs after
+//        STORAGE_WRITE_TRIES writes is handed back as failed.
+//
+//            sync  - pwrite/pread (or C150NastyFile with file
+//                    nastiness) done on the spot. Always available.
+//
+//            uring - io_uring ring with each write linked to its
+//                    read-back, many packets in flight, completions
+//                    reaped in bulk. fdatasync, close and rename are
+//                    queued on the same ring.
+//
+//        Either engine can sit behind a reorder buffer, which holds
+//        packets that arrive out of order, joins neighbours into
+//        contiguous runs and hands each run to the engine as one
+//        write once it reaches REORDER_RUN_BYTES, or when the server
+//        reaps with wait set. Packets are still reported verified
+//        one by one. Past its memory budget the buffer sends new
+//        packets straight through, starting no runs until those it
+//        holds have drained to half the budget.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCSTORAGE_H_INCLUDED__
+#define __FCSTORAGE_H_INCLUDED__
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#define REORDER_RUN_BYTES     65536      // a run this long is written at once
+#define REORDER_DEFAULT_BYTES (4 << 20)  // reorder buffer budget per engine
+#define STORAGE_WRITE_TRIES   16         // writes of a packet before it fails
+
+//
+// A packet whose write has been read back, and whether it matched
+//
+struct writeDone {
+    int fd;
+    int packetNum;
+    bool ok;
+};
+
+class StorageEngine {
+public:
+    virtual ~StorageEngine() {}
+
+    // Name shown in the debug log
+    virtual const char *name() = 0;
+
+    // Create path at exactly fileSize bytes and return its descriptor
+    virtual int open(std::string path, long fileSize) = 0;
+
+    // Open a file another engine created, without truncating it, so
+    // several threads can each write their own part of it
+    virtual int reopen(std::string path) = 0;
+
+    // Queue data to be written at offset and verified
+    virtual void write(int fd, int packetNum, off_t offset, const char *data, size_t len) = 0;
+
+    // Move packets that verified or failed into done. With wait set,
+    // block until nothing is left in flight.
+    virtual void reap(std::vector<struct writeDone>& done, bool wait) = 0;
+
+    // Finish a file once all of its packets have been reaped. Returns
+    // 0, or -1 with errno set if its data may not be on disk.
+    virtual int close(int fd) = 0;
+
+    // Leave len bytes at offset, which the file already reads as zeros,
+    // unwritten, handing their blocks back where the file system can
+    virtual void zero(int fd, off_t offset, off_t len);
+
+    // Rename a finished file, returns 0 on success like rename(2)
+    virtual int rename(std::string from, std::string to) = 0;
+};
+
+//
+// Returns the named engine ("sync" or "uring"). Falls back to the
+// sync engine when io_uring is unavailable or file nastiness is on.
+// Unless reorderBytes is 0 the engine is behind a reorder buffer that
+// holds at most that many bytes.
+//
+StorageEngine *newStorageEngine(const char *engineName, int fileNasty, size_t reorderBytes);
+
+#endif
@@ -0,0 +1,111 @@
+// --------------------------------------------------------------
+//
+//                        fcstoragetest.cpp
+//
+//        Checks of the reorder buffer in front of the sync engine.
+//        With the sync engine a write is verified as soon as it is
+//        made, so a packet that reap(done, false) reports at once
+//        went straight through, and one it does not report is held
+//        in the buffer.
+//
+//            budget     - packets go direct once the budget is
+//                         exceeded, and stay direct while the runs
+//                         held are over half of it
+//            drain      - after a wait has flushed the runs, new
+//                         packets are buffered again
+//            close      - each engine reports a file it could not
+//                         sync and close, so it is not kept
+//
+//        COMMAND LINE
+//
+//              fcstoragetest [tmpdir]
+//
+//        Exits 0 if every check passes, 1 otherwise.
+//
+// --------------------------------------------------------------
+
+#include "fcpacket.h"
+#include "fcstorage.h"
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+#define TEST_BUDGET_PACKETS 8    // reorder budget, in whole packets
+#define TEST_FILE_PACKETS 256    // packets in the target file
+#define TEST_BAD_FD 1000000      // a descriptor no test ever has open
+
+static int failures = 0;
+static const size_t packetLen = MAX_DATA_SIZE - 1;
+
+static void check(bool ok, const char *what) {
+    printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+        failures++;
+}
+
+/* Writes packet n at its place and returns true if the engine reported
+ * it verified straight away, that is, it was not buffered.
+ */
+
+static bool writeIsDirect(StorageEngine *engine, int fd, int n) {
+
+    vector<char> data(packetLen, (char) n);
+    vector<struct writeDone> done;
+    engine -> write(fd, n, (off_t) (n - 1) * packetLen, data.data(), packetLen);
+    engine -> reap(done, false);
+    for (auto& w : done) {
+        if (w.packetNum == n)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct stat st;
+    string tmpdir = stat("/dev/shm", &st) == 0 ? "/dev/shm" : "/tmp";
+    if (argc > 1)
+        tmpdir = argv[1];
+
+    string path = tmpdir + "/fcstoragetest.reorder";
+    StorageEngine *engine = newStorageEngine("sync", 0, TEST_BUDGET_PACKETS * packetLen);
+    int fd = engine -> open(path, (long) TEST_FILE_PACKETS * packetLen);
+
+    //Every other packet, so no two join and no run is long enough to go
+    bool buffered = true;
+    for (int n = 1; n <= 2 * TEST_BUDGET_PACKETS; n += 2)
+        buffered = buffered and !writeIsDirect(engine, fd, n);
+    check(buffered, "budget: packets within the budget are buffered");
+
+    check(writeIsDirect(engine, fd, 2 * TEST_BUDGET_PACKETS + 3), "budget: the packet over the budget goes direct");
+
+    bool direct = true;
+    for (int n = 2 * TEST_BUDGET_PACKETS + 5; n < 4 * TEST_BUDGET_PACKETS; n += 2)
+        direct = direct and writeIsDirect(engine, fd, n);
+    check(direct, "budget: later packets stay direct while the runs are held");
+
+    vector<struct writeDone> done;
+    engine -> reap(done, true);
+    check(!writeIsDirect(engine, fd, TEST_FILE_PACKETS - 1), "drain: once flushed, packets are buffered again");
+
+    engine -> reap(done, true);
+    check(engine -> close(fd) == 0, "close: a file written in full closes");
+    delete engine;
+    unlink(path.c_str());
+
+    //A descriptor that is not open stands in for a file whose sync fails
+    for (const char *name : {"sync", "uring"}) {
+        StorageEngine *closer = newStorageEngine(name, 0, 0);
+        string what = string("close: the ") + closer -> name() + " engine reports a failed close";
+        check(closer -> close(TEST_BAD_FD) != 0, what.c_str());
+        delete closer;
+    }
+
+    printf("%s\n", failures == 0 ? "All checks passed" : "Some checks FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,235 @@
+// --------------------------------------------------------------
+//
+//                        fcwalk.cpp
+//
+//        Parallel directory walker for the fileclient.
+//        See fcwalk.h for the interface.
+//
+// --------------------------------------------------------------
+
+#include "fcwalk.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+using namespace std;
+
+bool parseSchedule(const char *name, enum schedulePolicy& policy) {
+
+    if (strcmp(name, "walk") == 0)
+        policy = SCHEDULE_WALK;
+    else if (strcmp(name, "shortest") == 0)
+        policy = SCHEDULE_SHORTEST;
+    else if (strcmp(name, "largest") == 0)
+        policy = SCHEDULE_LARGEST;
+    else if (strcmp(name, "fair") == 0)
+        policy = SCHEDULE_FAIR;
+    else
+        return false;
+    return true;
+}
+
+/* Sorts are stable, so files of one size keep the order the walk found
+ * them in. The fair classes are consecutive runs of the sorted files,
+ * each served smallest first; a tie in bytes goes to the smaller class.
+ */
+
+void orderFiles(vector<struct walkEntry>& files, enum schedulePolicy policy) {
+
+    if (policy == SCHEDULE_WALK)
+        return;
+    if (policy == SCHEDULE_LARGEST) {
+        stable_sort(files.begin(), files.end(),
+                    [](const struct walkEntry& a, const struct walkEntry& b) { return a.size > b.size; });
+        return;
+    }
+    stable_sort(files.begin(), files.end(),
+                [](const struct walkEntry& a, const struct walkEntry& b) { return a.size < b.size; });
+    if (policy == SCHEDULE_SHORTEST)
+        return;
+
+    size_t count = files.size();
+    size_t slots = min((size_t) FAIR_SLOTS, count);
+    vector<size_t> next(slots), end(slots);
+    vector<long> sent(slots, 0);
+    for (size_t k = 0; k < slots; k++) {
+        next[k] = k * count / slots;
+        end[k] = (k + 1) * count / slots;
+    }
+
+    vector<struct walkEntry> ordered;
+    ordered.reserve(count);
+    while (ordered.size() < count) {
+        size_t pick = slots;
+        for (size_t k = 0; k < slots; k++) {
+            if (next[k] < end[k] and (pick == slots or sent[k] < sent[pick]))
+                pick = k;
+        }
+        sent[pick] += max(files[next[pick]].size, 0L);
+        ordered.push_back(files[next[pick]++]);
+    }
+    files.swap(ordered);
+}
+
+/* Opens the root and starts numThreads workers on it.
+ */
+
+DirWalker::DirWalker(string root, int numThreads, bool withSizes) : withSizes(withSizes), busyWorkers(0),
+        finished(false), unreadable(0) {
+
+    rootFd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+    if (rootFd < 0) {
+        perror("Cannot open source directory");
+        finished = true;
+        unreadable = 1;
+        return;
+    }
+    dirs.push_back({""});
+
+    if (numThreads < 1)
+        numThreads = 1;
+    for (int i = 0; i < numThreads; i++)
+        workers.push_back(thread(&DirWalker::worker, this));
+}
+
+DirWalker::~DirWalker() {
+    for (auto& w : workers)
+        w.join();
+    if (rootFd >= 0)
+        close(rootFd);
+}
+
+/* Hands out the next file found, waiting for the workers if none is
+ * queued yet. Returns false when the walk is over.
+ */
+
+bool DirWalker::next(struct walkEntry& entry) {
+
+    unique_lock<mutex> guard(lock);
+    filesReady.wait(guard, [this] { return !files.empty() or finished; });
+    if (files.empty())
+        return false;
+
+    entry = files.front();
+    files.pop_front();
+    return true;
+}
+
+/* Worker loop: read directories until none are queued and no other
+ * worker could still queue one.
+ */
+
+void DirWalker::worker() {
+
+    unique_lock<mutex> guard(lock);
+    while (1) {
+        dirsReady.wait(guard, [this] { return !dirs.empty() or finished; });
+        if (dirs.empty())
+            return;
+
+        struct pendingDir dir = dirs.front();
+        dirs.pop_front();
+        busyWorkers++;
+
+        guard.unlock();
+        readDirectory(dir);
+        guard.lock();
+
+        busyWorkers--;
+        if (dirs.empty() and busyWorkers == 0) {
+            finished = true;
+            dirsReady.notify_all();
+            filesReady.notify_all();
+        }
+    }
+}
+
+int DirWalker::unreadableDirs() {
+    lock_guard<mutex> guard(lock);
+    return unreadable;
+}
+
+/* Reads one directory, opened here relative to the root. Files are
+ * queued for sending and subdirectories are queued for the workers by
+ * path. Entries are batched so the lock is taken once per directory,
+ * not per name.
+ */
+
+void DirWalker::readDirectory(struct pendingDir dir) {
+
+    //Without its trailing '/', so O_NOFOLLOW applies to the last name
+    string path = dir.relPath.empty() ? "." : dir.relPath.substr(0, dir.relPath.length() - 1);
+    int fd = openat(rootFd, path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *d = fd < 0 ? NULL : fdopendir(fd);
+    if (d == NULL) {
+        fprintf(stderr, "Cannot read directory %s: %s\n", path.c_str(), strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        lock_guard<mutex> guard(lock);
+        unreadable++;
+        return;
+    }
+
+    vector<struct walkEntry> foundFiles;
+    vector<struct pendingDir> foundDirs;
+    struct dirent *ent;
+    struct stat st;
+
+    //errno is cleared before each readdir so an error can be told from the end
+    while ((errno = 0, ent = readdir(d)) != NULL) {
+        // skip the . and .. names
+        if ((strcmp(ent -> d_name, ".") == 0) ||
+            (strcmp(ent -> d_name, "..") == 0 )) {
+            continue;          // never copy . or ..
+        }
+
+        unsigned char type = ent -> d_type;
+        bool statted = false;
+
+        //Only stat when readdir could not tell us the type. Symlinks are
+        //followed to files but never to directories, so a link cannot
+        //send the walk round in a loop.
+        if (type == DT_UNKNOWN or type == DT_LNK) {
+            int flags = type == DT_UNKNOWN ? AT_SYMLINK_NOFOLLOW : 0;
+            if (fstatat(dirfd(d), ent -> d_name, &st, flags) != 0)
+                continue;
+            statted = true;
+            if (S_ISREG(st.st_mode))
+                type = DT_REG;
+            else if (S_ISDIR(st.st_mode) and flags != 0)
+                type = DT_DIR;
+            else
+                continue;
+        }
+
+        if (type == DT_REG) {
+            long size = -1;
+            if (withSizes and (statted or fstatat(dirfd(d), ent -> d_name, &st, 0) == 0))
+                size = st.st_size;
+            foundFiles.push_back({dir.relPath + ent -> d_name, size});
+        } else if (type == DT_DIR) {
+            foundDirs.push_back({dir.relPath + ent -> d_name + "/"});
+        }
+    }
+    bool readFailed = errno != 0;
+    if (readFailed)
+        fprintf(stderr, "Cannot read all of directory %s: %s\n", path.c_str(), strerror(errno));
+    closedir(d);
+
+    lock_guard<mutex> guard(lock);
+    if (readFailed)
+        unreadable++;
+    if (!foundFiles.empty()) {
+        files.insert(files.end(), foundFiles.begin(), foundFiles.end());
+        filesReady.notify_one();
+    }
+    if (!foundDirs.empty()) {
+        dirs.insert(dirs.end(), foundDirs.begin(), foundDirs.end());
+        dirsReady.notify_all();
+    }
+}
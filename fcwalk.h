@@ -0,0 +1,102 @@
+// --------------------------------------------------------------
+//
+//                        fcwalk.h
+//
+//        Parallel directory walker for the fileclient.
+//
+//        A few threads enumerate the source tree while the main
+//        thread is already sending: each worker takes a directory
+//        off a shared queue, opens it relative to the root and reads
+//        it with readdir (openat/fstatat, trusting d_type so regular
+//        files and directories cost no extra stat), pushes the
+//        subdirectories back on the queue and the files onto the
+//        output queue that next() hands out.
+//
+//        Queued directories are paths, not descriptors, so only the
+//        root and one directory per worker are open at a time however
+//        wide the tree is. A directory that cannot be opened or read
+//        is counted, and its files are missing from the walk.
+//
+//        Paths handed out are relative to the root, using '/' as
+//        the separator, so the server can recreate the tree.
+//
+//        Files go out in the order the walk finds them unless they
+//        are to be scheduled by size: then the workers stat each
+//        file as they find it, the whole tree is taken, and
+//        orderFiles puts it in the order of a schedulePolicy.
+//
+// --------------------------------------------------------------
+
+#ifndef __FCWALK_H_INCLUDED__
+#define __FCWALK_H_INCLUDED__
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define FAIR_SLOTS 4   // size classes sharing the link under SCHEDULE_FAIR
+
+struct walkEntry {
+    std::string relPath;   // path below the root, e.g. "a/b/c.txt"
+    long size;             // bytes, -1 unless the walker was asked for sizes
+};
+
+//
+// The order files are sent in:
+//
+//   SCHEDULE_WALK      as the walk finds them, sending from the first
+//   SCHEDULE_SHORTEST  smallest first, for the lowest mean completion
+//   SCHEDULE_LARGEST   largest first
+//   SCHEDULE_FAIR      the files, by size, are split into FAIR_SLOTS
+//                      classes of as many files each, and the next file
+//                      always comes from the class sent the fewest bytes
+//                      so far. Each class gets a share of the link, so
+//                      small files do not wait behind large ones and
+//                      large ones are not left to the end.
+//
+enum schedulePolicy { SCHEDULE_WALK, SCHEDULE_SHORTEST, SCHEDULE_LARGEST, SCHEDULE_FAIR };
+
+// Parses walk, shortest, largest or fair; false for anything else
+bool parseSchedule(const char *name, enum schedulePolicy& policy);
+
+// Puts files, which must have their sizes, in the order of policy
+void orderFiles(std::vector<struct walkEntry>& files, enum schedulePolicy policy);
+
+class DirWalker {
+public:
+    // withSizes has every file stat'ed for its size as it is found
+    DirWalker(std::string root, int numThreads, bool withSizes = false);
+    ~DirWalker();
+
+    // Blocks until the next file is found. Returns false once the
+    // whole tree has been enumerated and handed out.
+    bool next(struct walkEntry& entry);
+
+    // Directories left out because they could not be read, so far
+    int unreadableDirs();
+
+private:
+    struct pendingDir {
+        std::string relPath;  // "" for the root, else "a/b/"
+    };
+
+    void worker();
+    void readDirectory(struct pendingDir dir);
+
+    bool withSizes;
+    int rootFd;                          // the root, open for the whole walk
+    std::mutex lock;
+    std::condition_variable dirsReady;   // signalled when dirs is pushed
+    std::condition_variable filesReady;  // signalled when files is pushed
+    std::deque<struct pendingDir> dirs;
+    std::deque<struct walkEntry> files;
+    int busyWorkers;                     // workers reading a directory
+    bool finished;                       // no dirs left and nobody busy
+    int unreadable;                      // directories that could not be read
+    std::vector<std::thread> workers;
+};
+
+#endif
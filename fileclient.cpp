@@ -59,11 +59,21 @@
 // --------------------------------------------------------------
 
 #include "fcpacket.h"
+#include "fchash.h"
+#include "fccodec.h"
+#include "fcwalk.h"
+#include "fcread.h"
+#include "fcmetrics.h"
+#include "fclog.h"
+#include "fcevent.h"
+#include "fcsend.h"
 #include "c150nastydgmsocket.h"
 #include "c150debug.h"
 #include "c150grading.h"
 #include "c150nastyfile.h" 
 #include <vector>
+#include <map>
+#include <functional>
 #include <cassert>
 #include <fstream>
 #include <sstream>
@@ -76,6 +86,9 @@
 #include <cstring>                
 #include <cerrno>
 #include <dirent.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <openssl/sha.h>
 
 using namespace std;          // for C++ std library
@@ -85,14 +98,30 @@ using namespace C150NETWORK;  // for all the comp150 utilities
 void checkAndPrintMessage(ssize_t readlen, char *buf, ssize_t bufferlen);
 void setUpDebugLogging(const char *logname, int argc, char *argv[]);
 void checkDirectory(char *dirname);
-string sendMessageToServer(const char *msg, size_t msgSize, C150DgmSocket *sock, bool readRequested);
-void sha1file(const char *filename, char *sha1);
-void loopFilesInDir(DIR *SRC, string dirName, C150DgmSocket *sock);
-void readAndSendFile(C150NastyFile& nastyFile, const char *filename, const char *dirname, C150DgmSocket *sock);
-void sha1string(const char *input, char *sha1);
-void clientEndToEnd(const char *filename, const char *dirname, C150DgmSocket *sock);
-int numPacketsFile(C150NastyFile& nastyFile);
-void receiveAndRespond(vector<string> *dataPackets, const char *filename, const char *dirname, C150DgmSocket *sock, string incoming);
+struct serverLink;
+struct bundleEntry;
+LoopCall<string> sendMessageToServer(const char *msg, size_t msgSize, struct serverLink *link, bool readRequested);
+void loopFilesInDir(string dirName, vector<C150DgmSocket *>& socks);
+LoopTask sendFiles(struct serverLink *link, string dirName, function<bool(struct walkEntry&)> *nextFile, int *running, exception_ptr *failed);
+LoopCall<bool> sendSourceFile(string dirName, string relPath, int attempt, struct serverLink *link);
+void scheduleRetry(string relPath, int attempt);
+LoopCall<int> runDueRetries(string dirName, bool wait, struct serverLink *link);
+LoopCall<bool> readAndSendFile(C150NastyFile& nastyFile, const char *filename, const char *dirname, int attempt, struct serverLink *link);
+LoopCall<char> sendFileData(const char *filename, long fileSize, const char *fileSha1, function<size_t(char *, size_t)> readChunk, struct serverLink *link);
+LoopCall<bool> clientEndToEnd(const char *filename, const char *sha1, int attempt, struct serverLink *link);
+long fileSizeFile(C150NastyFile& nastyFile);
+LoopCall<bool> receiveAndRespond(PacketPool& dataPackets, string startMessage, string fileNameHash, struct serverLink *link, const char *reply);
+LoopCall<ssize_t> exchangeWithServer(const char *msg, size_t msgSize, struct serverLink *link, bool readRequested, char *reply);
+void sendToServer(const char *msg, size_t msgSize, struct serverLink *link);
+LoopCall<ssize_t> readFromServer(struct serverLink *link, char *buf, size_t len, long ms);
+LoopCall<bool> addToBundle(const char *filename, const char *dirname, long fileSize, int attempt, struct serverLink *link);
+LoopCall<bool> sendBundle(struct serverLink *link);
+LoopCall<bool> bundleEndToEnd(string bundleName, vector<struct bundleEntry>& files, struct serverLink *link);
+LoopCall<string> negotiateDigest(struct serverLink *link);
+LoopCall<char> sendStriped(const char *filename, string filepath, long fileSize, const char *fileSha1, struct serverLink *link);
+LoopCall<bool> serverHasContents(const char *filename, const char *fileSha1, struct serverLink *link);
+LoopCall<bool> sendStripe(EventLoop *loop, PacketPool **pool, string filepath, string fileNameHash, struct sockaddr_in server, int firstPacket, int lastPacket);
+string padNumber(long n, size_t width);
 
 
 // Protocol message codes 
@@ -104,7 +133,26 @@ void receiveAndRespond(vector<string> *dataPackets, const char *filename, const
 #define FIN_ACK  '7'
 #define INIT_FCP '8'
 #define DATA_FCP '9'
-
+#define ZERO_FCP 'Z'
+#define PKT_DONE '!'
+#define PKT_LOST '@'
+#define ACK_BDL  'A'
+#define REQ_BDL  'B'
+#define BDL_RES  'R'
+#define START_FCP  'S'
+#define FILE_OK    'K'
+#define FILE_BAD   'X'
+#define NEED_START '?'
+#define STRIPE_REQ 'T'
+#define STRIPE_ACK 'U'
+#define HASH_REQ   'H'
+#define HASH_ACK   'J'
+#define DEDUP_REQ  'D'
+#define DEDUP_HIT  'L'
+#define DEDUP_MISS 'M'
+
+#define NEED_START_TRIES 8 // starts resent for one file before it fails
+#define REPLY_WAIT_MS 2000 // wait for a reply before sending again
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
 //
@@ -121,6 +169,60 @@ const int serverArg = 1;     // server name is 1st arg
 
 int fileNasty    = 0;
 int networkNasty = 0;
+int walkThreads  = 4;   // directory walker threads, set with --walkers
+enum schedulePolicy schedule = SCHEDULE_WALK; // order files are sent in, set with --schedule
+long bundleMax   = 0;   // files up to this many bytes are bundled, set with --bundle
+int stripeCount  = 1;   // flows per large file, set with --stripes
+int laneCount    = 1;   // files in flight at once, a socket each, set with --lanes
+bool zeroCopy    = false; // batched MSG_ZEROCOPY sends on the stripe flows, set with --zerocopy
+bool dedup       = true; // ask the server for a file's contents by digest first, set with --dedup
+const char *serverName; // for the stripe flows, which resolve it themselves
+string digestOffer = DIGEST_PREFERENCES; // digest algorithms offered, set with --hash
+int maxRetries   = 3;   // extra attempts for a file that fails its check, set with --retries
+long backoffMs   = 500; // wait before the first retry, doubled for each one after, set with --backoff
+int runFailures  = 0;   // files given up on and directories left unread, for the exit status
+vector<PacketPool *> retiredPools; // zero-copy sends never completed: never reused or freed
+
+//
+// Files that failed their end-to-end check, by the time (metricsNow)
+// they may go again. They are sent between the files still being
+// walked, and waited for only once the walk is done.
+//
+struct retryEntry {
+	string relPath;
+	int attempt;        // the attempt it will be, the first is 0
+};
+multimap<uint64_t, struct retryEntry> retryQueue;
+
+//
+// Small files waiting to go out together as one bundle: the files in
+// the order they were packed, and their contents back to back
+//
+struct bundleEntry {
+	string filename;
+	long size;
+	string sha1;
+	int attempt;
+};
+vector<struct bundleEntry> bundleFiles;
+string bundleData;
+int bundleCount = 0;    // bundles sent so far, for naming
+
+//
+// A lane: one control socket and the coroutine sending files on it.
+// The server keeps a session for each socket, so the lanes' files go
+// side by side. A reply is waited for on the event loop, so the C150
+// timeout is kept short and a read only takes what has arrived. The
+// lanes share one thread's metrics, so with several a file's line also
+// counts what the others did meanwhile.
+//
+struct serverLink {
+	EventLoop *loop;
+	C150DgmSocket *sock;
+	SocketWaiter *waiter;
+	PacketPool packets;                 // the file being sent, kept for resends
+	vector<PacketPool *> stripePools;   // one per flow of a striped file
+};
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
 //
@@ -138,14 +240,47 @@ main(int argc, char *argv[]) {
     GRADEME(argc, argv);
 
      // Variable declarations
-     DIR *SRC;
-     C150NastyDgmSocket *sock;
+     vector<C150DgmSocket *> socks;
 
      // Make sure command line looks right
-     if (argc != 5) {
-       fprintf(stderr,"Correct syntxt is: %s <server> <networknastiness> <filenastiness> <srcdir>\n", argv[0]);
+     if (argc < 5) {
+       fprintf(stderr,"Correct syntxt is: %s <server> <networknastiness> <filenastiness> <srcdir> [--walkers=N] [--schedule=walk|shortest|largest|fair] [--bundle[=maxbytes]] [--stripes=N] [--lanes=N] [--zerocopy] [--dedup=on|off] [--hash=alg,...] [--retries=N] [--backoff=ms] [--metrics=path] [--log=none|file|packet]\n", argv[0]);
           exit(1);
      }
+     for (int i = 5; i < argc; i++) {
+       if (strncmp(argv[i], "--walkers=", 10) == 0) {
+         walkThreads = atoi(argv[i] + 10);
+       } else if (strncmp(argv[i], "--schedule=", 11) == 0 and parseSchedule(argv[i] + 11, schedule)) {
+         // policy already set, an unknown one falls through to the usage
+       } else if (strcmp(argv[i], "--bundle") == 0) {
+         bundleMax = BUNDLE_MAX_FILE;
+       } else if (strncmp(argv[i], "--bundle=", 9) == 0) {
+         bundleMax = atol(argv[i] + 9);
+       } else if (strncmp(argv[i], "--stripes=", 10) == 0) {
+         stripeCount = atoi(argv[i] + 10);
+       } else if (strncmp(argv[i], "--lanes=", 8) == 0) {
+         laneCount = max(1, min(atoi(argv[i] + 8), LANES_MAX));
+       } else if (strcmp(argv[i], "--zerocopy") == 0) {
+         zeroCopy = true;
+       } else if (strcmp(argv[i], "--dedup=on") == 0 or strcmp(argv[i], "--dedup=off") == 0) {
+         dedup = strcmp(argv[i], "--dedup=on") == 0;
+       } else if (strncmp(argv[i], "--hash=", 7) == 0) {
+         digestOffer = argv[i] + 7;
+       } else if (strncmp(argv[i], "--retries=", 10) == 0) {
+         maxRetries = atoi(argv[i] + 10);
+       } else if (strncmp(argv[i], "--backoff=", 10) == 0) {
+         backoffMs = atol(argv[i] + 10);
+       } else if (strncmp(argv[i], "--metrics=", 10) == 0) {
+         metricsOpen("fileclient", argv[i] + 10);
+       } else if (strncmp(argv[i], "--log=", 6) == 0 and fclogSetLevel(argv[i] + 6)) {
+         // level already set, an unknown one falls through to the usage
+       } else {
+         fprintf(stderr,"Correct syntxt is: %s <server> <networknastiness> <filenastiness> <srcdir> [--walkers=N] [--schedule=walk|shortest|largest|fair] [--bundle[=maxbytes]] [--stripes=N] [--lanes=N] [--zerocopy] [--dedup=on|off] [--hash=alg,...] [--retries=N] [--backoff=ms] [--metrics=path] [--log=none|file|packet]\n", argv[0]);
+         exit(1);
+       }
+     }
+
+     fclogOpen("fileclient", "fileclientlog.txt");
 
     //        Send / receive / print 
     try {
@@ -156,28 +291,22 @@ main(int argc, char *argv[]) {
 		string dirName = string(argv[4]) + "/";
 
 		networkNasty = atoi(argv[2]);
-		c150debug->printf(C150APPLICATION,"Creating C150NastyDgmSocket(nastiness=%d)",
-			 networkNasty);
-        sock = new C150NastyDgmSocket(networkNasty);
-        sock -> turnOnTimeouts(2000);
+		c150debug->printf(C150APPLICATION,"Creating %d C150NastyDgmSocket(nastiness=%d)",
+			 laneCount, networkNasty);
+		for (int i = 0; i < laneCount; i++) {
+			C150NastyDgmSocket *sock = new C150NastyDgmSocket(networkNasty);
+			// Replies are waited for on the event loop, see serverLink
+			sock -> turnOnTimeouts(CONTROL_READ_MS);
+			sock -> setServerName(argv[1]);
+			socks.push_back(sock);
+		}
         c150debug->printf(C150APPLICATION,"Ready to accept messages");
-        sock -> setServerName(argv[1]); 
-		//
-		// Open the source directory
-		//
-		SRC = opendir(argv[4]);
-		if (SRC == NULL) {
-			fprintf(stderr,"Error opening source directory %s\n", argv[4]);     
-			exit(8);
-      	}
-
+        serverName = argv[serverArg];
 		fileNasty = atoi(argv[3]);
-		
-		// Loop through files in directory, sending each to the servers
-		loopFilesInDir(SRC, dirName, sock);
 
-		// Close the open directory
-		closedir(SRC);
+		// Loop through files in the directory tree, sending each to the server
+		loopFilesInDir(dirName, socks);
+		metricsRunDone();
 	}
 
     //
@@ -191,81 +320,327 @@ main(int argc, char *argv[]) {
         cerr << argv[0] << ": caught C150NetworkException: " << e.formattedExplanation() << endl;
     } 
 
-	delete sock;
-    return 0;
+	for (auto sock : socks)
+		delete sock;
+    return runFailures > 0 ? 1 : 0;
 }
 
 /*
- * Loops through a directory, processing each file to another function
+ * Loops through a directory tree, processing each file to another function.
+ * The tree is enumerated by a DirWalker in the background, so sending
+ * starts with the first file found rather than after the whole walk.
+ * With a size schedule the whole tree is walked and sized first, then
+ * sent in the schedule's order.
+ * Files are named by their path relative to dirName. Files that fail
+ * their end-to-end check go again, in between the others, until they
+ * succeed or run out of retries.
+ * The files go out in one lane per socket, each a sendFiles coroutine
+ * on an event loop run on this thread, so while one lane waits for the
+ * server the others go on sending.
  * Returns nothing
  */
-void loopFilesInDir(DIR *SRC, string dirName, C150DgmSocket *sock) {
+void loopFilesInDir(string dirName, vector<C150DgmSocket *>& socks) {
 
 	//  Loop copying the files
 	//
 	//    copyfile takes name of target file
 	//
-	struct dirent *sourceFile;
-	C150NastyFile nastyFile(fileNasty); // Global variable fileNasty
-	void *ret;
-	string filePath;
-
-	while ((sourceFile = readdir(SRC)) != NULL) {
-		// skip the . and .. names
-		if ((strcmp(sourceFile -> d_name, ".") == 0) ||
-			(strcmp(sourceFile -> d_name, "..") == 0 )) {
-			continue;          // never copy . or ..
+	DirWalker walker(dirName, walkThreads, schedule != SCHEDULE_WALK);
+	struct walkEntry sourceFile;
+
+	vector<struct walkEntry> scheduled;
+	size_t nextScheduled = 0;
+	if (schedule != SCHEDULE_WALK) {
+		while (walker.next(sourceFile))
+			scheduled.push_back(sourceFile);
+		orderFiles(scheduled, schedule);
+	}
+	function<bool(struct walkEntry&)> nextFile = [&](struct walkEntry& entry) {
+		if (schedule == SCHEDULE_WALK)
+			return walker.next(entry);
+		if (nextScheduled == scheduled.size())
+			return false;
+		entry = scheduled[nextScheduled++];
+		return true;
+	};
+
+	EventLoop loop;
+	vector<struct serverLink *> links;
+	int running = socks.size();
+	exception_ptr failed;
+	for (auto sock : socks) {
+		struct serverLink *link = new serverLink;
+		link -> loop = &loop;
+		link -> sock = sock;
+		link -> waiter = new SocketWaiter(&loop, sock -> getSocketDescriptor());
+		link -> stripePools.assign(STRIPE_MAX, NULL);
+		links.push_back(link);
+		loop.post([link, dirName, &nextFile, &running, &failed]() {
+			sendFiles(link, dirName, &nextFile, &running, &failed);
+		});
+	}
+	loop.run();
+	for (auto link : links) {
+		delete link -> waiter;
+		delete link;
+	}
+
+	// A lane that lost the server ends the run, as the one socket did
+	if (failed)
+		rethrow_exception(failed);
+
+	// The files of a directory that could not be read were never sent
+	int unreadable = walker.unreadableDirs();
+	if (unreadable > 0) {
+		cerr << unreadable << " directories could not be read, their files were not sent" << endl;
+		runFailures += unreadable;
+	}
+}
+
+/*
+ * One lane: sends files of the walk on its socket until none are left,
+ * then whatever retries come due. The lanes take their files from the
+ * same walk and pack the small ones into the same bundles. The last
+ * lane to finish, or the first to lose the server, stops the loop.
+ * Parameters: link, this lane's socket
+ *             dirName, the root of the tree, ending in '/'
+ *             nextFile, hands out the next file of the walk
+ *             running, the lanes not yet finished
+ *             failed, set to the network error that ended a lane
+ * Returns: nothing
+ */
+LoopTask sendFiles(struct serverLink *link, string dirName, function<bool(struct walkEntry&)> *nextFile, int *running, exception_ptr *failed) {
+
+	try {
+		// Agree on the digest algorithm before any file goes out. The
+		// server's session for each lane keeps its own.
+		co_await negotiateDigest(link);
+
+		struct walkEntry sourceFile;
+		while ((*nextFile)(sourceFile)) {
+			co_await sendSourceFile(dirName, sourceFile.relPath, 0, link);
+			co_await runDueRetries(dirName, false, link);
 		}
-		filePath = dirName + string(sourceFile -> d_name);
-		ret = nastyFile.fopen(filePath.c_str(), "r");
-		if (ret == NULL) {
-			perror("Cannot open file.");
-		} else {
-			readAndSendFile(nastyFile, sourceFile -> d_name, dirName.c_str(), sock);
-			nastyFile.fclose();
+
+		// Send whatever is left in the last bundle
+		co_await sendBundle(link);
+
+		//
+		// Only retries are left: wait for each in turn, bundling the small
+		// ones that come due together
+		//
+		while (!retryQueue.empty()) {
+			co_await runDueRetries(dirName, true, link);
+			co_await sendBundle(link);
 		}
 	}
+	catch (C150NetworkException& e) {
+		*failed = current_exception();
+	}
+	if (--*running == 0 or *failed)
+		link -> loop -> stop();
+}
+
+/*
+ * Sends one file of the tree, bundled or on its own
+ * Parameters: dirName, the root of the tree, ending in '/'
+ *             relPath, the file's path below it
+ *             attempt, the attempt this is, the first is 0
+ *             link, the lane's socket
+ * Returns: false if the file failed and was queued for a retry
+ */
+LoopCall<bool> sendSourceFile(string dirName, string relPath, int attempt, struct serverLink *link) {
+
+	C150NastyFile nastyFile(fileNasty); // Global variable fileNasty
+	string filePath = dirName + relPath;
+	if (nastyFile.fopen(filePath.c_str(), "r") == NULL) {
+		perror("Cannot open file.");
+        *GRADING << "File: " << relPath << " cannot be read, not sent, attempt " << attempt << endl;
+		scheduleRetry(relPath, attempt);
+		co_return false;
+	}
+
+	//
+	// Small files are packed into the current bundle rather than paying
+	// for a transfer and end-to-end exchange of their own. Names with a
+	// newline cannot be written in the bundle index.
+	//
+	long fileSize = fileSizeFile(nastyFile);
+	bool ok;
+	if (bundleMax > 0 and fileSize <= bundleMax and relPath.find('\n') == string::npos) {
+		ok = co_await addToBundle(relPath.c_str(), dirName.c_str(), fileSize, attempt, link);
+	} else if (!(ok = co_await readAndSendFile(nastyFile, relPath.c_str(), dirName.c_str(), attempt, link))) {
+		scheduleRetry(relPath, attempt);
+	}
+	nastyFile.fclose();
+	co_return ok;
+}
+
+/*
+ * Queues a file that failed for another attempt after its backoff, unless
+ * it has had all its retries
+ * Parameters: relPath, the file's path below the root
+ *             attempt, the attempt that failed
+ * Returns: nothing
+ */
+void scheduleRetry(string relPath, int attempt) {
+
+	if (attempt >= maxRetries) {
+		cerr << "Giving up on " << relPath << " after " << attempt + 1 << " attempts" << endl;
+		runFailures++;
+		return;
+	}
+	uint64_t wait = (uint64_t) backoffMs * 1000 << min(attempt, 20);
+	retryQueue.insert({metricsNow() + wait, {relPath, attempt + 1}});
+}
+
+/*
+ * Sends every queued retry whose backoff is over
+ * Parameters: dirName, the root of the tree
+ *             wait, sleep until the first one is due if none is yet
+ *             link, the lane's socket
+ * Returns: the number of retries sent. Another lane may have taken the
+ *          one waited for.
+ */
+LoopCall<int> runDueRetries(string dirName, bool wait, struct serverLink *link) {
+
+	int sent = 0;
+	if (retryQueue.empty())
+		co_return sent;
+	uint64_t now = metricsNow();
+	if (wait and retryQueue.begin() -> first > now) {
+		co_await sleepOn(link -> loop, (retryQueue.begin() -> first - now + 999) / 1000);
+		now = metricsNow();
+	}
+
+	// Retries that fail again are queued behind these, never run now
+	while (!retryQueue.empty() and retryQueue.begin() -> first <= now) {
+		struct retryEntry retry = retryQueue.begin() -> second;
+		retryQueue.erase(retryQueue.begin());
+		co_await sendSourceFile(dirName, retry.relPath, retry.attempt, link);
+		sent++;
+	}
+	co_return sent;
 }
 
 //
-// Calculates the number of packets needed to send a given file
-// Returns the number of packets needed
+// Finds the size in bytes of an open file
+// Returns the file size, leaving the file positioned at its end
 //
-int numPacketsFile(C150NastyFile& nastyFile) {
+long fileSizeFile(C150NastyFile& nastyFile) {
 
-	int fsize, numDataPackets;
 	nastyFile.fseek(0, SEEK_END);
-	fsize = nastyFile.ftell();
-	if (fsize == 0) {
-		return fsize; // File empty
-	}
-	if (fsize > MAX_DATA_SIZE - 1) {
-		numDataPackets = (int) (fsize / (MAX_DATA_SIZE - 1));
-		if (fsize % (MAX_DATA_SIZE - 1) != 0) {
-			numDataPackets += 1;
-		}
-	} else {
-		numDataPackets = 1;
-	}
-
-	return numDataPackets;
+	return nastyFile.ftell();
 }
 
 /*
- * Creates packets from a single file and begins sending the file
+ * Sends a single file and runs the end-to-end check on it
  * Parameters: nastyFile, a C150NastyFile that is open'd
  *             filename, which is the file name
  *             dirname, the directory name where the file is
- *             sock, the open socket
- * Returns: nothing
+ *             attempt, the attempt this is, the first is 0
+ *             link, the lane's socket
+ * Returns: true if the server found the file intact
  *
  */
-void readAndSendFile(C150NastyFile& nastyFile, const char *filename, const char *dirname, C150DgmSocket *sock) {
+LoopCall<bool> readAndSendFile(C150NastyFile& nastyFile, const char *filename, const char *dirname, int attempt, struct serverLink *link) {
+
+	long fileSize = fileSizeFile(nastyFile);
+	metricsFileStart();
+
+	//
+	// The full digest goes out in the start message, and is reused for
+	// the end-to-end check
+	//
+	string filepath = string(dirname) + string(filename);
+	//
+	// A file that cannot be read, or went away during the walk, fails on
+	// its own like one that fails its check; the run goes on
+	//
+	struct digestValue fileDigest;
+	if (!digestFile(filepath.c_str(), fileNasty, fileDigest)) {
+		cerr << "Cannot digest file " << filepath << endl;
+        *GRADING << "File: " << filename << " cannot be read, not sent, attempt " << attempt << endl;
+		metricsFileDone(filename, false);
+		co_return false;
+	}
+	struct digestHex sha1 = toHex(fileDigest);
+
+	//
+	// Contents the server already holds under another name are not sent
+	//
+	if (dedup and fileSize >= DEDUP_MIN_BYTES and co_await serverHasContents(filename, sha1.text, link)) {
+        *GRADING << "File: " << filename << " already on the server by digest, not sent, attempt " << attempt << endl;
+        *GRADING << "File: " << filename << " end-to-end check succeeded, attempt " << attempt << endl;
+		metricsFileDone(filename, true);
+		co_return true;
+	}
+
+	//
+	// The data is read again for the packets, voting on each extent
+	// like the digest did
+	//
+	ExtentReader reader(fileNasty);
+	if (!reader.open(filepath.c_str())) {
+		cerr << "Cannot open file " << filepath << endl;
+		metricsFileDone(filename, false);
+		co_return false;
+	}
+
+    *GRADING << "File: " << filename << " , beginning transmission, attempt " << attempt << endl;
+
+	bool striped = stripeCount > 1 and fileSize >= STRIPE_MIN_BYTES;
+	char status = striped ? co_await sendStriped(filename, filepath, fileSize, sha1.text, link) : 0;
+	if (!striped or status == STRIPE_ACK)
+		status = co_await sendFileData(filename, fileSize, sha1.text,
+				[&reader](char *buf, size_t len) { return reader.read(buf, len); }, link);
+
+	bool ok = false;
+	if (status == PKT_DONE) {
+		// All packets for this file succesfully received
+		// Commence end2end check
+        *GRADING << "File: " << string(filename) << " transmission complete, waiting for end-to-end check, attempt " << attempt << endl;
+		ok = co_await clientEndToEnd(filename, sha1.text, attempt, link);
+	} else if (status == FILE_OK or status == FILE_BAD) {
+		// The start message carried the whole file and the server has
+		// already checked it
+        *GRADING << "File: " << string(filename) << " transmission complete, waiting for end-to-end check, attempt " << attempt << endl;
+        *GRADING << "File: " << filename << " end-to-end check " << (status == FILE_OK ? "succeeded" : "failed")
+                 << ", attempt " << attempt << endl;
+		ok = status == FILE_OK;
+	}
+	metricsFileDone(filename, ok);
+	co_return ok;
+}
+
+/*
+ * Creates packets from a stream of bytes and sends them to the server as
+ * one file, resending whatever the server reports lost.
+ *
+ * The file opens with a START_FCP message carrying the name, size, full
+ * digest and, when it fits, the data of packet 1, so data flows without
+ * waiting for the server. A file whose data all fits in that message is
+ * written and checked by the server straight away, and its reply ends the
+ * transfer in one round trip. Retransmitting the start message is always
+ * safe: the server answers a repeat from its saved result.
+ *
+ * Parameters: filename, the name the server stores the bytes under
+ *             fileSize, the number of bytes readChunk will produce
+ *             fileSha1, digest of the bytes, or NULL if not known
+ *             readChunk, reads up to len bytes into buf, returns the count
+ *             link, the lane's socket
+ * Returns: PKT_DONE once the server reports every packet written,
+ *          FILE_OK or FILE_BAD if the start message finished the file,
+ *          0 if the server went quiet
+ *
+ */
+LoopCall<char> sendFileData(const char *filename, long fileSize, const char *fileSha1, function<size_t(char *, size_t)> readChunk, struct serverLink *link) {
 	int numDataPackets;
 	bool readRequested = false;
 	string incoming;
+	char reply[MAX_PACKET_SIZE];
 
-	numDataPackets = numPacketsFile(nastyFile);
+	numDataPackets = numPacketsFile(fileSize);
 
 	// If file is empty, make sure one data packet sends
 	if(numDataPackets == 0) {
@@ -273,14 +648,12 @@ void readAndSendFile(C150NastyFile& nastyFile, const char *filename, const char
 	}
 
 	//
-	// Array holds all dataPackets for this file in case need to resend
+	// Every packet of the file stays encoded in the pool in case it has
+	// to be resent. The pool's memory is reused from file to file.
 	//
-	vector<string> *dataPackets = new vector<string> (numDataPackets);
+	PacketPool& dataPackets = link -> packets;
+	dataPackets.reset(numDataPackets);
 
-	//
-	// Seek back to beginning for reading
-	//
-	nastyFile.rewind();
 	struct initialPacket initPkt;
 
 
@@ -291,43 +664,55 @@ void readAndSendFile(C150NastyFile& nastyFile, const char *filename, const char
 		numPacketsStr = "0" + numPacketsStr;
 	}
 
-    *GRADING << "File: " << filename << " , beginning transmission, attempt " << 0 << endl;
+	//
+	// Exact byte size lets the server preallocate the target up front
+	//
+	string fileSizeStr = to_string(fileSize);
+	while(fileSizeStr.length() < 16) {
+		fileSizeStr = "0" + fileSizeStr;
+	}
 
-    string firstMessage = initPkt.packetType + numPacketsStr + string(filename);
-	incoming  = sendMessageToServer(firstMessage.c_str(), firstMessage.length(), sock, readRequested);
-	//while (incoming[0] != '$') {
-		// Resend initial packet, server did not receive
-		//incoming= sendMessageToServer(firstMessage.c_str(), firstMessage.length(), sock, readRequested);
-	//}
+	//
+	// Start message header: START_FCP, packet count, size, digest, name
+	// length, whether packet 1 rides along, name. Names too long for it
+	// fall back to the plain INIT_FCP message.
+	//
+	string filenameStr  = string(filename);
+	string nameLenStr   = to_string(filenameStr.length());
+	while(nameLenStr.length() < 3) {
+		nameLenStr = "0" + nameLenStr;
+	}
+	string startHeader = START_FCP + numPacketsStr + fileSizeStr
+			+ (fileSha1 ? string(fileSha1) : string(SHA_DIGEST_LENGTH * 2, '0')) + nameLenStr;
+	bool useStart = startHeader.length() + 1 + filenameStr.length() < MAX_PACKET_SIZE;
+	string startMessage;
+	if (!useStart) {
+		startMessage = initPkt.packetType + numPacketsStr + fileSizeStr + filenameStr;
+		sendToServer(startMessage.c_str(), startMessage.length(), link);
+	}
 
 	//
 	// Create and send data packets
 	//
-	struct dataPacket dataPkt;
-
-	// Prepare SHA1 digest variables
-	char * databuf = (char *) malloc(MAX_DATA_SIZE);
-	char * sha1buf = (char *) calloc((SHA_DIGEST_LENGTH * 2) + 1, 1);
-    
+	string fileNameHash = nameHash(filename);
 
 	//
-	// Get hash digest of filename to send
+	// Packets of nothing but zeros are not sent one by one: each run of
+	// them goes as a single zero range when it ends. Each such packet
+	// keeps a zero range of its own in the pool, which is what goes again
+	// if the server asks for it.
 	//
-	sha1string(filename, sha1buf);
-	dataPkt.fileNameHash = string(sha1buf);
+	char zeroMessage[MAX_PACKET_SIZE];
+	int zeroFrom = 0;   // first packet of the run not yet sent, 0 for none
+	int sent = 0;       // packets and zero ranges sent, for pacing
 
-	string dataMessage; 
 	int i;
 	for(i = 0; i < numDataPackets; i++) {
-		dataPkt.packetNum = to_string(i + 1);
-		if (dataPkt.packetNum.length() > 16)
-			perror("Number of packets too large to store in 16 chars.");
-		while(dataPkt.packetNum.length() < 16) {
-			dataPkt.packetNum = "0" + dataPkt.packetNum;
-		}	
-		memset(databuf, 0, MAX_DATA_SIZE);
-		
-		int read = nastyFile.fread(databuf, 1, MAX_DATA_SIZE - 1);
+		//
+		// The data is read straight into the message, behind its header
+		//
+		char *dataMessage = dataPackets.slot(i);
+		size_t read = readChunk(dataMessage + DATA_HEADER_SIZE, MAX_DATA_SIZE - 1);
 
 		if (i == numDataPackets - 1) {
 			readRequested = true;
@@ -337,184 +722,672 @@ void readAndSendFile(C150NastyFile& nastyFile, const char *filename, const char
 			}
 		}
 
-		dataPkt.data = string(databuf);
+		bool zeros = i != 0 and allZero(dataMessage + DATA_HEADER_SIZE, read);
+		if (zeros) {
+			dataPackets.length(i) = encodeZeroRange(dataMessage, fileNameHash.c_str(), i + 1, i + 1);
+			if (zeroFrom == 0)
+				zeroFrom = i + 1;
+			if (i != numDataPackets - 1)
+				continue;
+		} else {
+			dataPackets.length(i) = encodeData(dataMessage, fileNameHash.c_str(), i + 1, read);
+			threadMetrics().packets++;
+			threadMetrics().bytes += read;
+		}
+
+		if (zeroFrom != 0) {
+			size_t zeroLen = encodeZeroRange(zeroMessage, fileNameHash.c_str(), zeroFrom, zeros ? i + 1 : i);
+			FCLOG(FCLOG_PACKET, "Sending zero range from packet %ld", zeroFrom, 0);
+			threadMetrics().packets++;
+			if (zeros and readRequested)
+				co_await exchangeWithServer(zeroMessage, zeroLen, link, true, reply);
+			else
+				sendToServer(zeroMessage, zeroLen, link);
+			zeroFrom = 0;
+			sent++;
+			if (zeros)
+				break;
+		}
 
 		//
-		// Store and send packet
+		// Packet 1 goes inside the start message when there is room for it.
+		// Only a known digest lets the server finish the file on its own.
 		//
-		dataMessage = dataPkt.packetType + dataPkt.checksum + dataPkt.fileNameHash 
-						+ dataPkt.packetNum + dataPkt.data;
-		(*dataPackets)[i] = dataMessage;
+		if (i == 0 and useStart) {
+			bool inlineData = fileSha1 != NULL and
+					startHeader.length() + 1 + filenameStr.length() + read < MAX_PACKET_SIZE;
+			startMessage = startHeader + (inlineData ? "1" : "0") + filenameStr
+					+ (inlineData ? string(dataMessage + DATA_HEADER_SIZE, read) : "");
+			if (inlineData and numDataPackets == 1) {
+				//
+				// Whole file in one datagram: the reply is the verdict
+				//
+				string expected = FILE_OK + filenameStr;
+				string expectedBad = FILE_BAD + filenameStr;
+				incoming = co_await sendMessageToServer(startMessage.c_str(), startMessage.length(), link, true);
+				while (incoming != expected and incoming != expectedBad) {
+					incoming = co_await sendMessageToServer(startMessage.c_str(), startMessage.length(), link, true);
+				}
+				co_return incoming[0];
+			}
+			FCLOG_MSG(FCLOG_FILE, "Sending start of file, %ld packets", numDataPackets, 0,
+					filenameStr.data(), filenameStr.length());
+			sendToServer(startMessage.c_str(), startMessage.length(), link);
+			if (inlineData) {
+				sent++;
+				continue;
+			}
+		}
 		
-        if((i % 100 == 0) and (i != 0)) {
-            usleep(350000);
+        if((sent % 100 == 0) and (sent != 0)) {
+            co_await sleepOn(link -> loop, 350);
         }
-        cout << "sending packet " << dataPkt.packetNum << endl;
-		incoming = sendMessageToServer(dataMessage.c_str(), dataMessage.length(), sock, readRequested);
+        FCLOG(FCLOG_PACKET, "Sending packet %ld", i + 1, 0);
+		if (readRequested)
+			co_await exchangeWithServer(dataMessage, dataPackets.length(i), link, true, reply);
+		else
+			sendToServer(dataMessage, dataPackets.length(i), link);
+		sent++;
     }
 
-	// Free alloc'd memory
-	free(databuf);
-	free(sha1buf);
-
 	// Pass off to receiveAndRespond function
-	receiveAndRespond(dataPackets, filename, dirname, sock, incoming);
+	bool done = co_await receiveAndRespond(dataPackets, startMessage, fileNameHash, link, reply);
+	co_return done ? PKT_DONE : 0;
+}
+
+/*
+ * Offers the server the digest algorithms in digestOffer and switches to
+ * the one it picks, which is then used for every digest either side sends.
+ * Parameters: link, the lane's socket
+ * Returns: the name of the algorithm chosen
+ */
+LoopCall<string> negotiateDigest(struct serverLink *link) {
+
+	string message = HASH_REQ + digestOffer;
+	string incoming = co_await sendMessageToServer(message.c_str(), message.length(), link, true);
+	while (incoming.empty() or incoming[0] != HASH_ACK) {
+		incoming = co_await sendMessageToServer(message.c_str(), message.length(), link, true);
+	}
+
+	if (selectDigest(incoming.substr(1)) == "") {
+		fprintf(stderr,"Server chose unknown digest algorithm %s\n", incoming.substr(1).c_str());
+		exit(1);
+	}
+	c150debug->printf(C150APPLICATION,"Using digest algorithm %s", digestName());
+	co_return string(digestName());
+}
+
+/*
+ * Sends one large file over several flows at once. The server is asked
+ * for stripeCount flows on the main socket and replies with a port for
+ * each; the packets are split into contiguous runs, one per flow, and
+ * every run is sent by a sendStripe coroutine reading its own part of
+ * the file. The runs are started together on the lane's event loop and
+ * then awaited in turn, so the other lanes go on meanwhile. The
+ * end-to-end check afterwards covers the whole file as usual.
+ *
+ * Parameters: filename, the name the server stores the file under
+ *             filepath, where the file is on this side
+ *             fileSize, its size in bytes
+ *             fileSha1, its digest
+ *             link, the lane's socket
+ * Returns: PKT_DONE once every flow reports its run written, STRIPE_ACK
+ *          if the server has no flows to offer and the file should be
+ *          sent unstriped, 0 otherwise
+ *
+ */
+LoopCall<char> sendStriped(const char *filename, string filepath, long fileSize, const char *fileSha1, struct serverLink *link) {
+
+	int numDataPackets = numPacketsFile(fileSize);
+	string request = STRIPE_REQ + padNumber(numDataPackets, 16) + padNumber(fileSize, 16)
+			+ string(fileSha1) + padNumber(min(stripeCount, STRIPE_MAX), 2) + filename;
+
+	//
+	// Repeats of the request are answered with the same ports
+	//
+	string expected = STRIPE_ACK + string(filename) + ":";
+	string incoming = co_await sendMessageToServer(request.c_str(), request.length(), link, true);
+	while (incoming.compare(0, expected.length(), expected) != 0) {
+		incoming = co_await sendMessageToServer(request.c_str(), request.length(), link, true);
+	}
+
+	//An empty list means the server could not open the flows. A port
+	//that is not a number leaves the list empty too, but the file then
+	//fails like one whose flows cannot be reached
+	if (incoming.length() == expected.length())
+		co_return STRIPE_ACK;
+	vector<int> ports;
+	stringstream portList(incoming.substr(expected.length()));
+	string port;
+	while (getline(portList, port, ',')) {
+		long n = port.length() >= 1 and port.length() <= 5 ? getNumber(port.c_str(), port.length()) : -1;
+		if (n < 1 or n > 65535) {
+			ports.clear();
+			break;
+		}
+		ports.push_back(n);
+	}
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (ports.empty() or getaddrinfo(serverName, NULL, &hints, &res) != 0) {
+		cerr << "Cannot reach stripe flows for " << filename << endl;
+		co_return 0;
+	}
+	struct sockaddr_in server = *(struct sockaddr_in *) res -> ai_addr;
+	freeaddrinfo(res);
+
+	string fileNameHash = nameHash(filename);
+
+	//
+	// Same split as the server: equal runs, the last one shorter
+	//
+	int numStripes = ports.size();
+	int perStripe = (numDataPackets + numStripes - 1) / numStripes;
+	//
+	// Each flow encodes into a pool of the lane's, kept for the next file
+	// unless sendStripe has to retire it
+	//
+	vector<LoopCall<bool>> runs;
+	for (int i = 0; i < numStripes; i++) {
+		server.sin_port = htons(ports[i]);
+		int first = 1 + i * perStripe;
+		int last = min(numDataPackets, (i + 1) * perStripe);
+		if (link -> stripePools[i] == NULL)
+			link -> stripePools[i] = new PacketPool;
+		runs.push_back(sendStripe(link -> loop, &link -> stripePools[i], filepath, fileNameHash, server, first, last));
+	}
+	bool allDone = true;
+	for (auto& run : runs)
+		allDone = co_await run and allDone;
+
+	co_return allDone ? PKT_DONE : 0;
+}
+
+/*
+ * Asks the server whether it already has a file with these contents and,
+ * if it has, to make the file from them. Repeats of the question for the
+ * same file get the same answer.
+ * Parameters: filename, the name the server stores the file under
+ *             fileSha1, its digest
+ *             link, the lane's socket
+ * Returns: true if the server made the file, false if it must be sent
+ */
+LoopCall<bool> serverHasContents(const char *filename, const char *fileSha1, struct serverLink *link) {
+
+	string request = DEDUP_REQ + string(fileSha1) + filename;
+	string hit = DEDUP_HIT + string(filename);
+	string miss = DEDUP_MISS + string(filename);
+	string incoming = co_await sendMessageToServer(request.c_str(), request.length(), link, true);
+	while (incoming != hit and incoming != miss) {
+		incoming = co_await sendMessageToServer(request.c_str(), request.length(), link, true);
+	}
+	co_return incoming == hit;
+}
+
+/*
+ * Sends one run of a striped file on a socket of its own and resends
+ * whatever the server reports lost, until the server reports the run
+ * done. A coroutine on loop with its own file handle: it gives way to
+ * the other runs while it paces its sends and while it waits for the
+ * server. With
+ * --zerocopy the first pass goes out in zero-copy batches, which must
+ * complete before the pool is used for another file. If they do not, the
+ * pool is retired and *pool replaced with a new one.
+ * Parameters: loop, the lane's event loop, shared by the runs
+ *             pool, the pool this run encodes into
+ *             filepath, the file on this side
+ *             fileNameHash, the filename hash carried by the data packets
+ *             server, the address of this run's flow on the server
+ *             firstPacket, lastPacket, the run of packets to send
+ * Returns: true once the server has the whole run
+ */
+LoopCall<bool> sendStripe(EventLoop *loop, PacketPool **pool, string filepath, string fileNameHash, struct sockaddr_in server, int firstPacket, int lastPacket) {
+
+	PacketPool& dataPackets = **pool;
+	bool done = false;
+	ExtentReader reader(fileNasty);
+	int flow = -1;
+	if (!reader.open(filepath.c_str())) {
+		cerr << "Cannot open file " << filepath << endl;
+	} else if ((flow = socket(AF_INET, SOCK_DGRAM, 0)) < 0 or
+			connect(flow, (struct sockaddr *) &server, sizeof(server)) != 0) {
+		perror("Cannot open stripe socket");
+		reader.close();
+	} else {
+		BatchSender sender(flow, zeroCopy);
+		long offset = (long) (MAX_DATA_SIZE - 1) * (firstPacket - 1);
+		size_t count = lastPacket - firstPacket + 1;
+		//Packed back to back, a batch is one piece of memory to send
+		dataPackets.reset(count, zeroCopy ? DATA_MESSAGE_SIZE : MAX_PACKET_SIZE);
+
+		//Runs of zero packets go as zero ranges, as in sendFileData
+		char zeroMessage[MAX_PACKET_SIZE];
+		int zeroFrom = 0;
+		size_t sent = 0;
+		for (size_t i = 0; i <= count; i++) {
+			char *dataMessage = NULL;
+			bool zeros = true;
+			if (i < count) {
+				dataMessage = dataPackets.slot(i);
+				size_t read = reader.read(offset, dataMessage + DATA_HEADER_SIZE, MAX_DATA_SIZE - 1);
+				offset += read;
+				zeros = allZero(dataMessage + DATA_HEADER_SIZE, read);
+				if (zeros) {
+					dataPackets.length(i) = encodeZeroRange(dataMessage, fileNameHash.c_str(),
+							firstPacket + i, firstPacket + i);
+					if (zeroFrom == 0)
+						zeroFrom = firstPacket + i;
+					continue;
+				}
+				dataPackets.length(i) = encodeData(dataMessage, fileNameHash.c_str(), firstPacket + i, read);
+				threadMetrics().packets++;
+				threadMetrics().bytes += read;
+			}
+
+			if (zeroFrom != 0) {
+				size_t zeroLen = encodeZeroRange(zeroMessage, fileNameHash.c_str(), zeroFrom, firstPacket + i - 1);
+				threadMetrics().packets++;
+				sender.send(zeroMessage, zeroLen);
+				zeroFrom = 0;
+				sent++;
+			}
+			if (zeros)
+				break;
+
+			if((sent % 100 == 0) and (sent != 0)) {
+				sender.flush();
+				co_await sleepOn(loop, 350);
+			}
+			sender.add(dataMessage, dataPackets.length(i));
+			sent++;
+		}
+		sender.flush();
+		reader.close();
+
+		//
+		// The server asks for lost packets; silence means it may not have
+		// seen the end of the run, so the last packet goes again. Every
+		// reply waiting is taken before waiting again.
+		//
+		SocketWaiter waiter(loop, flow);
+		char incoming[MAX_PACKET_SIZE];
+		int quietRounds = 0;
+		while (quietRounds < STRIPE_IDLE_ROUNDS and !done) {
+			if (!co_await waiter.readable(2000)) {
+				quietRounds++;
+				threadMetrics().timeouts++;
+				threadMetrics().retransmits++;
+				sender.send(dataPackets.slot(count - 1), dataPackets.length(count - 1));
+				continue;
+			}
+			quietRounds = 0;
+			sender.reap();
+			ssize_t len;
+			while (!done and (len = recv(flow, incoming, sizeof(incoming) - 1, MSG_DONTWAIT)) > 0) {
+				incoming[len] = '\0';
+				if (incoming[0] == PKT_DONE and fileNameHash.compare(0, DIGEST_HEX_LENGTH, incoming + 1) == 0)
+					done = true;
+				if (incoming[0] == PKT_LOST and len >= 1 + NUMBER_WIDTH) {
+					long n = getNumber(incoming + 1, NUMBER_WIDTH);
+					if (n >= firstPacket and n <= lastPacket) {
+						threadMetrics().retransmits++;
+						sender.send(dataPackets.slot(n - firstPacket), dataPackets.length(n - firstPacket));
+					}
+				}
+			}
+		}
+
+		//
+		// Completions normally follow the sends within microseconds. A pool
+		// the kernel may still be reading is never written or freed again:
+		// it is retired, and the next file gets a new one
+		//
+		for (int i = 0; i < 20 and !sender.idle(); i++) {
+			co_await waiter.readable(100);
+			sender.reap();
+		}
+		if (!sender.idle()) {
+			cerr << "Zero-copy sends of " << filepath << " still pending, retiring their packet pool" << endl;
+			retiredPools.push_back(*pool);
+			*pool = new PacketPool;
+		}
+	}
+	if (flow >= 0)
+		close(flow);
+	co_return done;
+}
+
+/*
+ * Pads a number with zeros on the left
+ * Parameters: n, the number
+ *             width, the length to pad to
+ * Returns: the padded number
+ */
+string padNumber(long n, size_t width) {
+	string str = to_string(n);
+	if (str.length() < width)
+		str.insert(0, width - str.length(), '0');
+	return str;
 }
 
 /*	
  * Receives messages from the server and sends responses
- * Parameters: dataPackets, a list of data packets already sent
- *             filename, a file name
- *             dirname, the directory name in which the file resides
- *             sock, the open socket to server
- *             incoming, the message received from the server
- * Returns: nothing
+ * Parameters: dataPackets, the data packets already sent
+ *             startMessage, the message that opened the file
+ *             fileNameHash, the filename hash carried by the data packets
+ *             link, the lane's socket
+ *             reply, the message received from the server
+ * Returns: true if the server reported all packets received, false if it
+ *          went quiet first or kept asking for the start
  */
-void receiveAndRespond(vector<string> *dataPackets, const char *filename, const char *dirname, C150DgmSocket *sock, string incoming) {
-    char incomingMessage[512];
-    int readlen = 0, firstloop = 0;
-	string dataMessage;
-	bool readRequested = true, endToEndDone = false;
-
-    while(endToEndDone == false) {
-        if(firstloop) {
-            readlen = sock -> read(incomingMessage, sizeof(incomingMessage)-1);
-            if(sock ->timedout() == true) {
+LoopCall<bool> receiveAndRespond(PacketPool& dataPackets, string startMessage, string fileNameHash, struct serverLink *link, const char *reply) {
+    char incoming[MAX_PACKET_SIZE];
+    int readlen = 0;
+	int startsResent = 0;
+	bool readRequested = true, transferDone = false, haveIncoming = true;
+
+	strcpy(incoming, reply);
+    while(transferDone == false) {
+        if(!haveIncoming) {
+            readlen = co_await readFromServer(link, incoming, sizeof(incoming)-1, REPLY_WAIT_MS);
+            if(readlen < 0) {
+                threadMetrics().timeouts++;
                 break;
             }
-            incomingMessage[readlen] = '\0'; // make sure null terminated
-            incoming = string(incomingMessage);
+            incoming[readlen] = '\0'; // make sure null terminated
         }
+        haveIncoming = false;
+
         if (incoming[0] == '!') {
-            firstloop++;
 			// All packets for this file succesfully received
-			// Commence end2end check
-            *GRADING << "File: " << string(filename) << " transmission complete, waiting for end-to-end check, attempt " << 0 << endl;
-			clientEndToEnd(filename, dirname, sock); 
-            break;
+            transferDone = true;
         } else if (incoming[0] == '@') {
-            firstloop++;
             do {
 				// Packet(s) requested by server
-				int requestedPacketNum   = stoi(incoming.substr(1,16));
-				string requestedFileName = incoming.substr(16,40);
+				long requestedPacketNum = getNumber(incoming + 1, NUMBER_WIDTH);
+				if (requestedPacketNum < 1 or requestedPacketNum > (long) dataPackets.size())
+					break;
 				// Resend requested packet
-				dataMessage = (*dataPackets)[requestedPacketNum - 1];
-
 				assert(readRequested == true);
-				incoming = string(sendMessageToServer(dataMessage.c_str(), dataMessage.length(), sock, readRequested));
+				threadMetrics().retransmits++;
+				co_await exchangeWithServer(dataPackets.slot(requestedPacketNum - 1), dataPackets.length(requestedPacketNum - 1),
+						link, readRequested, incoming);
 				if (incoming[0] == '!') {
-                    *GRADING << "File: " << string(filename) << " transmission complete, waiting for end-to-end check, attempt " << 0 << endl;
-					clientEndToEnd(filename, dirname, sock);
-                    endToEndDone = true;
+                    transferDone = true;
                     break;
 				}
         	} while (incoming[0] == '@');
-        } else {
-            firstloop++;
+        } else if (incoming[0] == NEED_START and fileNameHash.compare(0, DIGEST_HEX_LENGTH, incoming + 1) == 0) {
+			// The start message was lost, so the server has been dropping
+			// this file's data. Start it again and resend the last packet
+			// so the server times out and asks for the rest. A server that
+			// keeps asking is not taking the start, and the file fails.
+			if (++startsResent > NEED_START_TRIES)
+				break;
+			sendToServer(startMessage.c_str(), startMessage.length(), link);
+			threadMetrics().retransmits++;
+			size_t last = dataPackets.size() - 1;
+			co_await exchangeWithServer(dataPackets.slot(last), dataPackets.length(last), link, readRequested, incoming);
+			haveIncoming = true;
         }
     }
-	delete dataPackets;
+	co_return transferDone;
 }
 
 /*
- * Initiates the end-to-end protocol, sending protocol messages to server
- * 	and processing received messages.
- * Parameters: filename, the name of a file for which the check is requested,
-               dirname, the directory path in which the file resides
-		       sock, the C150DgmSocket connected to the server
- * Returns: Nothing
+ * Packs a small file into the current bundle, sending the bundle first if
+ * this file would take it past its limits. Other lanes may pack more
+ * files meanwhile, so the limits are checked again after.
+ * Parameters: filename, the file name relative to dirname
+ *             dirname, the directory name where the file is
+ *             fileSize, the size of the file in bytes
+ *             link, the lane's socket
+ * Returns: false if the file could not be read and was queued for a retry
+ */
+LoopCall<bool> addToBundle(const char *filename, const char *dirname, long fileSize, int attempt, struct serverLink *link) {
+
+	while (!bundleFiles.empty() and (bundleFiles.size() >= BUNDLE_MAX_FILES or
+			bundleData.length() + fileSize > BUNDLE_MAX_BYTES)) {
+		co_await sendBundle(link);
+	}
+
+	//
+	// Read the contents and take the end-to-end digest now, while the file
+	// is at hand
+	//
+	string filepath = string(dirname) + string(filename);
+	size_t start = bundleData.length();
+	bundleData.resize(start + fileSize);
+	ExtentReader reader(fileNasty);
+	long read = reader.open(filepath.c_str()) ? reader.read(0, &bundleData[start], fileSize) : 0;
+	if (read != fileSize) {
+		cerr << "Not enough bytes read by fread" << endl;
+		bundleData.resize(start + (read > 0 ? read : 0));
+	}
+
+	struct digestValue fileDigest;
+	if (!digestFile(filepath.c_str(), fileNasty, fileDigest)) {
+		cerr << "Cannot digest file " << filepath << endl;
+        *GRADING << "File: " << filename << " cannot be read, not sent, attempt " << attempt << endl;
+		bundleData.resize(start);
+		scheduleRetry(filename, attempt);
+		co_return false;
+	}
+
+	bundleFiles.push_back({string(filename), (long) (bundleData.length() - start), toHex(fileDigest).str(), attempt});
+
+    *GRADING << "File: " << filename << " , beginning transmission, attempt " << attempt << endl;
+	co_return true;
+}
+
+/*
+ * Sends the current bundle as one transfer and runs one end-to-end
+ * exchange covering every file in it. The bundle starts with an index,
+ * one "<size> <sha1> <filename>" line per file and a blank line, followed
+ * by the file contents back to back in index order. The bundle is taken
+ * whole before anything is sent, and other lanes start the next one.
+ * Parameters: link, the lane's socket
+ * Returns: false if any file in it failed and was queued for a retry
  */
-void clientEndToEnd(const char *filename, const char *dirname, C150DgmSocket *sock) {
+LoopCall<bool> sendBundle(struct serverLink *link) {
+
+	if (bundleFiles.empty())
+		co_return true;
+
+	vector<struct bundleEntry> files;
+	files.swap(bundleFiles);
+	string bundleName = string(BUNDLE_PREFIX) + to_string(getpid()) + "." + to_string(bundleCount++);
+
+	string bundle;
+	for (auto& f : files) {
+		bundle += to_string(f.size) + " " + f.sha1 + " " + f.filename + "\n";
+	}
+	bundle += "\n";
+	bundle += bundleData;
+	bundleData.clear();
+
+	size_t pos = 0;
+	char status = co_await sendFileData(bundleName.c_str(), bundle.length(), NULL,
+			[&bundle, &pos](char *buf, size_t len) {
+				size_t n = bundle.copy(buf, len, pos);
+				pos += n;
+				return n;
+			}, link);
+
+	bool ok = false;
+	if (status == PKT_DONE) {
+		for (auto& f : files) {
+	        *GRADING << "File: " << f.filename << " transmission complete, waiting for end-to-end check, attempt " << f.attempt << endl;
+		}
+		// The bundle is reported as one file in the metrics
+		ok = co_await bundleEndToEnd(bundleName, files, link);
+		metricsFileDone(bundleName.c_str(), ok);
+	} else {
+		metricsFileDone(bundleName.c_str(), false);
+		for (auto& f : files)
+			scheduleRetry(f.filename, f.attempt);
+	}
+	co_return ok;
+}
+
+/*
+ * End-to-end protocol for a bundle: REQ_BDL asks the server to unpack and
+ * check every file, BDL_RES carries one CHK_SUCC/CHK_FAIL per file in
+ * index order, ACK_BDL echoes those back and FIN_ACK closes the exchange.
+ * Parameters: bundleName, the name the bundle was sent under
+ *             files, the files in it, in index order
+ *             link, the lane's socket
+ * Returns: true if every file in the bundle was intact
+ */
+LoopCall<bool> bundleEndToEnd(string bundleName, vector<struct bundleEntry>& files, struct serverLink *link) {
+
+	bool readRequested = true;
+	string message = REQ_BDL + bundleName;
+	string serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
+
 	//
-	// Get the SHA-1 of the file
+	// Response is BDL_RES + bundle name + ':' + one status per file
 	//
+	string expected = BDL_RES + bundleName + ":";
+	while (serverResponse.compare(0, expected.length(), expected) != 0) {
+		serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
+	}
+	string statuses = serverResponse.substr(expected.length());
 
-	char *sha1 = (char *) calloc((SHA_DIGEST_LENGTH * 2) + 1, 1);
-	string filepath = string(dirname) + string(filename);
-	sha1file(filepath.c_str(), sha1);
+	for (size_t i = 0; i < files.size(); i++) {
+		if (i < statuses.length() and statuses[i] == CHK_SUCC) {
+	        *GRADING << "File: " << files[i].filename << " end-to-end check succeeded, attempt " << files[i].attempt << endl;
+		} else {
+	        *GRADING << "File: " << files[i].filename << " end-to-end check failed, attempt " << files[i].attempt << endl;
+			scheduleRetry(files[i].filename, files[i].attempt);
+		}
+	}
+
+	message = ACK_BDL + bundleName + ":" + statuses;
+	serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
+
+	//
+	// Check for FIN_ACK, else exit
+	//
+	while (serverResponse[0] != FIN_ACK) {
+		serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
+	}
+	cout << "End-to-end check complete for " << files.size() << " bundled files." << endl;
+	co_return statuses.find_first_not_of(CHK_SUCC) == string::npos and statuses.length() >= files.size();
+}
+
+/*
+ * Initiates the end-to-end protocol, sending protocol messages to server
+ * 	and processing received messages.
+ * Parameters: filename, the name of a file for which the check is requested,
+               sha1, the SHA-1 of the file as the client read it
+               attempt, the attempt this is, the first is 0
+		       link, the lane's socket
+ * Returns: true if the server found the file intact
+ */
+LoopCall<bool> clientEndToEnd(const char *filename, const char *sha1, int attempt, struct serverLink *link) {
 
 	// Concatenate strings to create message text to send
 	string message = REQ_CHK + string(sha1) + string(filename);
 
 	// Send the message REQ_CHK to the server, beginning the end-to-end protocol
 	bool readRequested = true;
-	string serverResponse = sendMessageToServer(message.c_str(), message.length(), sock, readRequested);
+	string serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
 
 	//
 	// Parse server response for end2end protocol code and respond to server
 	//
 
 	while (serverResponse[0] != CHK_SUCC and serverResponse[0] != CHK_FAIL) {
-		serverResponse = sendMessageToServer(message.c_str(), message.length(), sock, readRequested);
+		serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
 	}	
 
     if (serverResponse[0] == CHK_SUCC) { // end2end succeeded
-        *GRADING << "File: " << filename << " end-to-end check succeeded, attempt " << 0 << endl;
+        *GRADING << "File: " << filename << " end-to-end check succeeded, attempt " << attempt << endl;
         message = ACK_SUCC + string(filename);
-        serverResponse = sendMessageToServer(message.c_str(), message.length(), sock, readRequested);
+        serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
     } else if (serverResponse[0] == CHK_FAIL) { // end2end failed
-        *GRADING << "File: " << filename << " end-to-end check failed, attempt " << 0 << endl;
+        *GRADING << "File: " << filename << " end-to-end check failed, attempt " << attempt << endl;
         message = ACK_FAIL + string(filename);
-        serverResponse = sendMessageToServer(message.c_str(), message.length(), sock, readRequested);
+        serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
     }
 
 	//
 	// Check for FIN_ACK, else exit
 	//
 	while (serverResponse[0] != FIN_ACK) {
-		serverResponse = sendMessageToServer(message.c_str(), message.length(), sock, readRequested);
+		serverResponse = co_await sendMessageToServer(message.c_str(), message.length(), link, readRequested);
 	}
 	cout << "End-to-end check complete." << endl;
-	
-	free(sha1);
+	co_return message[0] == ACK_SUCC;
 }
 
 /*
- * Writes a string to a C150DgmSocket
+ * Writes a string to a lane's socket
  * Returns C++ string of the read() message from the socket
  */
-string sendMessageToServer(const char *msg, size_t msgSize, C150DgmSocket *sock, bool readRequested) {
+LoopCall<string> sendMessageToServer(const char *msg, size_t msgSize, struct serverLink *link, bool readRequested) {
+	char incomingMsg[MAX_PACKET_SIZE];
+
+	co_await exchangeWithServer(msg, msgSize, link, readRequested, incomingMsg);
+	co_return string(incomingMsg);
+}
+
+/*
+ * Does the work of sendMessageToServer with the reply left in the
+ * caller's buffer
+ * Parameters: msg, msgSize, link and readRequested as for sendMessageToServer
+ *             reply, MAX_PACKET_SIZE bytes that receive the reply, NUL
+ *             terminated, or an empty string if none was read
+ * Returns: the length of the reply
+ */
+LoopCall<ssize_t> exchangeWithServer(const char *msg, size_t msgSize, struct serverLink *link, bool readRequested, char *reply) {
 	//
 	// Declare variables
 	//
-    char *incomingMsg = (char *) malloc(512); // MAX_PACKET_SIZE
-    ssize_t readlen;
+    ssize_t readlen = 0;
     bool sendMessageAgain = true;
 
+	reply[0] = '\0';
+
 	//
 	// Loop until successful read on socket (no timeout)
 	//
 	
     while(sendMessageAgain == true) {
 
-        c150debug->printf(C150APPLICATION,"%s: Writing message: \"%s\"",
-                      "fileclient", msg);
-
 		// Write message to socket
-        sock -> write(msg, msgSize);
+        uint64_t sent = metricsNow();
+        sendToServer(msg, msgSize, link);
 
 		//
         // Read the response from the server
 		//
 		if (readRequested) {
 			
-			c150debug->printf(C150APPLICATION,"%s: Returned from write, doing read()",
-				"pingclient");
-			memset(incomingMsg, 0, 512);
-
-			readlen = sock -> read(incomingMsg, 512);
-            readlen++;
-            readlen--;
+			readlen = co_await readFromServer(link, reply, MAX_PACKET_SIZE - 1, REPLY_WAIT_MS);
+			bool timedout = readlen < 0;
+			readlen = timedout ? 0 : readlen;
+			reply[readlen] = '\0';
+			FCLOG_MSG(FCLOG_PACKET, "Read %ld bytes", readlen, 0, reply, readlen);
+			if (timedout) {
+				threadMetrics().timeouts++;
+				threadMetrics().retransmits++;
+			} else {
+				threadMetrics().rtt.record(metricsNow() - sent);
+			}
 
-            if(incomingMsg[0] == '!' or incomingMsg[0] == '2')
+            if(reply[0] == '!' or reply[0] == '2')
                 break;
 
 			//
 			// Keep sending messages if timedout, else check and print messsage
 			// 	and return incoming message string.
 			//
-			if((sock -> timedout() == true)) {
+			if(timedout == true) {
 				sendMessageAgain = true;
 			} else {
 				break;
@@ -523,10 +1396,41 @@ string sendMessageToServer(const char *msg, size_t msgSize, C150DgmSocket *sock,
 			sendMessageAgain = false;
 		}
     }
-	string incomingMsgStr = string(incomingMsg);
-    free(incomingMsg);
 
-	return incomingMsgStr;
+	co_return readlen;
+}
+
+/*
+ * Writes a message no reply is waited for. Not a coroutine, so sending
+ * a data packet never allocates.
+ * Parameters: msg, msgSize, the message
+ *             link, the lane's socket
+ * Returns: nothing
+ */
+void sendToServer(const char *msg, size_t msgSize, struct serverLink *link) {
+    FCLOG_MSG(FCLOG_PACKET, "Writing message", 0, 0, msg, msgSize);
+    link -> sock -> write(msg, msgSize);
+}
+
+/*
+ * Waits on the event loop for the next message from the server. A read
+ * the C150 socket drops or finds empty goes back to waiting.
+ * Parameters: link, the lane's socket
+ *             buf, len, where the message goes, at most len bytes
+ *             ms, how long to wait for it
+ * Returns: the length of the message, -1 if none came in time
+ */
+LoopCall<ssize_t> readFromServer(struct serverLink *link, char *buf, size_t len, long ms) {
+
+	uint64_t deadline = metricsNow() + (uint64_t) ms * 1000;
+	while (true) {
+		uint64_t now = metricsNow();
+		if (now >= deadline or !co_await link -> waiter -> readable((deadline - now + 999) / 1000))
+			co_return -1;
+		ssize_t readlen = link -> sock -> read(buf, len);
+		if (!link -> sock -> timedout())
+			co_return readlen;
+	}
 }
 
 void checkDirectory(char *dirname) {
@@ -541,96 +1445,3 @@ void checkDirectory(char *dirname) {
     exit(8);
   }
 }
-
-/*
- * Produces a 40 byte SHA-1 string of a file from an input filename
- * Output buffer sha1 is caller-managed memory
- * Returns nothing
- */
-void sha1file(const char *filename, char *sha1) {
-
-	//
-	// Declare variables
-	//
-    // ifstream *t;
-    // stringstream *buffer;
-	unsigned char * buffer;
-	C150NastyFile nastyFile(fileNasty);
-	unsigned char temp[SHA_DIGEST_LENGTH];
-	char ostr[(SHA_DIGEST_LENGTH * 2) + 1];
-
-	//
-	// Zero-initalize buffers
-	//
-	memset(ostr, 0, (SHA_DIGEST_LENGTH * 2) + 1); // Human-readable SHA-1 digest
-	memset(temp, 0, SHA_DIGEST_LENGTH);	// Raw SHA-1 digest buffer
-
-	//
-	// Open file, read from file, get SHA-1 digest
-	//
-	void *ret = nastyFile.fopen(filename, "r");
-	if (ret == NULL) {
-		perror("Cannot open file.");
-		exit(1);
-	}
-	int fsize  = 0;
-	nastyFile.fseek(0, SEEK_END);
-	fsize = nastyFile.ftell();
-	buffer = (unsigned char *) malloc(fsize * sizeof(unsigned char));
-	nastyFile.rewind();
-	fsize = nastyFile.fread(buffer, 1, fsize);
-
-    SHA1(buffer, fsize, temp);
-	
-	//
-	// Write the SHA-1 digest bytes in human-readable form to a string
-	// Taken from website https://memset.wordpress.com/2010/10/06/using-sha1-function/
-	//
-	for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        sprintf((char*) &(ostr[i*2]), "%02x", temp[i]);
-    }
-
-	//
-	// Copy human-readable output string to function user-returned variable
-	//
-	memcpy(sha1, ostr, (SHA_DIGEST_LENGTH * 2) + 1);
-
-	//
-	// Free alloc'd memory
-	//
-	free(buffer);
-}
-
-/*
- * Produces a 40 byte SHA-1 string from an input string
- * Output string is caller-managed memory
- * Returns nothing
- */
-void sha1string(const char *input, char *sha1) {
-	//
-	// Declare variables
-	//
-	unsigned char temp[SHA_DIGEST_LENGTH];
-	char ostr[(SHA_DIGEST_LENGTH * 2) + 1];
-
-	//
-	// Zero-initalize buffers
-	//
-	memset(ostr, 0, (SHA_DIGEST_LENGTH * 2) + 1); // Human-readable SHA-1 digest
-	memset(temp, 0, SHA_DIGEST_LENGTH);	// Raw SHA-1 digest buffer
-
-    SHA1((const unsigned char *) input, strlen(input), temp);
-	
-	//
-	// Write the SHA-1 digest bytes in human-readable form to a string
-	// Taken from website https://memset.wordpress.com/2010/10/06/using-sha1-function/
-	//
-	for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        sprintf((char*)&(ostr[i*2]), "%02x", temp[i]);
-    }
-
-	//
-	// Copy human-readable output string to function user-returned variable
-	//
-	memcpy(sha1, ostr, (SHA_DIGEST_LENGTH * 2) + 1);
-}
\ No newline at end of file
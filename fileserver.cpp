@@ -56,22 +56,131 @@
 #include "c150grading.h"
 #include "c150nastyfile.h"
 #include "fcpacket.h"
+#include "fchash.h"
+#include "fccodec.h"
+#include "fcstorage.h"
+#include "fcmetrics.h"
+#include "fclog.h"
+#include "fcevent.h"
+#include "fcdedup.h"
 #include <fstream>
 #include <cstdlib>
 #include <stdio.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <climits>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <openssl/sha.h> 
 
 
 using namespace C150NETWORK;  // for all the comp150 utilities 
 
 void setUpDebugLogging(const char *logname, int argc, char *argv[]);
-int endCheck(string file_name, string file_hash, string directory);
-void sha1file(const char *filename, char *sha1);
-int copyfile(struct initialPacket* pckt1, C150DgmSocket *sock, char* directory);
-void sha1string(const char *input, char *sha1);
-void fileCheck(string currFileName, int packetNum, C150NastyFile& currentFile, string data);
+struct clientSession;
+struct stripeSession;
+struct stripeFlow;
+struct clientSession *findSession(const struct sockaddr_in& peer);
+void readControl();
+void handleMessage(struct clientSession *s, char *incomingMessage, ssize_t readlen);
+void sessionWrite(struct clientSession *s, const char *msg, size_t len);
+void expireSessions();
+int endCheck(struct clientSession *s, string file_name, string file_hash, string directory);
+LoopTask copyfile(struct clientSession *s, struct initialPacket pckt1, string firstChunk);
+char copySingle(struct clientSession *s, struct initialPacket* pckt1, string chunk, string directory);
+bool safeRelativePath(string path);
+bool sizeFieldsValid(const char *numPackets, const char *fileSize);
+void makeParentDirs(string directory, string path);
+string unpackBundle(struct clientSession *s, string bundleName, string directory);
+void finishBundle(struct clientSession *s, string bundleName, string statuses, string directory);
+bool startStripes(struct clientSession *s, struct initialPacket* pckt1, int numStripes, string directory);
+void finishStripes(struct clientSession *s);
+LoopTask receiveFlow(struct stripeSession *session, struct stripeFlow *flow);
+void waitForStop(sigset_t stopSignals);
 
 int fileNasty = 0;
+char *targetDir; //Where files are written
+const char *storageName = "sync"; //Storage engine for the write path, --storage
+size_t reorderBytes = REORDER_DEFAULT_BYTES; //Reorder buffer budget, 0 for none
+int ioThreads = 2; //Event loop threads for the flows of a striped file, --io-threads
+EventLoopPool *flowLoops; //Those event loops
+C150DgmSocket *controlSock; //Socket every client's control messages come to
+EventLoop *controlLoop; //Loop on the main thread reading it
+map<uint64_t, struct clientSession *> sessions; //By client address and port
+bool verifyFull = false; //--verify=full: read every file again for its check
+bool dedup = true; //--dedup=off: receive files whose contents are already here
+ContentIndex contentIndex; //Files checked good, by digest, shared by all clients
+
+//
+// A large file received over several flows at once. Each flow has its own
+// UDP socket and storage engine, owns a contiguous run of the file's
+// packets, and is received by a receiveFlow coroutine on one of the event
+// loops in flowLoops, which many flows share. Everything below loop is
+// only touched on that loop.
+//
+struct stripeFlow {
+    int sock;
+    int firstPacket;
+    int lastPacket;
+    EventLoop *loop;
+
+    bool stop;                   //Set to end the receiver early
+    bool done;                   //The receiver has returned
+    bool synced;                 //Its engine closed with the data on disk
+    SocketWaiter *waiter;        //The receiver's, while it waits on sock
+};
+
+struct stripeSession {
+    string key;              //Digest and name, as in lastStarted
+    string filename;
+    string fileNameHash;
+    string tmpPath;
+    int fd;                  //Descriptor that preallocated the file
+    PrefixDigest *receivedDigest; //The client's, kept up to date by the flows
+    string ports;            //Comma separated, as sent to the client
+    vector<struct stripeFlow *> flows;
+    mutex lock;              //Guards flowsRunning
+    condition_variable flowsDone;
+    int flowsRunning;
+};
+
+//
+// One client, known by the address and port its control messages come
+// from. Everything the server remembers between a client's messages is
+// kept here, so clients sending at the same time never see each other's
+// files. Only touched on the control loop. Per-file metrics are counted
+// per thread, so while several clients send at once a file's line also
+// counts the others' packets; the run totals are exact.
+//
+struct clientSession {
+    struct sockaddr_in peer;
+    time_t lastHeard;                   //For expireSessions
+    StorageEngine *storage;             //Its own, so a reap only sees its files
+    const struct digestAlgorithm *digest; //Picked for the client by HASH_REQ
+    bool negotiated;                    //The last message was a HASH_REQ, now answered
+    bool alreadyRead;                   //The file last checked has been renamed
+    map<string, string> bundleResults;  //Statuses of bundles already unpacked
+    map<string, string> singleResults;  //Digest of one-datagram files written good
+    string lastStarted;                 //Name and digest of the file received last, until acked
+    string lastCopied;                  //Name hash of that file once copyfile has all its packets
+    string metricsPending;              //File whose metrics line is written at its first check
+    string lastChecked;                 //Digest and name of the file last checked good, until acked
+    string lastDeduped;                 //Digest and name of the file last made from the index
+    PrefixDigest receivedDigest;        //Digest of the file being received, kept as it lands
+    string receivedDigestName;          //Its .tmp name, relative to the target directory
+    bool receivedSynced;                //Its data was on disk when storage closed it
+    struct stripeSession *activeStripes; //Its striped file being received, or NULL
+    MessageQueue *inbox;                //copyfile's, while it receives a file
+};
 
 #define REQ_CHK  '0' //Client requesting an end to end check
 #define CHK_SUCC '2' //End to end check succeeded
@@ -84,6 +193,21 @@ int fileNasty = 0;
 #define DATA_FCP '9' //Packets that contain file data
 #define PKT_DONE '!' //Server telling client that all packets have been copied
 #define PKT_LOST '@' //Server asking for a packet that was not written
+#define ACK_BDL  'A' //Client acknowledging the statuses of a bundle
+#define REQ_BDL  'B' //Client requesting unpack and check of a bundle
+#define BDL_RES  'R' //Server reporting one check status per bundled file
+#define START_FCP  'S' //Client starting a file: name, size, digest, packet 1
+#define FILE_OK    'K' //One-datagram file written and checked good
+#define FILE_BAD   'X' //One-datagram file written but failed its check
+#define NEED_START '?' //Server got data for a file it was never started on
+#define STRIPE_REQ 'T' //Client asking to send a file over several flows
+#define STRIPE_ACK 'U' //Server giving the ports of the flows
+#define HASH_REQ   'H' //Client offering digest algorithms, best first
+#define HASH_ACK   'J' //Server naming the one it picked
+#define DEDUP_REQ  'D' //Client asking whether a file's contents are already here
+#define DEDUP_HIT  'L' //Server made the file from contents it had
+#define DEDUP_MISS 'M' //Server needs the file sent
+#define ZERO_FCP   'Z' //Run of all-zero packets that is not sent
 
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
@@ -105,19 +229,36 @@ main(int argc, char *argv[])
 	//
 	// Variable declarations
 	//
-	ssize_t readlen;             // amount of data read from socket
-	char incomingMessage[512];   // received message data
 	int nastiness;               // how aggressively do we drop packets, etc?
-	char *directory = argv[3];
-    bool alreadyRead = false;    // keeps track if the file has been renamed 
 
 	//
 	// Check command line and parse arguments
 	//
-	if (argc != 4)  {
-		fprintf(stderr,"Correct syntxt is: %s <networknastiness> <filenastiness> <targetdir>\n", argv[0]);
+	if (argc < 4)  {
+		fprintf(stderr,"Correct syntxt is: %s <networknastiness> <filenastiness> <targetdir> [--storage=sync|uring] [--reorder=bytes] [--io-threads=N] [--verify=cached|full] [--dedup=on|off] [--metrics=path] [--log=none|file|packet]\n", argv[0]);
 		exit(1);
 	}
+	for (int i = 4; i < argc; i++) {
+		if (strncmp(argv[i], "--storage=", 10) == 0) {
+			storageName = argv[i] + 10;
+		} else if (strncmp(argv[i], "--reorder=", 10) == 0 and strlen(argv[i]) > 10 and
+				strspn(argv[i] + 10, "0123456789") == strlen(argv[i] + 10)) {
+			reorderBytes = strtoul(argv[i] + 10, NULL, 10);
+		} else if (strncmp(argv[i], "--io-threads=", 13) == 0 and atoi(argv[i] + 13) > 0) {
+			ioThreads = atoi(argv[i] + 13);
+		} else if (strcmp(argv[i], "--verify=cached") == 0 or strcmp(argv[i], "--verify=full") == 0) {
+			verifyFull = strcmp(argv[i], "--verify=full") == 0;
+		} else if (strcmp(argv[i], "--dedup=on") == 0 or strcmp(argv[i], "--dedup=off") == 0) {
+			dedup = strcmp(argv[i], "--dedup=on") == 0;
+		} else if (strncmp(argv[i], "--metrics=", 10) == 0) {
+			metricsOpen("fileserver", argv[i] + 10);
+		} else if (strncmp(argv[i], "--log=", 6) == 0 and fclogSetLevel(argv[i] + 6)) {
+			//Level already set, an unknown one falls through to the usage
+		} else {
+			fprintf(stderr,"Correct syntxt is: %s <networknastiness> <filenastiness> <targetdir> [--storage=sync|uring] [--reorder=bytes] [--io-threads=N] [--verify=cached|full] [--dedup=on|off] [--metrics=path] [--log=none|file|packet]\n", argv[0]);
+			exit(1);
+		}
+	}
 	if (strspn(argv[1], "0123456789") != strlen(argv[1])) {
 		fprintf(stderr,"Nastiness %s is not numeric\n", argv[1]);     
 		fprintf(stderr,"Correct syntxt is: %s <nastiness_number>\n", argv[0]);     
@@ -127,11 +268,13 @@ main(int argc, char *argv[])
 	// convert command line strings to integers
 	nastiness = atoi(argv[1]);   
 	fileNasty = atoi(argv[2]);
+	targetDir = argv[3];
 
 	//
 	//  Set up debug message logging
 	//
 	setUpDebugLogging("pingserverdebug.txt",argc, argv);
+	fclogOpen("fileserver", "fileserverlog.txt");
 
 	//
 	// We set a debug output indent in the server only, not the client.
@@ -149,6 +292,18 @@ main(int argc, char *argv[])
 	c150debug->setIndent("    ");           	// if we merge client and server
 												// logs, server stuff will be indented
 
+	flowLoops = new EventLoopPool(ioThreads);
+
+	//Stopping the server writes out the metrics of the run in progress.
+	//The signals are blocked here, before any other thread exists, and
+	//taken by a thread of their own so no read is ever interrupted.
+	sigset_t stopSignals;
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGINT);
+	sigaddset(&stopSignals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+	thread(waitForStop, stopSignals).detach();
+
 	//
 	// Create socket, loop receiving and responding
 	//
@@ -159,120 +314,25 @@ main(int argc, char *argv[])
 		c150debug->printf(C150APPLICATION,"Creating C150NastyDgmSocket(nastiness=%d)",
 				nastiness);
 		C150NastyDgmSocket *sock = new C150NastyDgmSocket(nastiness);
-		sock -> turnOnTimeouts(1000);
+		//Reads only follow a datagram the loop has seen arrive, so the
+		//timeout only matters when the nasty socket drops that one
+		sock -> turnOnTimeouts(CONTROL_READ_MS);
+		controlSock = sock;
 		c150debug->printf(C150APPLICATION,"Ready to accept messages");
 
 		//
-		// infinite loop processing messages
-		//
-		while(1) {
-
-			//
-			// Read a packet
-			// -1 in size below is to leave room for null
-			//
-
-			readlen = sock -> read(incomingMessage, sizeof(incomingMessage) - 1);
-			if (readlen == 0) {
-				c150debug->printf(C150APPLICATION,"Read zero length message, trying again");
-				continue;
-    	 	}
-
+		// Event loop processing messages
 		//
-		// Clean up the message in case it contained junk
+		// Each client has a session of its own, found by the address its
+		// messages come from, and the loop hands every message to its
+		// client's session. A file being copied is a coroutine waiting on
+		// its session, so many clients send files at once on this one
+		// thread, with the flows of striped files on the flowLoops.
 		//
-		incomingMessage[readlen] = '\0'; // make sure null terminated
-		string incoming(incomingMessage); // Convert to C++ string ...it's slightly
-										// easier to work with, and cleanString
-										// expects it
-		//cleanString(incoming);            // c150ids-supplied utility: changes
-										// non-printing characters to .
-		c150debug->printf(C150APPLICATION,"Successfully read %d bytes. Message=\"%s\"",
-			readlen, incoming.c_str());
-
-
-
-		// Check for protocol code REQ_CHK
-		// Requests an end to end check for a given file
-		if (incoming[0] == REQ_CHK) {
-			//Get the hash of the file out of the message
-			string file_hash = incoming.substr(1, (SHA_DIGEST_LENGTH * 2));
-			//Get the file name out of the message and add .tmp because it 
-			//has not been checked yet
-			string file_name = incoming.substr((SHA_DIGEST_LENGTH * 2) + 1) + ".tmp";
-
-			// Calls the end to end check which reports 2 with success and 3 with failure
-            // Returns 4 if the file was already renamed
-			int file_status = endCheck(file_name, file_hash, (string)directory);
-
-            if(file_status == 4)
-                continue;
-
-			//Response is the message code with the file name 
-			string response = to_string(file_status) + incoming.substr((SHA_DIGEST_LENGTH * 2) + 1);
-
-			c150debug->printf(C150APPLICATION,"Responding with message=\"%s\"",
-					response.c_str());
-			sock -> write(response.c_str(), response.length()+1);
-
-            //To make sure that the file has not been renamed yet
-            alreadyRead = false;
-		} 
-
-		// If the incoming message is an acknowledgement of success
-		else if (incoming[0] == ACK_SUCC) {
-			// Prepend protocol message FIN_ACK for the final acknowledgement
-			string response = FIN_ACK + incoming.substr(1);
-
-			//Get file name and path
-			string file_name = incoming.substr(1);
-			string file_path = string(argv[3]) + "/";
-			*GRADING << "File: " << file_name << " end-to-end check succeeded" << endl;
-
-			// Rename the file to get rid of the .tmp extension
-            if(!alreadyRead) {
-    			if(rename((file_path + file_name + ".tmp").c_str(), (file_path + file_name).c_str()))
-    				cerr << "Could not rename file\n" << endl;
-            }
-
-            //The file has been renamed
-            alreadyRead = true;
-
-			c150debug->printf(C150APPLICATION,"Responding with message=\"%s\"",
-					response.c_str());
-			sock -> write(response.c_str(), response.length()+1);
-		}
-		//If the incomine message is an acknowlegement of failure
-		else if(incoming[0] == ACK_FAIL) {
-			//Attach 7 for the final acknowledgement
-			string response = FIN_ACK + incoming.substr(1);
-				string file_name = incoming.substr(1);
-			*GRADING << "File: " << file_name << " end-to-end check failed" << endl;
-
-			c150debug->printf(C150APPLICATION,"Responding with message=\"%s\"",
-					response.c_str());
-			sock -> write(response.c_str(), response.length()+1);
-		}
-		else if(incoming[0] == INIT_FCP) {
-
-            struct initialPacket pckt1;
-
-            pckt1.packetType = INIT_FCP;
-            strncpy(pckt1.numPackets, incoming.substr(1, 16).c_str(), 16);
-            strncpy(pckt1.filename, incoming.substr(17).c_str(), MAX_FILE_NAME);
-
-            *GRADING << "File: " << pckt1.filename << " starting to receive file" << endl;
-
-            //string initAck = INIT_ACK + string(pckt1.filename);
-
-            //c150debug->printf(C150APPLICATION,"Responding with message=\"%s\"",
-                    //initAck.c_str());
-            //sock -> write(initAck.c_str(), initAck.length()+1);
-
-            copyfile(&pckt1, sock, directory);
-            *GRADING << "File: " << pckt1.filename << " received, beginning end-to-end check" << endl;
-        }
-	   	}
+		controlLoop = new EventLoop();
+		controlLoop -> watch(sock -> getSocketDescriptor(), readControl);
+		controlLoop -> after(SESSION_IDLE_SECONDS * 1000, expireSessions);
+		controlLoop -> run();
     } 
 
      catch (C150NetworkException& e) {
@@ -369,13 +429,496 @@ void setUpDebugLogging(const char *logname, int argc, char *argv[]) {
 
 }
 
-/* Function takes in information about the file and returns a status code 
+/* Function takes in a client's address and port. Returns its session,
+ * made the first time the client is heard from.
+ */
+
+struct clientSession *findSession(const struct sockaddr_in& peer) {
+
+    uint64_t key = ((uint64_t) ntohl(peer.sin_addr.s_addr) << 16) | ntohs(peer.sin_port);
+    auto found = sessions.find(key);
+    if (found != sessions.end())
+        return found -> second;
+
+    struct clientSession *s = new struct clientSession;
+    s -> peer = peer;
+    s -> lastHeard = time(NULL);
+    s -> storage = newStorageEngine(storageName, fileNasty, reorderBytes);
+    s -> digest = findDigest("sha1");
+    s -> negotiated = false;
+    s -> alreadyRead = false;
+    s -> receivedSynced = false;
+    s -> activeStripes = NULL;
+    s -> inbox = NULL;
+    sessions[key] = s;
+
+    c150debug->printf(C150APPLICATION,"New client on port %d, using %s storage engine, %d clients",
+            ntohs(peer.sin_port), s -> storage -> name(), (int) sessions.size());
+    return s;
+}
+
+/* Called by the control loop whenever the control socket is readable.
+ * Reads every message waiting and hands each to the session of the
+ * client that sent it: to the file it is sending, while copyfile has
+ * one, or else to handleMessage. The sender is found by peeking at the
+ * datagram before the nasty socket reads it. A message the socket
+ * dropped, delayed or damaged on the way reads back different from the
+ * one peeked at, and is dropped here for its client to send again.
+ */
+
+void readControl() {
+
+    int fd = controlSock -> getSocketDescriptor();
+    char peeked[MAX_PACKET_SIZE];
+    char incomingMessage[MAX_PACKET_SIZE];
+
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t peekLen = recvfrom(fd, peeked, sizeof(peeked) - 1, MSG_PEEK | MSG_DONTWAIT,
+                                   (struct sockaddr *) &from, &fromLen);
+        if (peekLen < 0)
+            return;
+
+        //
+        // Read a packet
+        // -1 in size below is to leave room for null
+        //
+        ssize_t readlen = controlSock -> read(incomingMessage, sizeof(incomingMessage) - 1);
+        if (controlSock -> timedout())
+            return;
+        if (readlen == 0) {
+            FCLOG(FCLOG_PACKET, "Read zero length message, trying again", 0, 0);
+            continue;
+        }
+        if (readlen != peekLen or memcmp(incomingMessage, peeked, readlen) != 0) {
+            FCLOG(FCLOG_PACKET, "Dropping message of %ld bytes from an unknown sender", readlen, 0);
+            continue;
+        }
+        incomingMessage[readlen] = '\0'; // make sure null terminated
+
+        struct clientSession *s = findSession(from);
+        s -> lastHeard = time(NULL);
+        if (s -> inbox != NULL)
+            s -> inbox -> push(incomingMessage, readlen);
+        else
+            handleMessage(s, incomingMessage, readlen);
+    }
+}
+
+/* Function takes in a session and a reply for its client. Every client
+ * shares the control socket, which writes to whoever it last read from,
+ * so the reply is addressed to the session's client.
+ */
+
+void sessionWrite(struct clientSession *s, const char *msg, size_t len) {
+    sendto(controlSock -> getSocketDescriptor(), msg, len, 0, (struct sockaddr *) &s -> peer, sizeof(s -> peer));
+}
+
+/* Run by the control loop every SESSION_IDLE_SECONDS. Forgets the clients
+ * that have been quiet that long, ending any striped file they left, and
+ * sets itself to run again. A client whose file copyfile still has is
+ * kept, as copyfile gives up on it by itself.
+ */
+
+void expireSessions() {
+
+    time_t now = time(NULL);
+    for (auto i = sessions.begin(); i != sessions.end(); ) {
+        struct clientSession *s = i -> second;
+        if (s -> inbox != NULL or now - s -> lastHeard < SESSION_IDLE_SECONDS) {
+            i++;
+            continue;
+        }
+        c150debug->printf(C150APPLICATION,"Forgetting client on port %d", ntohs(s -> peer.sin_port));
+        if (s -> activeStripes != NULL)
+            finishStripes(s);
+        delete s -> storage;
+        delete s;
+        i = sessions.erase(i);
+    }
+    controlLoop -> after(SESSION_IDLE_SECONDS * 1000, expireSessions);
+}
+
+/* Function takes in a client's session and a control message from it,
+ * null terminated, of readlen bytes. Acts on the message and answers
+ * the client. Runs on the control loop. A file the client starts is
+ * received by a copyfile coroutine, which takes the client's messages
+ * until it has every packet.
+ */
+
+void handleMessage(struct clientSession *s, char *incomingMessage, ssize_t readlen) {
+
+	if (incomingMessage[0] != HASH_REQ)
+		s -> negotiated = false;
+
+	//Data or a zero range for a file that is not being received means
+	//its start was lost. Ask for it again, naming the file by its hash.
+	//For the file copyfile has just finished it means the done reply
+	//was lost, so that goes again instead. These come once per packet,
+	//so they are answered without building a string.
+	if (incomingMessage[0] == DATA_FCP or incomingMessage[0] == ZERO_FCP) {
+		if (readlen >= DATA_NUM_OFFSET) {
+			char response[MAX_PACKET_SIZE];
+			bool copied = s -> lastCopied.compare(0, DIGEST_HEX_LENGTH, incomingMessage + DATA_HASH_OFFSET,
+					DIGEST_HEX_LENGTH) == 0;
+			size_t responseLen = encodeReply(response, copied ? PKT_DONE : NEED_START, -1,
+					incomingMessage + DATA_HASH_OFFSET);
+			FCLOG_MSG(FCLOG_PACKET, "Responding with message", 0, 0, response, responseLen);
+			sessionWrite(s, response, responseLen + 1);
+		}
+		return;
+	}
+
+	string incoming(incomingMessage, readlen); // Convert to C++ string ...it's slightly
+									// easier to work with, and cleanString
+									// expects it
+	//cleanString(incoming);            // c150ids-supplied utility: changes
+									// non-printing characters to .
+	FCLOG_MSG(FCLOG_PACKET, "Successfully read %ld bytes", readlen, 0, incomingMessage, readlen);
+
+
+
+	// Check for protocol code REQ_CHK
+	// Requests an end to end check for a given file
+	if (incoming[0] == REQ_CHK) {
+		//Get the hash of the file out of the message
+		string file_hash = incoming.substr(1, (SHA_DIGEST_LENGTH * 2));
+		//Get the file name out of the message and add .tmp because it 
+		//has not been checked yet
+		string file_name = incoming.substr((SHA_DIGEST_LENGTH * 2) + 1) + ".tmp";
+
+		//A striped file is complete once the client asks for its check
+		if (s -> activeStripes != NULL and s -> activeStripes -> filename + ".tmp" == file_name)
+			finishStripes(s);
+
+		// Calls the end to end check which reports 2 with success and 3 with failure
+        // Returns 4 if the file was already renamed
+		int file_status = endCheck(s, file_name, file_hash, targetDir);
+
+        if(file_status == 4)
+            return;
+
+        //Repeats of the request are checked again but counted once
+        string checked = incoming.substr((SHA_DIGEST_LENGTH * 2) + 1);
+        if (file_status == CHK_SUCC - '0')
+            s -> lastChecked = file_hash + checked;
+        if (checked == s -> metricsPending) {
+            metricsFileDone(checked.c_str(), file_status == CHK_SUCC - '0');
+            s -> metricsPending.clear();
+        }
+
+		//Response is the message code with the file name 
+		string response = to_string(file_status) + incoming.substr((SHA_DIGEST_LENGTH * 2) + 1);
+
+		FCLOG_MSG(FCLOG_FILE, "Responding with message", 0, 0, response.data(), response.length());
+		sessionWrite(s, response.c_str(), response.length()+1);
+
+        //To make sure that the file has not been renamed yet
+        s -> alreadyRead = false;
+	} 
+
+	// If the incoming message is an acknowledgement of success
+	else if (incoming[0] == ACK_SUCC) {
+		// Prepend protocol message FIN_ACK for the final acknowledgement
+		string response = FIN_ACK + incoming.substr(1);
+
+		//Get file name and path
+		string file_name = incoming.substr(1);
+		string file_path = string(targetDir) + "/";
+		*GRADING << "File: " << file_name << " end-to-end check succeeded" << endl;
+
+		// Rename the file to get rid of the .tmp extension
+        if(!s -> alreadyRead) {
+			if(s -> storage -> rename(file_path + file_name + ".tmp", file_path + file_name))
+				cerr << "Could not rename file\n" << endl;
+        }
+
+        //The file has been renamed, and its contents can be reused
+        if (!s -> alreadyRead and s -> lastChecked.length() > SHA_DIGEST_LENGTH * 2 and
+                s -> lastChecked.compare(SHA_DIGEST_LENGTH * 2, string::npos, file_name) == 0)
+            contentIndex.add(s -> lastChecked.substr(0, SHA_DIGEST_LENGTH * 2), s -> digest, file_path + file_name);
+        s -> alreadyRead = true;
+        s -> lastStarted.clear();
+        s -> lastCopied.clear();
+        s -> lastChecked.clear();
+
+		FCLOG_MSG(FCLOG_FILE, "Responding with message", 0, 0, response.data(), response.length());
+		sessionWrite(s, response.c_str(), response.length()+1);
+	}
+	//If the incomine message is an acknowlegement of failure
+	else if(incoming[0] == ACK_FAIL) {
+		//Attach 7 for the final acknowledgement
+		string response = FIN_ACK + incoming.substr(1);
+			string file_name = incoming.substr(1);
+		*GRADING << "File: " << file_name << " end-to-end check failed" << endl;
+		s -> lastStarted.clear();
+		s -> lastCopied.clear();
+
+		FCLOG_MSG(FCLOG_FILE, "Responding with message", 0, 0, response.data(), response.length());
+		sessionWrite(s, response.c_str(), response.length()+1);
+	}
+	//A bundle of small files has arrived: unpack it and check each
+	//file, answering retransmitted requests from the saved result
+	else if(incoming[0] == REQ_BDL) {
+		string bundleName = incoming.substr(1);
+		if (!safeRelativePath(bundleName))
+			return;
+
+		if (s -> bundleResults.find(bundleName) == s -> bundleResults.end()) {
+			string statuses = unpackBundle(s, bundleName, targetDir);
+			s -> bundleResults[bundleName] = statuses;
+			//The bundle is reported as one file, as the client does
+			if (bundleName == s -> metricsPending) {
+				metricsFileDone(bundleName.c_str(), !statuses.empty() and
+						statuses.find_first_not_of(CHK_SUCC) == string::npos);
+				s -> metricsPending.clear();
+			}
+		}
+
+		string response = BDL_RES + bundleName + ":" + s -> bundleResults[bundleName];
+		FCLOG_MSG(FCLOG_FILE, "Responding with message", 0, 0, response.data(), response.length());
+		sessionWrite(s, response.c_str(), response.length()+1);
+	}
+	//The client has seen the bundle statuses: keep the files that
+	//passed and drop the bundle itself
+	else if(incoming[0] == ACK_BDL) {
+		size_t colon = incoming.find(':');
+		if (colon == string::npos)
+			return;
+		string bundleName = incoming.substr(1, colon - 1);
+
+		if (s -> bundleResults.find(bundleName) != s -> bundleResults.end()) {
+			finishBundle(s, bundleName, incoming.substr(colon + 1), targetDir);
+			s -> bundleResults.erase(bundleName);
+		}
+
+		string response = FIN_ACK + bundleName;
+		FCLOG_MSG(FCLOG_FILE, "Responding with message", 0, 0, response.data(), response.length());
+		sessionWrite(s, response.c_str(), response.length()+1);
+	}
+	else if(incoming[0] == INIT_FCP) {
+
+        if (incoming.length() < 34 or !sizeFieldsValid(incoming.data() + 1, incoming.data() + 17))
+            return;
+
+        struct initialPacket pckt1;
+
+        pckt1.packetType = INIT_FCP;
+        strncpy(pckt1.numPackets, incoming.substr(1, 16).c_str(), 16);
+        strncpy(pckt1.fileSize, incoming.substr(17, 16).c_str(), 16);
+        strncpy(pckt1.filename, incoming.substr(33).c_str(), MAX_FILE_NAME);
+
+        //Names are paths relative to the target directory, never
+        //allowed to climb out of it
+        if (!safeRelativePath(pckt1.filename)) {
+            c150debug->printf(C150ALWAYSLOG,"Refusing unsafe file name \"%s\"",
+                    pckt1.filename);
+            return;
+        }
+
+        *GRADING << "File: " << pckt1.filename << " starting to receive file" << endl;
+
+        //string initAck = INIT_ACK + string(pckt1.filename);
+
+        //c150debug->printf(C150APPLICATION,"Responding with message=\"%s\"",
+                //initAck.c_str());
+        //sessionWrite(s, initAck.c_str(), initAck.length()+1);
+
+        //The client's messages go to copyfile until it has every packet
+        s -> lastCopied.clear();
+        copyfile(s, pckt1, "");
+    }
+	//Start of a file. Layout after the code: packet count (16), size
+	//(16), digest (40), name length (3), '1' if packet 1 follows the
+	//name, name, packet 1 data
+	else if(incoming[0] == START_FCP) {
+
+        //A damaged start is dropped, like any other bad message
+        if (incoming.length() < 77 or !sizeFieldsValid(incoming.data() + 1, incoming.data() + 17))
+            return;
+        long nameLen = getNumber(incoming.data() + 73, 3);
+        if (nameLen <= 0 or nameLen >= MAX_FILE_NAME or incoming.length() < 77 + (size_t) nameLen)
+            return;
+
+        struct initialPacket pckt1;
+
+        pckt1.packetType = START_FCP;
+        memcpy(pckt1.numPackets, incoming.data() + 1, 16);
+        memcpy(pckt1.fileSize, incoming.data() + 17, 16);
+        memcpy(pckt1.fileDigest, incoming.data() + 33, SHA_DIGEST_LENGTH * 2);
+        strncpy(pckt1.filename, incoming.substr(77, nameLen).c_str(), MAX_FILE_NAME);
+        bool haveChunk = incoming[76] == '1';
+        string chunk = haveChunk ? incoming.substr(77 + nameLen) : "";
+
+        if (!safeRelativePath(pckt1.filename)) {
+            c150debug->printf(C150ALWAYSLOG,"Refusing unsafe file name \"%s\"",
+                    pckt1.filename);
+            return;
+        }
+
+        //The whole file is in this message: write it, check it and
+        //answer in one go. A repeat of a start already written good gets
+        //the same answer without touching the file again; one that
+        //failed is written again, as the client may be retrying it.
+        if (haveChunk and stoi(string(pckt1.numPackets, 16)) == 1) {
+            string digest(pckt1.fileDigest, SHA_DIGEST_LENGTH * 2);
+            auto done = s -> singleResults.find(pckt1.filename);
+            char verdict;
+            if (done != s -> singleResults.end() and done -> second == digest) {
+                verdict = FILE_OK;
+            } else {
+                verdict = copySingle(s, &pckt1, chunk, targetDir);
+                if (s -> singleResults.size() >= 65536)
+                    s -> singleResults.clear();
+                if (verdict == FILE_OK)
+                    s -> singleResults[pckt1.filename] = digest;
+            }
+
+            string response = verdict + string(pckt1.filename);
+            FCLOG_MSG(FCLOG_FILE, "Responding with message", 0, 0, response.data(), response.length());
+            sessionWrite(s, response.c_str(), response.length()+1);
+            return;
+        }
+
+        //A late duplicate of the start of the file just received must
+        //not truncate it while its end-to-end check is under way. Once
+        //all its packets are written, a repeat is a client that missed
+        //the done reply, and gets it again
+        string startKey = string(pckt1.fileDigest, SHA_DIGEST_LENGTH * 2) + pckt1.filename;
+        string startHash = nameHash(pckt1.filename, s -> digest);
+        if (startKey == s -> lastStarted) {
+            if (s -> lastCopied == startHash) {
+                char response[MAX_PACKET_SIZE];
+                size_t responseLen = encodeReply(response, PKT_DONE, -1, startHash.c_str());
+                FCLOG_MSG(FCLOG_PACKET, "Responding with message", 0, 0, response, responseLen);
+                sessionWrite(s, response, responseLen + 1);
+            }
+            return;
+        }
+        s -> lastStarted = startKey;
+        s -> lastCopied.clear();
+
+        *GRADING << "File: " << pckt1.filename << " starting to receive file" << endl;
+        copyfile(s, pckt1, haveChunk ? chunk : "");
+    }
+	//A client about to send a file asks whether its contents are here
+	//already. Layout after the code: digest (40), name. If they are,
+	//the file is made from them and is done; a repeat of the request
+	//for the file just made gets the same answer.
+	else if(incoming[0] == DEDUP_REQ) {
+
+        if (incoming.length() <= 1 + SHA_DIGEST_LENGTH * 2)
+            return;
+        string digest = incoming.substr(1, SHA_DIGEST_LENGTH * 2);
+        string name = incoming.substr(1 + SHA_DIGEST_LENGTH * 2);
+        if (!safeRelativePath(name)) {
+            c150debug->printf(C150ALWAYSLOG,"Refusing unsafe file name \"%s\"",
+                    name.c_str());
+            return;
+        }
+
+        bool hit = s -> lastDeduped == digest + name;
+        if (!hit and dedup) {
+            string source = contentIndex.find(digest, s -> digest);
+            struct digestValue expected, actual;
+            if (source != "" and verifyFull and !(fromHex(digest.c_str(), expected) and
+                    digestFile(source.c_str(), fileNasty, actual, s -> digest) and actual == expected))
+                source = "";
+            if (source != "") {
+                metricsFileStart();
+                makeParentDirs(targetDir, name);
+                hit = ContentIndex::materialize(source, string(targetDir) + "/" + name);
+                metricsFileDone(name.c_str(), hit);
+            }
+            if (hit) {
+                *GRADING << "File: " << name << " has the contents of " << source
+                         << ", made from it instead of received" << endl;
+                *GRADING << "File: " << name << " end-to-end check succeeded" << endl;
+                s -> lastDeduped = digest + name;
+            }
+        }
+
+        string response = (hit ? DEDUP_HIT : DEDUP_MISS) + name;
+        FCLOG_MSG(FCLOG_FILE, "Responding with message", 0, 0, response.data(), response.length());
+        sessionWrite(s, response.c_str(), response.length()+1);
+    }
+	//A client starting up offers the digest algorithms it can use. The
+	//first one known here is used for everything it sends after; a
+	//client that offers nothing known keeps SHA-1.
+	else if(incoming[0] == HASH_REQ) {
+
+        //A client starting while no other is here starts a new run. A
+        //repeat of the request with nothing in between is the same
+        //client, which missed the reply
+        if (!s -> negotiated and sessions.size() == 1)
+            metricsRunDone();
+        s -> negotiated = true;
+
+        //The choice is kept for this client, not made the process
+        //default, as other clients and the flow threads may be hashing
+        s -> digest = findDigest(incoming.substr(1));
+        if (s -> digest == NULL)
+            s -> digest = findDigest("sha1");
+        c150debug->printf(C150APPLICATION,"Using digest algorithm %s", digestName(s -> digest));
+
+        string response = HASH_ACK + string(digestName(s -> digest));
+        sessionWrite(s, response.c_str(), response.length()+1);
+    }
+	//Start of a file sent over several flows. Layout after the code:
+	//packet count (16), size (16), digest (40), flows (2), name. The
+	//reply names the port of each flow; a repeat of the request for
+	//the session already running gets the same reply.
+	else if(incoming[0] == STRIPE_REQ) {
+
+        if (incoming.length() < 76 or !sizeFieldsValid(incoming.data() + 1, incoming.data() + 17))
+            return;
+
+        struct initialPacket pckt1;
+
+        pckt1.packetType = STRIPE_REQ;
+        memcpy(pckt1.numPackets, incoming.data() + 1, 16);
+        memcpy(pckt1.fileSize, incoming.data() + 17, 16);
+        memcpy(pckt1.fileDigest, incoming.data() + 33, SHA_DIGEST_LENGTH * 2);
+        int numStripes = getNumber(incoming.data() + 73, 2);
+        strncpy(pckt1.filename, incoming.substr(75).c_str(), MAX_FILE_NAME);
+
+        if (!safeRelativePath(pckt1.filename) or numStripes < 1) {
+            c150debug->printf(C150ALWAYSLOG,"Refusing unsafe file name \"%s\"",
+                    pckt1.filename);
+            return;
+        }
+
+        //A repeat for a file whose flows have finished is not dropped
+        //but answered with no ports, as a client waiting on it sends
+        //the file unstriped, and that start is answered as done
+        string startKey = string(pckt1.fileDigest, SHA_DIGEST_LENGTH * 2) + pckt1.filename;
+        if (startKey != s -> lastStarted) {
+            if (s -> activeStripes != NULL)
+                finishStripes(s);
+            s -> lastCopied.clear();
+
+            //Without its sockets the file is not started, and the empty
+            //port list tells the client to send it unstriped instead
+            if (startStripes(s, &pckt1, numStripes, targetDir)) {
+                s -> lastStarted = startKey;
+                *GRADING << "File: " << pckt1.filename << " starting to receive file" << endl;
+            }
+        }
+
+        string ports = s -> activeStripes != NULL and s -> activeStripes -> key == startKey ? s -> activeStripes -> ports : "";
+        string response = STRIPE_ACK + string(pckt1.filename) + ":" + ports;
+        FCLOG_MSG(FCLOG_FILE, "Responding with message", 0, 0, response.data(), response.length());
+        sessionWrite(s, response.c_str(), response.length()+1);
+    }
+}
+
+/* Function takes in the client's session and information about the file
+ * and returns a status code 
  * Status code: 2 for success
  *				3 for failure
  */
-int endCheck(string file_name, string file_hash, string directory) {
-    // Allocate SHA-1 buffer
-    char *sha1 = (char *) calloc((SHA_DIGEST_LENGTH * 2) + 1, 1);
+int endCheck(struct clientSession *s, string file_name, string file_hash, string directory) {
     
     file_name = directory + "/" + file_name;
     const char *filename = file_name.c_str();
@@ -392,109 +935,180 @@ int endCheck(string file_name, string file_hash, string directory) {
             return 4;
         } 
 
-	// Check the given file against the given sha1
-    sha1file(filename, sha1);
+	// Check the given file against the given digest. The digest kept while
+	// the file was received is used unless it is incomplete or --verify=full
+	// asks for the file to be read again
+    struct digestValue expected, actual;
+    if (file_hash.length() < DIGEST_HEX_LENGTH or !fromHex(file_hash.c_str(), expected))
+        return 3;
+    //A file whose data may not have reached the disk is never kept
+    if (file_name == directory + "/" + s -> receivedDigestName and !s -> receivedSynced)
+        return 3;
+    bool cached = !verifyFull and file_name == directory + "/" + s -> receivedDigestName and
+        s -> receivedDigest.finish(actual);
+    if (!cached and !digestFile(filename, fileNasty, actual, s -> digest))
+        return 3;
 
     // Return 2 if the files are the same
 	// Return 3 if they are different
-    if (string(sha1) == file_hash)
+    if (actual == expected)
         return 2;
     else 
         return 3;
 }
 
-/* Function takes in a filename and a sha1 buffer and does not return anything
- * Produces a SHA of the file given by the filename and puts that SHA value
- * into the given buffer.
+/* Function takes in a client's session, the start packet of a file small
+ * enough to arrive in that one message, its data, and the target
+ * directory. Writes the file,
+ * checks it against the digest from the start packet and, if it matches,
+ * renames it into place, all without another message from the client.
+ * Returns FILE_OK or FILE_BAD.
  */
 
-void sha1file(const char *filename, char *sha1) {
+char copySingle(struct clientSession *s, struct initialPacket* pckt1, string chunk, string directory) {
 
-	//
-	// Declare variables
-	//
-	unsigned char * buffer;
-	C150NastyFile nastyFile(fileNasty);
-	unsigned char temp[SHA_DIGEST_LENGTH];
-	char ostr[(SHA_DIGEST_LENGTH * 2) + 1];
+    string file_path = directory + "/" + pckt1->filename;
+    long fileSize = stol(string(pckt1->fileSize, 16));
+    vector<struct writeDone> written;
 
-	//
-	// Zero-initalize buffers
-	//
-	memset(ostr, 0, (SHA_DIGEST_LENGTH * 2) + 1); // Human-readable SHA-1 digest
-	memset(temp, 0, SHA_DIGEST_LENGTH);	// Raw SHA-1 digest buffer
+    *GRADING << "File: " << pckt1->filename << " starting to receive file" << endl;
+    metricsFileStart();
 
-	//
-	// Open file, read from file, get SHA-1 digest
-	//
-	void *ret = nastyFile.fopen(filename, "r");
-	if (ret == NULL) {
-		perror("Cannot open file.");
-		exit(1);
-	}
-	int fsize = 0;
-	nastyFile.fseek(0, SEEK_END);
-	fsize = nastyFile.ftell();
-	buffer = (unsigned char *) malloc(fsize);
-	nastyFile.rewind();
-	fsize = nastyFile.fread(buffer, 1, fsize);
-	nastyFile.fclose();
-	
-    SHA1(buffer, fsize, temp);
-	
-	//
-	// Write the SHA-1 digest bytes in human-readable form to a string
-	// Taken from website https://memset.wordpress.com/2010/10/06/using-sha1-function/
-	//
-	for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        sprintf((char*)&(ostr[i*2]), "%02x", temp[i]);
+    makeParentDirs(directory, pckt1->filename);
+    int fd = s -> storage -> open(file_path + ".tmp", fileSize);
+    if (!chunk.empty()) {
+        threadMetrics().packets++;
+        threadMetrics().bytes += chunk.length();
+        s -> storage -> write(fd, 1, 0, chunk.data(), chunk.length());
+        s -> storage -> reap(written, true);
     }
+    bool synced = s -> storage -> close(fd) == 0;
 
-	//
-	// Copy human-readable output string to function user-returned variable
-	//
-	memcpy(sha1, ostr, (SHA_DIGEST_LENGTH * 2) + 1);
+    *GRADING << "File: " << pckt1->filename << " received, beginning end-to-end check" << endl;
 
-	//
-	// Free alloc'd memory
-	//
-	free(buffer);
+    struct digestValue expected, actual;
+    bool same = synced and (long) chunk.length() == fileSize and fromHex(pckt1->fileDigest, expected) and
+            digestFile((file_path + ".tmp").c_str(), fileNasty, actual, s -> digest) and actual == expected;
+
+    metricsFileDone(pckt1->filename, same);
+    if (!same) {
+        *GRADING << "File: " << pckt1->filename << " end-to-end check failed" << endl;
+        return FILE_BAD;
+    }
+
+    *GRADING << "File: " << pckt1->filename << " end-to-end check succeeded" << endl;
+    if(s -> storage -> rename(file_path + ".tmp", file_path))
+        cerr << "Could not rename file\n" << endl;
+    return FILE_OK;
+}
+
+/* Function takes in a zero range, first to last, already clipped to the
+ * packets being received, the engine and descriptor of the target, and
+ * the state of each packet, indexed from packet base, and the digest kept
+ * of the file. The target was
+ * created empty at its full size, so the range reads as zeros already:
+ * its packets not seen yet are marked written and verified without a
+ * write, and its blocks are handed back. Returns how many were marked.
+ */
+
+static int markZeros(StorageEngine *engine, int fd, long first, long last, vector<char>& received, long base,
+                     PrefixDigest& digest) {
+
+    int marked = 0;
+    for (long p = first; p <= last; p++) {
+        if (received[p - base] != 0)
+            continue;
+        received[p - base] = 1;
+        digest.written(p);
+        marked++;
+    }
+    if (marked > 0)
+        engine -> zero(fd, (off_t) (MAX_DATA_SIZE - 1) * (first - 1),
+                       (off_t) (MAX_DATA_SIZE - 1) * (last - first + 1));
+    return marked;
+}
+
+/* Function takes in a control message, null terminated, of len bytes.
+ * Returns the name of the file it starts if it is a START_FCP, INIT_FCP or
+ * STRIPE_REQ, and "" otherwise.
+ */
+
+static string startedFile(const char *msg, ssize_t len) {
+
+    if (msg[0] == START_FCP and len > 77) {
+        long nameLen = getNumber(msg + 73, 3);
+        if (nameLen > 0 and 77 + nameLen <= len)
+            return string(msg + 77, nameLen);
+    } else if (msg[0] == INIT_FCP and len > 33) {
+        return string(msg + 33);
+    } else if (msg[0] == STRIPE_REQ and len > 75) {
+        return string(msg + 75);
+    }
+    return "";
 }
 
-/* Function takes in a packet struct, a socket, and a directory.
+/* Function takes in a client's session, the packet struct starting its file,
+ * and the data of packet 1 if it came inside the start message (empty
+ * otherwise).
  * Main function for reading in packets of data, reads and writes all packets
  * that client sends, and reports back to client any packets it did not receive.
+ * A coroutine on the control loop: it takes the client's messages from its
+ * own inbox, so other clients are served while it waits. Gives up on a
+ * client that has been quiet for CLIENT_IDLE_ROUNDS seconds.
  */
 
-int copyfile(struct initialPacket* pckt1, C150DgmSocket *sock, char* directory) {
+LoopTask copyfile(struct clientSession *s, struct initialPacket pckt1, string firstChunk) {
 
-    C150NastyFile currentFile(fileNasty); //Nastyfile object for file operations
     ssize_t readlen; //Readlen for checking reading length
     char incomingMessage[512]; //Incoming message buffer
-    //packetLostNum is number of packet in the sequence that was lost
-    //fileNameHash is the hash of the current file name
     //lostPacketMsg is the message sent to the client asking for a packet
     //to be sent again or saying that copying is done
-    //data is the data being sent to be written 
-	string packetLostNum, fileNameHash, lostPacketMsg, data;
-    int numPack = stoi(pckt1->numPackets); //numPack is the number of packets expected 
-    int numPacketsReceived[numPack]; //numPacketsReceived keeps track of which packets are lost
-    //Set to all zero so that no packet is accidentely seen as written when 
+    char lostPacketMsg[MAX_PACKET_SIZE];
+    size_t lostPacketLen;
+    //view is the packet just read, parsed in place in incomingMessage
+    struct dataView view;
+    //numPack is the number of packets expected, fileSize is the exact size
+    //in bytes (the fields are fixed width and not null terminated)
+    int numPack = stoi(string(pckt1.numPackets, 16));
+    long fileSize = stol(string(pckt1.fileSize, 16));
+    //numPacketsReceived keeps track of which packets are lost, indexed by
+    //packet number: 0 not seen, 2 handed to storage, 1 written and verified.
+    //Set to all zero so that no packet is accidentely seen as written when
     //it was not been 
-    for(int i = 0; i < numPack; i++) {
-        numPacketsReceived[i] = 0;
+    vector<char> numPacketsReceived(numPack + 1, 0);
+    int packetsQueued = 0; //Number of packets handed to storage
+    vector<struct writeDone> written; //Packets storage has verified
+
+    //Create the target once, at its final size, and keep it open for the
+    //whole transfer so every packet is a positional write into it
+    string currFileName = string(targetDir) + "/" + pckt1.filename + ".tmp";
+    makeParentDirs(targetDir, pckt1.filename);
+    int fd = s -> storage -> open(currFileName, fileSize);
+    metricsFileStart();
+    s -> metricsPending = pckt1.filename;
+    s -> receivedDigest.start(fd, numPack, fileSize, MAX_DATA_SIZE - 1, s -> digest);
+    s -> receivedDigestName = string(pckt1.filename) + ".tmp";
+
+    //The client's messages come here until every packet is written
+    MessageQueue inbox(controlLoop);
+    s -> inbox = &inbox;
+    bool timedOut; //The wait for a message timed out
+    int idleRounds = 0; //Timeouts since the client was last heard
+
+    //Packet 1 may already be here, carried by the start message
+    if (!firstChunk.empty() and numPack >= 1) {
+        threadMetrics().packets++;
+        threadMetrics().bytes += firstChunk.length();
+        s -> storage -> write(fd, 1, 0, firstChunk.data(), firstChunk.length());
+        numPacketsReceived[1] = 2;
+        packetsQueued++;
     }
     
 	//
 	// Get hash of filename from initial packet for comparisons
 	//
-	char * sha1buf = (char *) malloc((SHA_DIGEST_LENGTH * 2) + 1);
-	memset(sha1buf, 0, (SHA_DIGEST_LENGTH * 2) + 1);
-
-	sha1string(pckt1 -> filename, sha1buf);
-	string initFileNameHash = string(sha1buf);
+	string initFileNameHash = nameHash(pckt1.filename, s -> digest);
 
-	string packet_type; //Checks what type of packet is being received
 	int packetNum, packetsLost; //packetNum is the current packet being read
                                 //packetsLost is the number of packets lost total
     int packetDone = 0; //Number of packets written successfully
@@ -505,195 +1119,633 @@ int copyfile(struct initialPacket* pckt1, C150DgmSocket *sock, char* directory)
 		do {
             //If the number of packets that has been successfully written is 
             //equal to or greater than the number of packets expected, don't read
+            timedOut = false;
             if(packetDone <= numPack) {
-			     readlen = sock -> read(incomingMessage, sizeof(incomingMessage)-1);
+                timedOut = !co_await inbox.next(1000);
+                readlen = inbox.pop(incomingMessage, sizeof(incomingMessage)-1);
+                if (!timedOut)
+                    idleRounds = 0;
             }
 
             //If the read times out or all packets have been received, go into 
             //to either request more packets or tell client copying is done
-            if((sock -> timedout() == true) or (packetDone >= numPack)) {
+            if(timedOut or (packetDone >= numPack)) {
+                if (timedOut)
+                    threadMetrics().timeouts++;
+                //Let every write in flight land before deciding what is lost
+                s -> storage -> reap(written, true);
+                for (auto& w : written) {
+                    numPacketsReceived[w.packetNum] = 1;
+                    packetDone++;
+                    if (w.ok)
+                        s -> receivedDigest.written(w.packetNum);
+                }
+                written.clear();
+
+                //A client gone this long is not coming back for its file
+                if (timedOut and ++idleRounds >= CLIENT_IDLE_ROUNDS) {
+                    FCLOG(FCLOG_FILE, "Client quiet for %ld seconds, dropping file", idleRounds, 0);
+                    s -> storage -> close(fd);
+                    s -> inbox = NULL;
+                    co_return;
+                }
                 packetsLost = 0;
 
                 // Loop through the checking array to see if any packets are missing
                 for (int i = 0; i < numPack; i++) {
                     if (numPacketsReceived[i+1] != 1) {
-                        cout << "yup?" << endl;
-
-                        packetLostNum = to_string(i+1);
-
-                        while(packetLostNum.length() < 16)
-                            packetLostNum = "0" + packetLostNum;
+                        FCLOG(FCLOG_PACKET, "Asking again for packet %ld", i + 1, 0);
 
                         //Create a packet that tells the client what packet was 
                         //not read
-                        lostPacketMsg = PKT_LOST + packetLostNum + fileNameHash;
+                        lostPacketLen = encodeReply(lostPacketMsg, PKT_LOST, i+1, initFileNameHash.c_str());
                         //Iterate that a packet was lost
                         packetsLost++;
+                        threadMetrics().retransmits++;
                         //Decrement because this packet was not read correctly
                         packetDone--;
-                        c150debug->printf(C150APPLICATION,"%s: Writing message: \"%s\"",
-                      						"fileclient", lostPacketMsg);
-                        sock -> write(lostPacketMsg.c_str(), lostPacketMsg.length());
+                        sessionWrite(s, lostPacketMsg, lostPacketLen);
                     }
                 }
                 //If all packets were written correctly, tell the client you are 
                 //done
                 if (packetsLost == 0) {
-                    lostPacketMsg = PKT_DONE + fileNameHash;
-                    usleep(500000);
-                    cout << "sending done" << endl;
-                    c150debug->printf(C150APPLICATION,"%s: Writing message: \"%s\"",
-                    					"fileclient", lostPacketMsg);
-                    sock -> write(lostPacketMsg.c_str(), lostPacketMsg.length());
+                    lostPacketLen = encodeReply(lostPacketMsg, PKT_DONE, -1, initFileNameHash.c_str());
+                    co_await sleepOn(controlLoop, 500);
+                    FCLOG(FCLOG_FILE, "All %ld packets written, sending done", numPack, 0);
+                    sessionWrite(s, lostPacketMsg, lostPacketLen);
+                    s -> receivedSynced = s -> storage -> close(fd) == 0;
+
+                    //Messages still queued are dropped, as before the
+                    //client's next one they are only late packets
+                    s -> inbox = NULL;
+                    s -> lastCopied = initFileNameHash;
+                    *GRADING << "File: " << pckt1.filename << " received, beginning end-to-end check" << endl;
                     //This is the only time the function should return
-                    return 0;
+                    co_return;
                 } else {
                     continue;
                 }
             }
 			if (readlen == 0) {
-				c150debug->printf(C150APPLICATION,"Read zero length message, trying again");
+				FCLOG(FCLOG_PACKET, "Read zero length message, trying again", 0, 0);
 				continue;
 			}
 
-			//
-			// Clean up the message in case it contained junk
-			//
 			incomingMessage[readlen] = '\0'; // make sure null terminated
-			string incoming(incomingMessage); // Convert to C++ string ...it's slightly
-												// easier to work with, and cleanString
-												// expects it
-			//Have to have this before it is cleaned to preserve newlines
 
-            //Ignore the packet if it is not a data packet
-            if(incoming[0] != DATA_FCP) {
-                continue;
+            //A client sends one file at a time, so the start of another
+            //means it has given up on this one. The file is dropped and the
+            //start handled as if nothing were being received
+            string started = startedFile(incomingMessage, readlen);
+            if (started != "" and started != pckt1.filename) {
+                FCLOG_MSG(FCLOG_FILE, "Client started another file, dropping", 0, 0,
+                          pckt1.filename, strlen(pckt1.filename));
+                s -> storage -> reap(written, true);
+                s -> storage -> close(fd);
+                s -> inbox = NULL;
+                s -> lastStarted.clear();
+                handleMessage(s, incomingMessage, readlen);
+                co_return;
             }
 
-            //If the packet does not contain any data do not read data
-			if(incoming.length() >= 57)
-				data = incoming.substr(57).c_str();
+            //A zero range stands for packets the client did not send, as
+            //they hold only zeros. They are done as soon as it is checked
+            long lastZero;
+            if (decodeZeroRange(incomingMessage, readlen, view, lastZero)) {
+                if (initFileNameHash.compare(0, DIGEST_HEX_LENGTH, view.fileNameHash, DIGEST_HEX_LENGTH) == 0 and
+                        dataMessageIntact(incomingMessage, readlen) and view.packetNum <= numPack) {
+                    threadMetrics().packets++;
+                    int marked = markZeros(s -> storage, fd, view.packetNum, min(lastZero, (long) numPack),
+                                           numPacketsReceived, 0, s -> receivedDigest);
+                    packetsQueued += marked;
+                    packetDone += marked;
+                }
+                sameFileName = false;
+                continue;
+            }
 
-			cleanString(incoming);            // c150ids-supplied utility: changes
-												// non-printing characters to .
+            //The packet is parsed where it lies. Anything that is not a data
+            //packet for this file is ignored (to meet invariant that one
+            //file is copied at a time)
+            sameFileName = decodeData(incomingMessage, readlen, view) and
+                    initFileNameHash.compare(0, DIGEST_HEX_LENGTH, view.fileNameHash, DIGEST_HEX_LENGTH) == 0;
+            if(!sameFileName) {
+                continue;
+            }
 
-			c150debug->printf(C150APPLICATION,"Successfully read %d bytes. Message=\"%s\"",
-						readlen, incoming.c_str());
+            //A packet damaged on the way never reaches the disk. Ask for it
+            //again straight away instead of waiting for the timeout
+            if(!dataMessageIntact(incomingMessage, readlen)) {
+                threadMetrics().corrupt++;
+                if(view.packetNum >= 1 and view.packetNum <= numPack and numPacketsReceived[view.packetNum] == 0) {
+                    threadMetrics().retransmits++;
+                    lostPacketLen = encodeReply(lostPacketMsg, PKT_LOST, view.packetNum, initFileNameHash.c_str());
+                    sessionWrite(s, lostPacketMsg, lostPacketLen);
+                }
+                sameFileName = false;
+                continue;
+            }
 
-            //Read in the packet information
-			packet_type         = incoming[0];
-			fileNameHash = incoming.substr(1, 40).c_str();
-			packetNum           = stoi(incoming.substr(41, 16));
-	
-            //Check that we are working with the correct file (to meet invariant
-            //that one file is copied at a time)
-			sameFileName = fileNameHash == initFileNameHash;
+			FCLOG(FCLOG_PACKET, "Successfully read %ld bytes of packet %ld", readlen, view.packetNum);
+			packetNum = view.packetNum;
 
-		} while(packet_type != "9" or !sameFileName); //Only taking in packets
+		} while(!sameFileName); //Only taking in packets
         //of the correct type and file
 
-        string currFileName = string(directory) + "/" + pckt1->filename + ".tmp";
+        //Ignore packet numbers outside the announced range
+        if(packetNum < 1 or packetNum > numPack) {
+            continue;
+        }
 
-        cout << "wrinting packet " << packetNum << endl;
-        fileCheck(currFileName, packetNum, currentFile, data);
-        cout << "wrote it" << endl;
+        //Duplicates of a packet already written or in flight are dropped
+        if(numPacketsReceived[packetNum] == 0) {
+            FCLOG(FCLOG_PACKET, "Writing packet %ld", packetNum, 0);
+            s -> storage -> write(fd, packetNum, (off_t) (MAX_DATA_SIZE - 1) * (packetNum - 1),
+                             view.data, view.dataLen);
+            numPacketsReceived[packetNum] = 2;
+            packetsQueued++;
+            threadMetrics().packets++;
+            threadMetrics().bytes += view.dataLen;
+        } else {
+            threadMetrics().duplicates++;
+        }
 
-        //Acknowledge that the packet was written correctly
-        if(numPacketsReceived[packetNum] != 1) {
+        //Acknowledge the packets that were written, waiting for the
+        //stragglers once the whole file has been handed to storage. One
+        //that never read back right is left out of the kept digest, so
+        //the end-to-end check reads the file again and fails it
+        s -> storage -> reap(written, packetsQueued >= numPack);
+        for (auto& w : written) {
+            numPacketsReceived[w.packetNum] = 1;
             packetDone++;
+            if (w.ok)
+                s -> receivedDigest.written(w.packetNum);
         }
-        numPacketsReceived[packetNum] = 1;
+        written.clear();
     }
-    //This return should never execute.
-    return 0;
 }
 
-/* Function takes in the current filename, the packet that is being checked,
- * the nastyfile object, and the data of the packet.
- * Writes the packet data to the file and makes sure it was written correctly.
+/* Function takes in the packet count and size fields, 16 digits each, of
+ * a message starting a file.
+ * Returns true if both are numbers and the count is the one the client
+ * sends for that size, so they can be parsed without throwing.
  */
 
-void fileCheck(string currFileName, int packetNum, C150NastyFile& currentFile, string data) {
+bool sizeFieldsValid(const char *numPackets, const char *fileSize) {
 
-    void* fileNastyCheck = calloc(MAX_DATA_SIZE-1, 1);
-    char *sha1 = (char *) calloc((SHA_DIGEST_LENGTH * 2) + 1, 1);
-    char *sha2 = (char *) calloc((SHA_DIGEST_LENGTH * 2) + 1, 1);
-    bool fileCheck = true;
+    long packets = getNumber(numPackets, 16);
+    long size = getNumber(fileSize, 16);
+    if (packets < 0 or size < 0 or packets > INT_MAX)
+        return false;
+    //An empty file still goes as one packet
+    return packets == max(numPacketsFile(size), 1);
+}
 
-    do {
-        //Check if the file exists, if it does already open it for updating,
-        //if not open it with "w" so that it is created
-        ifstream ifile(currFileName);
-        if (ifile) {
-            currentFile.fopen(currFileName.c_str(), "r+");
+/* Function takes in a file name from the client.
+ * Returns true if it is a relative path that stays inside the target
+ * directory (not absolute, no empty or ".." components).
+ */
+
+bool safeRelativePath(string path) {
+    if (path.empty() or path[0] == '/')
+        return false;
+
+    size_t start = 0;
+    while (start <= path.length()) {
+        size_t end = path.find('/', start);
+        if (end == string::npos)
+            end = path.length();
+        string part = path.substr(start, end - start);
+        if (part.empty() or part == "." or part == "..")
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+/* Function takes in the target directory and a relative file path.
+ * Creates every directory on the way to the file that does not exist yet.
+ */
+
+void makeParentDirs(string directory, string path) {
+    size_t slash = path.find('/');
+    while (slash != string::npos) {
+        string dir = directory + "/" + path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0755) != 0 and errno != EEXIST)
+            perror("Could not create directory\n");
+        slash = path.find('/', slash + 1);
+    }
+}
+
+/* Function takes in a client's session, the name of a bundle it has sent in
+ * full and the target directory. Writes every file in the bundle out as its own .tmp
+ * file and checks it against the digest in the bundle index.
+ * Returns one CHK_SUCC or CHK_FAIL per file, in index order.
+ */
+
+string unpackBundle(struct clientSession *s, string bundleName, string directory) {
+
+    string bundlePath = directory + "/" + bundleName + ".tmp";
+    ifstream bundleFile(bundlePath, ios::binary);
+    stringstream contents;
+    contents << bundleFile.rdbuf();
+    string bundle = contents.str();
+
+    //
+    // Index is one "<size> <sha1> <filename>" line per file, ended by a
+    // blank line. The file contents follow back to back.
+    //
+    size_t indexEnd = bundle.find("\n\n");
+    if (indexEnd == string::npos)
+        return "";
+    istringstream index(bundle.substr(0, indexEnd + 1));
+    size_t dataPos = indexEnd + 2;
+
+    string statuses, line;
+    vector<struct writeDone> written;
+    struct digestValue expected, actual;
+
+    while (getline(index, line)) {
+        size_t space1 = line.find(' ');
+        size_t space2 = line.find(' ', space1 + 1);
+        if (space1 == string::npos or space2 == string::npos) {
+            statuses += CHK_FAIL;
+            continue;
+        }
+
+        //A size that is not a plain number leaves every later file at an
+        //unknown offset, so the whole bundle fails
+        string sizeField = line.substr(0, space1);
+        char *end;
+        errno = 0;
+        long size = strtol(sizeField.c_str(), &end, 10);
+        if (sizeField.empty() or *end != '\0' or errno == ERANGE or size < 0 or
+                size > (long) (bundle.length() - dataPos)) {
+            size_t files = count(bundle.begin(), bundle.begin() + indexEnd + 1, '\n');
+            return string(files, CHK_FAIL);
+        }
+        string file_hash = line.substr(space1 + 1, space2 - space1 - 1);
+        string file_name = line.substr(space2 + 1);
+
+        if (!safeRelativePath(file_name) or dataPos + size > bundle.length()) {
+            statuses += CHK_FAIL;
+            dataPos += size;
+            continue;
+        }
+
+        *GRADING << "File: " << file_name << " starting to receive file" << endl;
+
+        //Same path as a file sent on its own: preallocated .tmp, verified
+        //write, then the end-to-end digest read back through the nastyfile
+        string tmpName = directory + "/" + file_name + ".tmp";
+        makeParentDirs(directory, file_name);
+        int fd = s -> storage -> open(tmpName, size);
+        if (size > 0) {
+            s -> storage -> write(fd, 1, 0, bundle.data() + dataPos, size);
+            s -> storage -> reap(written, true);
+            written.clear();
+        }
+        bool synced = s -> storage -> close(fd) == 0;
+        dataPos += size;
+
+        *GRADING << "File: " << file_name << " received, beginning end-to-end check" << endl;
+
+        bool same = synced and file_hash.length() == DIGEST_HEX_LENGTH and fromHex(file_hash.c_str(), expected) and
+                digestFile(tmpName.c_str(), fileNasty, actual, s -> digest) and actual == expected;
+        statuses += same ? CHK_SUCC : CHK_FAIL;
+    }
+
+    return statuses;
+}
+
+/* Function takes in a client's session, the name of its unpacked bundle,
+ * the statuses the client acknowledged and the target directory. Renames each file the client
+ * acknowledged as good and removes the bundle.
+ */
+
+void finishBundle(struct clientSession *s, string bundleName, string statuses, string directory) {
+
+    string bundlePath = directory + "/" + bundleName + ".tmp";
+    ifstream bundleFile(bundlePath, ios::binary);
+    string line;
+    size_t i = 0;
+
+    //Only the index is needed, it ends at the first blank line
+    while (getline(bundleFile, line) and !line.empty()) {
+        size_t space2 = line.find(' ', line.find(' ') + 1);
+        if (space2 == string::npos) {
+            i++;
+            continue;
+        }
+        string file_name = line.substr(space2 + 1);
+        string file_path = directory + "/" + file_name;
+
+        if (i < statuses.length() and statuses[i] == CHK_SUCC) {
+            *GRADING << "File: " << file_name << " end-to-end check succeeded" << endl;
+            if(s -> storage -> rename(file_path + ".tmp", file_path))
+                cerr << "Could not rename file\n" << endl;
         } else {
-            currentFile.fopen(currFileName.c_str(), "w");
+            *GRADING << "File: " << file_name << " end-to-end check failed" << endl;
         }
+        i++;
+    }
+
+    bundleFile.close();
+    unlink(bundlePath.c_str());
+}
+
+/* Moves the packets a flow's engine has written into its count. Failed
+ * ones are left out of the kept digest, as in copyfile.
+ */
+
+static void reapFlow(StorageEngine *engine, struct stripeSession *session, struct stripeFlow *flow,
+                     vector<struct writeDone>& written, vector<char>& received, int& verified, bool wait) {
+
+    engine -> reap(written, wait);
+    for (auto& w : written) {
+        received[w.packetNum - flow -> firstPacket] = 1;
+        verified++;
+        if (w.ok)
+            session -> receivedDigest -> written(w.packetNum);
+    }
+    written.clear();
+}
+
+/* Function takes in a stripe session and one of its flows. The receiver
+ * of one flow, run as a coroutine on the flow's event loop: opens a
+ * storage engine for the flow, then waits for packets on the flow's
+ * socket. New packets are written and damaged ones asked for again at
+ * once; each second with nothing good heard it asks again for what has
+ * not arrived, a window at a time, until the client has been quiet for
+ * STRIPE_IDLE_ROUNDS seconds or finishStripes stops it. Uses the same
+ * PKT_LOST/PKT_DONE messages as copyfile, replying to whichever address
+ * its packets come from.
+ */
+
+LoopTask receiveFlow(struct stripeSession *session, struct stripeFlow *flow) {
+
+    char buf[MAX_PACKET_SIZE];
+    char reply[MAX_PACKET_SIZE];
+    size_t replyLen;
+    struct dataView view;
+    const char *fileNameHash = session -> fileNameHash.c_str();
+    StorageEngine *engine = newStorageEngine(storageName, fileNasty, reorderBytes);
+    int fd = engine -> reopen(session -> tmpPath);
+    int count = flow -> lastPacket - flow -> firstPacket + 1;
+    vector<char> received(count, 0);     //0 not seen, 2 in flight, 1 verified
+    vector<struct writeDone> written;
+    int queued = 0, verified = 0, idleRounds = 0;
+    struct sockaddr_in client;
+    socklen_t clientLen = 0;             //0 until the client is heard from
+
+    {
+        SocketWaiter waiter(flow -> loop, flow -> sock);
+        flow -> waiter = &waiter;
+
+        while (!flow -> stop and idleRounds < STRIPE_IDLE_ROUNDS) {
+            if (!co_await waiter.readable(1000)) {
+                if (flow -> stop)
+                    break;
+                idleRounds++;
+                reapFlow(engine, session, flow, written, received, verified, true);
+                if (clientLen == 0 or verified == count)
+                    continue;
+                threadMetrics().timeouts++;
+                int asked = 0;
+                for (int i = 0; i < count and asked < STRIPE_LOST_WINDOW; i++) {
+                    if (received[i] != 0)
+                        continue;
+                    replyLen = encodeReply(reply, PKT_LOST, flow -> firstPacket + i, fileNameHash);
+                    sendto(flow -> sock, reply, replyLen, 0, (struct sockaddr *) &client, clientLen);
+                    asked++;
+                    threadMetrics().retransmits++;
+                }
+                continue;
+            }
 
-        //Seek to the correct place in the file (data is 399 long)
-        if (currentFile.fseek(399 * (packetNum - 1), SEEK_SET))
-            perror("fseek failed\n");
+            //Every datagram waiting is taken before the writes are reaped
+            while (1) {
+                struct sockaddr_in from;
+                socklen_t fromLen = sizeof(from);
+                ssize_t len = recvfrom(flow -> sock, buf, sizeof(buf), MSG_DONTWAIT,
+                                       (struct sockaddr *) &from, &fromLen);
+                if (len < 0)
+                    break;
+
+                long lastZero;
+                if (decodeZeroRange(buf, len, view, lastZero)) {
+                    if (memcmp(view.fileNameHash, fileNameHash, DIGEST_HEX_LENGTH) != 0 or
+                            !dataMessageIntact(buf, len) or view.packetNum < flow -> firstPacket or
+                            view.packetNum > flow -> lastPacket)
+                        continue;
+                    idleRounds = 0;
+                    client = from;
+                    clientLen = fromLen;
+                    threadMetrics().packets++;
+                    int marked = markZeros(engine, fd, view.packetNum, min(lastZero, (long) flow -> lastPacket),
+                                           received, flow -> firstPacket, *session -> receivedDigest);
+                    queued += marked;
+                    verified += marked;
+                    continue;
+                }
 
-        //Write the data to the file
-        if (currentFile.fwrite((void*) data.c_str(), 1, (size_t) data.length()) < data.length())
-            perror("Could not write to file\n");
+                if (!decodeData(buf, len, view) or
+                        memcmp(view.fileNameHash, fileNameHash, DIGEST_HEX_LENGTH) != 0)
+                    continue;
+                int packetNum = view.packetNum;
+                if (packetNum < flow -> firstPacket or packetNum > flow -> lastPacket)
+                    continue;
 
-        currentFile.fclose();
-        currentFile.fopen(currFileName.c_str(), "r+");
+                if (!dataMessageIntact(buf, len)) {
+                    threadMetrics().corrupt++;
+                    if (received[packetNum - flow -> firstPacket] == 0) {
+                        threadMetrics().retransmits++;
+                        replyLen = encodeReply(reply, PKT_LOST, packetNum, fileNameHash);
+                        sendto(flow -> sock, reply, replyLen, 0, (struct sockaddr *) &from, fromLen);
+                    }
+                    continue;
+                }
 
-        //Seek back to where the data was written.
-        if (currentFile.fseek(399 * (packetNum - 1), SEEK_SET))
-           perror("fseek failed\n");
+                idleRounds = 0;
+                client = from;
+                clientLen = fromLen;
+
+                if (received[packetNum - flow -> firstPacket] == 0) {
+                    engine -> write(fd, packetNum, (off_t) (MAX_DATA_SIZE - 1) * (packetNum - 1),
+                                    view.data, view.dataLen);
+                    received[packetNum - flow -> firstPacket] = 2;
+                    queued++;
+                    threadMetrics().packets++;
+                    threadMetrics().bytes += view.dataLen;
+                } else {
+                    threadMetrics().duplicates++;
+                }
+            }
 
-       //Read back the data that was just written
-        if(currentFile.fread(fileNastyCheck, 1, (size_t) data.length()) < data.length())
-           perror("Could not read from file\n");
+            reapFlow(engine, session, flow, written, received, verified, queued >= count);
 
-        sha1string((char*) fileNastyCheck, sha1);
-        sha1string(data.c_str(), sha2);
+            //Repeated for every batch after the last packet, in case a done is lost
+            if (verified == count and clientLen != 0) {
+                replyLen = encodeReply(reply, PKT_DONE, -1, fileNameHash);
+                sendto(flow -> sock, reply, replyLen, 0, (struct sockaddr *) &client, clientLen);
+            }
+        }
 
-        //Compare the values what was written to check if write messed up 
-        if(string(sha1) == string(sha2)) 
-           fileCheck = false;
+        flow -> waiter = NULL;
+    }
 
-        currentFile.fclose();
-    } while(fileCheck == true);
+    reapFlow(engine, session, flow, written, received, verified, true);
+    flow -> synced = engine -> close(fd) == 0;
+    delete engine;
 
-    free(sha1);
-    free(sha2);
-    free(fileNastyCheck);
+    //The counters go to the file, which the main thread finishes
+    metricsFlushThread();
+    flow -> done = true;
 }
 
-/* Function takes in an input and a sha1 buffer.
- * Gets the sha value of the given input and puts the sha value into the 
- * sha buffer given as the second argument.
+/* Stops a flow's receiver, if it is still running, and tells finishStripes,
+ * which may be waiting for the last flow. Runs on the flow's loop, so
+ * the receiver has returned by the time the count goes down.
  */
 
-void sha1string(const char *input, char *sha1) {
-	//
-	// Declare variables
-	//
-	unsigned char temp[SHA_DIGEST_LENGTH];
-	char ostr[(SHA_DIGEST_LENGTH * 2) + 1];
+static void stopFlow(struct stripeSession *session, struct stripeFlow *flow) {
 
-	//
-	// Zero-initalize buffers
-	//
-	memset(ostr, 0, (SHA_DIGEST_LENGTH * 2) + 1); // Human-readable SHA-1 digest
-	memset(temp, 0, SHA_DIGEST_LENGTH);	// Raw SHA-1 digest buffer
+    if (!flow -> done) {
+        flow -> stop = true;
+        flow -> waiter -> wake();
+    }
 
-    SHA1((const unsigned char *) input, strlen(input), temp);
-	
-	//
-	// Write the SHA-1 digest bytes in human-readable form to a string
-	// Taken from website https://memset.wordpress.com/2010/10/06/using-sha1-function/
-	//
-	for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-        sprintf((char*)&(ostr[i*2]), "%02x", temp[i]);
+    lock_guard<mutex> guard(session -> lock);
+    session -> flowsRunning--;
+    session -> flowsDone.notify_all();
+}
+
+/* Function takes in a client's session, the start packet of a striped file,
+ * the number of flows the client asked for, and the target directory. Opens a socket on a free
+ * port for each flow, preallocates the file and starts the receivers.
+ * The packets are split into contiguous runs, one per flow, the same way
+ * the client splits them.
+ * Returns false, with nothing left open, if a flow has no socket.
+ */
+
+bool startStripes(struct clientSession *s, struct initialPacket* pckt1, int numStripes, string directory) {
+
+    struct stripeSession *session = new struct stripeSession;
+    int numPack = stoi(string(pckt1->numPackets, 16));
+    long fileSize = stol(string(pckt1->fileSize, 16));
+
+    if (numStripes > STRIPE_MAX)
+        numStripes = STRIPE_MAX;
+    if (numStripes > numPack)
+        numStripes = numPack;
+
+
+    session -> key = string(pckt1->fileDigest, SHA_DIGEST_LENGTH * 2) + pckt1->filename;
+    session -> filename = pckt1 -> filename;
+    session -> fileNameHash = nameHash(pckt1 -> filename, s -> digest);
+    session -> tmpPath = directory + "/" + pckt1->filename + ".tmp";
+    session -> receivedDigest = &s -> receivedDigest;
+    session -> flowsRunning = 0;
+
+    int perStripe = (numPack + numStripes - 1) / numStripes;
+    for (int i = 0; i < numStripes; i++) {
+        struct stripeFlow *flow = new struct stripeFlow;
+        flow -> firstPacket = 1 + i * perStripe;
+        flow -> lastPacket  = min(numPack, (i + 1) * perStripe);
+        if (flow -> firstPacket > flow -> lastPacket) {
+            delete flow;
+            break;
+        }
+
+        //Any free port will do, the client learns it from the reply
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = 0;
+        flow -> sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (flow -> sock < 0 or bind(flow -> sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 or
+                getsockname(flow -> sock, (struct sockaddr *) &addr, &addrLen) != 0) {
+            perror("Could not open stripe socket");
+            if (flow -> sock >= 0)
+                close(flow -> sock);
+            delete flow;
+            for (auto opened : session -> flows) {
+                close(opened -> sock);
+                delete opened;
+            }
+            delete session;
+            return false;
+        }
+
+        if (!session -> ports.empty())
+            session -> ports += ",";
+        session -> ports += to_string(ntohs(addr.sin_port));
+
+        session -> flows.push_back(flow);
     }
 
-	//
-	// Copy human-readable output string to function user-returned variable
-	//
-	memcpy(sha1, ostr, (SHA_DIGEST_LENGTH * 2) + 1);
-}
\ No newline at end of file
+    metricsFileStart();
+    s -> metricsPending = session -> filename;
+
+    makeParentDirs(directory, pckt1->filename);
+    session -> fd = s -> storage -> open(session -> tmpPath, fileSize);
+    s -> receivedDigest.start(session -> fd, numPack, fileSize, MAX_DATA_SIZE - 1, s -> digest);
+    s -> receivedDigestName = session -> filename + ".tmp";
+
+    //Flows are started once the list is complete, as they count down
+    //flowsRunning from their loops when stopped
+    session -> flowsRunning = session -> flows.size();
+    for (auto flow : session -> flows) {
+        flow -> loop = flowLoops -> next();
+        flow -> stop = flow -> done = false;
+        flow -> synced = true;
+        flow -> waiter = NULL;
+        flow -> loop -> post([session, flow]() { receiveFlow(session, flow); });
+    }
+
+    s -> activeStripes = session;
+    return true;
+}
+
+/* Function takes in a client's session. Stops the receivers of its striped
+ * file, waits for them and releases the stripe session. Called when the client asks for the file's
+ * end-to-end check, by which point every flow has reported done.
+ */
+
+void finishStripes(struct clientSession *s) {
+
+    struct stripeSession *session = s -> activeStripes;
+    s -> activeStripes = NULL;
+
+    for (auto flow : session -> flows)
+        flow -> loop -> post([session, flow]() { stopFlow(session, flow); });
+    {
+        unique_lock<mutex> guard(session -> lock);
+        session -> flowsDone.wait(guard, [session]() { return session -> flowsRunning == 0; });
+    }
+    bool synced = true;
+    for (auto flow : session -> flows) {
+        synced = synced and flow -> synced;
+        close(flow -> sock);
+        delete flow;
+    }
+    s -> receivedSynced = s -> storage -> close(session -> fd) == 0 and synced;
+    s -> lastCopied = session -> fileNameHash;
+
+    *GRADING << "File: " << session -> filename << " received, beginning end-to-end check" << endl;
+    delete session;
+}
+
+/* Function takes in the signals that stop the server. Runs on a thread of
+ * its own: waits for one, writes the run's metrics and exits.
+ */
+
+void waitForStop(sigset_t stopSignals) {
+    int sig;
+    sigwait(&stopSignals, &sig);
+    metricsRunDone();
+    exit(0);
+}
@@ -3,56 +3,462 @@
 //
 //           Author: Noah Mendelsohn
 //
-//     A simple program to fill a file with numbers
+//     A simple program to fill a file with numbers, grown into a
+//     generator for test corpora.
+//
+//     COMMAND LINE
+//
+//         makedatafile <filename> <linesToWrite>
+//
+//             The original form: linesToWrite lines of ten numbers,
+//             each right aligned in 6 columns and followed by a space,
+//             counting up from 0. Output is byte for byte what it
+//             always was.
+//
+//         makedatafile --file=<path> --size=<bytes> [options]
+//
+//             One file of exactly size bytes.
+//
+//         makedatafile --tree=<dir> --files=<n> [options]
+//
+//             n files spread over a directory tree, with sizes drawn
+//             from --sizes.
+//
+//     OPTIONS
+//
+//         --profile=text      the numbered lines above (compressible)
+//         --profile=random    incompressible pseudo-random bytes
+//         --profile=dup       random 64K blocks, --dup of them copies
+//                             of earlier blocks
+//         --profile=sparse    zeros, left as holes, with a small random
+//                             island every megabyte
+//         --dup=<fraction>    share of duplicated blocks, default 0.5
+//         --sizes=fixed:S | uniform:MIN:MAX | pareto:MIN:ALPHA
+//                             file size distribution for --tree
+//         --depth=<d>         directory levels below dir, default 2
+//         --fanout=<f>        subdirectories per directory, default 4
+//         --threads=<n>       generator threads, default all cores
+//         --seed=<s>          same seed, same bytes; default 1
+//
+//     Sizes take K, M or G suffixes. Every byte is a function of the
+//     seed and its position, so large files are cut into chunks that
+//     threads fill in their own buffers and write with one pwrite
+//     each, in any order.
 //
 
 #include <string>
-#include <fstream>
-#include <sstream>
-#include <iomanip>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 using namespace std;
 
-int
-main(int argc, char *argv[]) {
+#define NUMBERSPERLINE 10
+#define NUMBERWIDTH    6               // setw of each number; wider numbers widen the line
+#define CHUNKBYTES     (8 << 20)       // unit of work for one thread
+#define DUPBLOCK       65536           // duplication granularity of the dup profile
+#define SPARSESTRIDE   (1 << 20)       // one island per this many bytes
+#define SPARSEISLAND   4096
 
-  int linesToWrite;
-  int lineNumber;
-  int numberNumber;
-  int outputNumber =0;
-  char *filename;
-  int NUMBERSPERLINE=10;
+enum profileType { TEXT, RANDOM, DUP, SPARSE };
+
+struct options {
+  profileType profile = TEXT;
+  double dupFraction = 0.5;
+  uint64_t seed = 1;
+  int threads = 0;
+};
+
+static struct options opts;
+
+//
+// splitmix64: a good 64-bit mix of a counter, so any byte can be
+// produced without generating the ones before it
+//
+static uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Random bytes for [offset, offset + len) of a stream named by key
+static void fillRandom(char *buf, uint64_t offset, size_t len, uint64_t key) {
+  size_t i = 0;
+  while (i < len) {
+    uint64_t word = mix(key ^ mix((offset + i) / 8));
+    size_t start = (offset + i) % 8;
+    size_t n = min(len - i, 8 - start);
+    memcpy(buf + i, (char *) &word + start, n);
+    i += n;
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     The numbered text profile
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+//
+// Bytes taken by the numbers 0 .. count-1, each padded to
+// NUMBERWIDTH and followed by a space
+//
+static uint64_t numbersBytes(uint64_t count) {
+  uint64_t bytes = 0, low = 0, high = 1000000;   // numbers below 10^6 are 6 wide
+  int width = NUMBERWIDTH;
+  while (low < count) {
+    uint64_t n = min(count, high) - low;
+    bytes += n * (width + 1);
+    low = high;
+    high *= 10;
+    width++;
+  }
+  return bytes;
+}
+
+// Where line starts in the file
+static uint64_t lineOffset(uint64_t line) {
+  return numbersBytes(line * NUMBERSPERLINE) + line;
+}
+
+// Formats lines [first, last) into buf, returns the bytes written
+static size_t formatLines(char *buf, uint64_t first, uint64_t last) {
+  char *p = buf;
+  uint64_t number = first * NUMBERSPERLINE;
+  for (uint64_t line = first; line < last; line++) {
+    for (int i = 0; i < NUMBERSPERLINE; i++, number++) {
+      char digits[24];
+      int n = 0;
+      uint64_t v = number;
+      do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+      } while (v > 0);
+      for (int pad = n; pad < NUMBERWIDTH; pad++)
+        *p++ = ' ';
+      while (n > 0)
+        *p++ = digits[--n];
+      *p++ = ' ';
+    }
+    *p++ = '\n';
+  }
+  return p - buf;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     Writing files
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+static void writeAll(int fd, const char *buf, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n <= 0) {
+      perror("makedatafile: write failed");
+      exit(4);
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+}
+
+//
+// Fills chunk [offset, offset + len) of a file of the given profile.
+// The file key makes different files of a tree different.
+//
+static void writeChunk(int fd, vector<char>& buf, uint64_t offset, size_t len, uint64_t key) {
+
+  buf.resize(len);
+
+  if (opts.profile == RANDOM) {
+    fillRandom(buf.data(), offset, len, key);
+  } else if (opts.profile == DUP) {
+    //Each block is either its own random block or a copy of an
+    //earlier one, decided by the block number alone
+    for (size_t done = 0; done < len; ) {
+      uint64_t pos = offset + done;
+      uint64_t block = pos / DUPBLOCK;
+      uint64_t source = block;
+      uint64_t h = mix(key ^ mix(block ^ 0x5555));
+      if (block > 0 and (h % 1000000) < opts.dupFraction * 1000000)
+        source = (h >> 20) % block;
+      size_t n = min((uint64_t) len - done, (block + 1) * DUPBLOCK - pos);
+      fillRandom(buf.data() + done, source * DUPBLOCK + pos % DUPBLOCK, n, key);
+      done += n;
+    }
+  } else if (opts.profile == SPARSE) {
+    //Only the islands are written, the rest stays a hole
+    uint64_t island = (offset + SPARSESTRIDE - 1) / SPARSESTRIDE * SPARSESTRIDE;
+    for (; island < offset + len; island += SPARSESTRIDE) {
+      size_t n = min((uint64_t) SPARSEISLAND, offset + len - island);
+      fillRandom(buf.data(), island, n, key);
+      writeAll(fd, buf.data(), n, island);
+    }
+    return;
+  }
+  writeAll(fd, buf.data(), len, offset);
+}
+
+//
+// Numbered text cut to size bytes, in chunks of whole lines
+//
+static void textChunks(int fd, uint64_t size, int threads) {
 
-  if (argc != 3) {
-    fprintf(stderr,"Correct syntax is %s <filename> <linesToWrite>\n", argv[0]);
-    exit (4);
+  uint64_t lo = 0, hi = size + 1;      // first line starting at or past size
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (lineOffset(mid) < size)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  uint64_t lines = lo;
 
-  filename = argv[1];
-  linesToWrite = atoi(argv[2]);
+  uint64_t linesPerChunk = max<uint64_t>(1, CHUNKBYTES / (NUMBERSPERLINE * (NUMBERWIDTH + 1) + 1));
+  uint64_t chunks = (lines + linesPerChunk - 1) / linesPerChunk;
+  atomic<uint64_t> next(0);
 
-  if (linesToWrite <= 0) {
-    fprintf(stderr,"Correct syntax is %s <filename> <linesToWrite>\n", argv[0]);    
-    exit (4);
+  auto worker = [&]() {
+    vector<char> buf;
+    uint64_t c;
+    while ((c = next++) < chunks) {
+      uint64_t first = c * linesPerChunk, last = min(lines, first + linesPerChunk);
+      buf.resize((last - first) * (NUMBERSPERLINE * 21 + 1));   // 20 digits, space
+      size_t len = formatLines(buf.data(), first, last);
+      uint64_t offset = lineOffset(first);
+      if (offset + len > size)
+        len = size - offset;
+      writeAll(fd, buf.data(), len, offset);
+    }
+  };
+
+  vector<thread> pool;
+  for (int i = 1; i < threads and (uint64_t) i < chunks; i++)
+    pool.push_back(thread(worker));
+  worker();
+  for (auto& t : pool)
+    t.join();
+}
+
+//
+// Creates path at exactly size bytes of the current profile, using up
+// to threads threads
+//
+static void makeFile(string path, uint64_t size, uint64_t key, int threads) {
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(("makedatafile: cannot create " + path).c_str());
+    exit(4);
+  }
+  if (ftruncate(fd, size) != 0) {
+    perror("makedatafile: cannot size file");
+    exit(4);
+  }
+
+  if (opts.profile == TEXT) {
+    textChunks(fd, size, threads);
+  } else {
+    uint64_t chunks = (size + CHUNKBYTES - 1) / CHUNKBYTES;
+    atomic<uint64_t> next(0);
+    auto worker = [&]() {
+      vector<char> buf;
+      uint64_t c;
+      while ((c = next++) < chunks) {
+        uint64_t offset = c * CHUNKBYTES;
+        writeChunk(fd, buf, offset, min((uint64_t) CHUNKBYTES, size - offset), key);
+      }
+    };
+    vector<thread> pool;
+    for (int i = 1; i < threads and (uint64_t) i < chunks; i++)
+      pool.push_back(thread(worker));
+    worker();
+    for (auto& t : pool)
+      t.join();
   }
+  close(fd);
+}
 
-  printf("Writing %d lines to file %s\n", linesToWrite, filename);
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+//
+//                     Directory trees
+//
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-  ofstream of(filename);
+static uint64_t parseSize(const char *text) {
+  char *end;
+  double v = strtod(text, &end);
+  switch (*end) {
+    case 'K': case 'k': v *= 1024; break;
+    case 'M': case 'm': v *= 1024 * 1024; break;
+    case 'G': case 'g': v *= 1024.0 * 1024 * 1024; break;
+  }
+  return (uint64_t) v;
+}
 
-  outputNumber = 0;
+//
+// Size of file i under a distribution spec, the same for the same seed
+//
+static uint64_t drawSize(string spec, uint64_t i) {
+  mt19937_64 rng(mix(opts.seed ^ mix(i)));
+  vector<string> parts;
+  size_t start = 0, colon;
+  while ((colon = spec.find(':', start)) != string::npos) {
+    parts.push_back(spec.substr(start, colon - start));
+    start = colon + 1;
+  }
+  parts.push_back(spec.substr(start));
 
-  for (lineNumber = 0; lineNumber < linesToWrite; lineNumber++) {
-    for (numberNumber = 0; numberNumber< NUMBERSPERLINE; numberNumber++) {
-      of << setw(6) << (outputNumber++) << ' '; 
+  if (parts[0] == "fixed" and parts.size() == 2)
+    return parseSize(parts[1].c_str());
+  if (parts[0] == "uniform" and parts.size() == 3) {
+    uint64_t lo = parseSize(parts[1].c_str()), hi = parseSize(parts[2].c_str());
+    return lo + rng() % (hi - lo + 1);
+  }
+  if (parts[0] == "pareto" and parts.size() == 3) {
+    //Heavy tailed: most files near MIN, a few very large
+    double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+    return (uint64_t) (parseSize(parts[1].c_str()) / pow(1.0 - u, 1.0 / atof(parts[2].c_str())));
+  }
+  fprintf(stderr, "makedatafile: bad size distribution %s\n", spec.c_str());
+  exit(4);
+}
+
+static void makeTree(string dir, uint64_t files, string sizes, int depth, int fanout, int threads) {
+
+  //Every directory of the tree, breadth first; files go round them
+  vector<string> dirs = {dir};
+  mkdir(dir.c_str(), 0755);
+  for (size_t i = 0; i < dirs.size(); i++) {
+    int level = count(dirs[i].begin() + dir.length(), dirs[i].end(), '/');
+    if (level >= depth)
+      continue;
+    for (int f = 0; f < fanout; f++) {
+      string sub = dirs[i] + "/d" + to_string(f);
+      if (mkdir(sub.c_str(), 0755) != 0 and errno != EEXIST) {
+        perror(("makedatafile: cannot create " + sub).c_str());
+        exit(4);
+      }
+      dirs.push_back(sub);
+    }
+  }
+
+  //Small files are many: one file per thread at a time
+  atomic<uint64_t> next(0), bytes(0);
+  auto worker = [&]() {
+    uint64_t i;
+    while ((i = next++) < files) {
+      uint64_t size = drawSize(sizes, i);
+      makeFile(dirs[i % dirs.size()] + "/file" + to_string(i), size, mix(opts.seed + i), 1);
+      bytes += size;
     }
-    of << endl;
+  };
+  vector<thread> pool;
+  for (int i = 1; i < threads; i++)
+    pool.push_back(thread(worker));
+  worker();
+  for (auto& t : pool)
+    t.join();
+
+  printf("Wrote %llu files, %llu bytes in %zu directories under %s\n",
+         (unsigned long long) files, (unsigned long long) bytes.load(), dirs.size(), dir.c_str());
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,"Correct syntax is %s <filename> <linesToWrite>\n"
+                 "   or %s --file=<path> --size=<bytes> [options]\n"
+                 "   or %s --tree=<dir> --files=<n> [--sizes=dist] [--depth=d] [--fanout=f] [options]\n"
+                 "options: --profile=text|random|dup|sparse --dup=fraction --threads=n --seed=s\n",
+          program, program, program);
+  exit (4);
+}
+
+int
+main(int argc, char *argv[]) {
+
+  int linesToWrite;
+  char *filename;
+
+  opts.threads = max(1u, thread::hardware_concurrency());
+
+  //
+  // The original two-argument form
+  //
+  if (argc == 3 and argv[1][0] != '-') {
+    filename = argv[1];
+    linesToWrite = atoi(argv[2]);
+
+    if (linesToWrite <= 0)
+      usage(argv[0]);
+
+    printf("Writing %d lines to file %s\n", linesToWrite, filename);
+    makeFile(filename, lineOffset(linesToWrite), opts.seed, opts.threads);
+    printf("Wrote %d lines to file %s\n", linesToWrite, filename);
+    return 0;
   }
 
-  of.close();
+  string file, tree, sizes = "fixed:64K";
+  uint64_t size = 0, files = 0;
+  int depth = 2, fanout = 4;
+  bool haveSize = false;
 
-  printf("Wrote %d lines to file %s\n", linesToWrite, filename);
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    string value = arg.find('=') == string::npos ? "" : arg.substr(arg.find('=') + 1);
+    if (arg.compare(0, 7, "--file=") == 0)
+      file = value;
+    else if (arg.compare(0, 7, "--size=") == 0) {
+      size = parseSize(value.c_str());
+      haveSize = true;
+    } else if (arg.compare(0, 7, "--tree=") == 0)
+      tree = value;
+    else if (arg.compare(0, 8, "--files=") == 0)
+      files = strtoull(value.c_str(), NULL, 10);
+    else if (arg.compare(0, 8, "--sizes=") == 0)
+      sizes = value;
+    else if (arg.compare(0, 8, "--depth=") == 0)
+      depth = atoi(value.c_str());
+    else if (arg.compare(0, 9, "--fanout=") == 0)
+      fanout = atoi(value.c_str());
+    else if (arg.compare(0, 10, "--threads=") == 0)
+      opts.threads = max(1, atoi(value.c_str()));
+    else if (arg.compare(0, 7, "--seed=") == 0)
+      opts.seed = strtoull(value.c_str(), NULL, 10);
+    else if (arg.compare(0, 6, "--dup=") == 0)
+      opts.dupFraction = atof(value.c_str());
+    else if (arg == "--profile=text")
+      opts.profile = TEXT;
+    else if (arg == "--profile=random")
+      opts.profile = RANDOM;
+    else if (arg == "--profile=dup")
+      opts.profile = DUP;
+    else if (arg == "--profile=sparse")
+      opts.profile = SPARSE;
+    else
+      usage(argv[0]);
+  }
 
-  
+  if (!file.empty() and haveSize and tree.empty()) {
+    makeFile(file, size, opts.seed, opts.threads);
+    printf("Wrote %llu bytes to file %s\n", (unsigned long long) size, file.c_str());
+  } else if (!tree.empty() and files > 0 and file.empty()) {
+    makeTree(tree, files, sizes, depth, fanout, opts.threads);
+  } else {
+    usage(argv[0]);
+  }
+  return 0;
 }